@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#include "control.h"
+#include "tfmux.h"
+
+//
+// processes listing round trip, control socket against http api
+//
+//   tfmux-bench <control socket> [host] [port] [iterations]
+//
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void report(const char *name, int iterations, double elapsed) {
+    printf("%-24s %8d requests  %10.2f us/request\n", name, iterations, elapsed / iterations);
+}
+
+static int bench_control(const char *path, int iterations) {
+    tfmux_reply_t reply;
+    tfmux_t *tfmux;
+
+    if(!(tfmux = tfmux_connect(path))) {
+        perror("tfmux_connect");
+        return 1;
+    }
+
+    double start = now();
+
+    for(int i = 0; i < iterations; i++) {
+        if(tfmux_wait(tfmux, tfmux_send(tfmux, CONTROL_LIST, NULL, 0), &reply)) {
+            fprintf(stderr, "control: %s\n", tfmux_error(tfmux));
+            return 1;
+        }
+    }
+
+    report("control", iterations, now() - start);
+
+    // every request sent before reading any reply
+    uint32_t *tags = malloc(sizeof(uint32_t) * iterations);
+    start = now();
+
+    for(int i = 0; i < iterations; i++)
+        tags[i] = tfmux_send(tfmux, CONTROL_LIST, NULL, 0);
+
+    for(int i = 0; i < iterations; i++) {
+        if(tfmux_wait(tfmux, tags[i], &reply)) {
+            fprintf(stderr, "control: %s\n", tfmux_error(tfmux));
+            return 1;
+        }
+    }
+
+    report("control (pipelined)", iterations, now() - start);
+
+    free(tags);
+    tfmux_close(tfmux);
+
+    return 0;
+}
+
+static int http_connect(const char *host, const char *port) {
+    struct addrinfo hints, *result;
+    int fd = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+
+    if(getaddrinfo(host, port, &hints, &result))
+        return -1;
+
+    for(struct addrinfo *ai = result; ai; ai = ai->ai_next) {
+        if((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+            continue;
+
+        if(connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+
+        close(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(result);
+
+    return fd;
+}
+
+// read one response on a keep-alive connection, body is skipped
+static int http_response(int fd, char *buffer, size_t size) {
+    size_t length = 0;
+    char *end = NULL;
+
+    while(!end) {
+        ssize_t n = read(fd, buffer + length, size - length - 1);
+        if(n <= 0)
+            return 1;
+
+        length += n;
+        buffer[length] = '\0';
+        end = strstr(buffer, "\r\n\r\n");
+    }
+
+    char *header = strcasestr(buffer, "content-length:");
+    size_t body = header ? strtoul(header + 15, NULL, 10) : 0;
+    size_t received = length - (end + 4 - buffer);
+
+    while(received < body) {
+        ssize_t n = read(fd, buffer, size);
+        if(n <= 0)
+            return 1;
+
+        received += n;
+    }
+
+    return 0;
+}
+
+static int bench_http(const char *host, const char *port, int iterations) {
+    char request[256], buffer[65536];
+    int fd;
+
+    if((fd = http_connect(host, port)) < 0) {
+        fprintf(stderr, "http: could not connect to %s:%s\n", host, port);
+        return 1;
+    }
+
+    int length = snprintf(request, sizeof(request), "GET /api/processes HTTP/1.1\r\nHost: %s\r\n\r\n", host);
+    double start = now();
+
+    for(int i = 0; i < iterations; i++) {
+        if(write(fd, request, length) != length || http_response(fd, buffer, sizeof(buffer))) {
+            fprintf(stderr, "http: request failed\n");
+            return 1;
+        }
+    }
+
+    report("http (keep-alive)", iterations, now() - start);
+    close(fd);
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if(argc < 2) {
+        fprintf(stderr, "usage: %s <control socket> [host] [port] [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    const char *host = argc > 2 ? argv[2] : "localhost";
+    const char *port = argc > 3 ? argv[3] : "7681";
+    int iterations = argc > 4 ? atoi(argv[4]) : 10000;
+
+    if(bench_control(argv[1], iterations))
+        return 1;
+
+    return bench_http(host, port, iterations);
+}
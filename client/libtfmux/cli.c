@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "tfmux.h"
+
+#define DEFAULT_SOCKET "/run/tfmux.ctl"
+#define DETACH_KEY 0x1d            // ctrl-]
+
+//
+// tfmux command line client
+//
+//   tfmux [-s socket] list
+//   tfmux [-s socket] attach <id>
+//
+static volatile sig_atomic_t resized = 1;
+static bool removed = false;
+static struct termios saved;
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-s socket] list\n", name);
+    fprintf(stderr, "       %s [-s socket] attach <id>\n\n", name);
+    fprintf(stderr, "socket defaults to $TFMUX_CONTROL or %s, detach with ctrl-]\n", DEFAULT_SOCKET);
+}
+
+static int command_list(tfmux_t *tfmux) {
+    tfmux_process_t *processes;
+    size_t count;
+
+    if(tfmux_list(tfmux, &processes, &count)) {
+        fprintf(stderr, "[-] list: %s\n", tfmux_error(tfmux));
+        return 1;
+    }
+
+    printf("%-6s %-8s %-10s %-16s %s\n", "ID", "PID", "STATE", "NAME", "COMMAND");
+
+    for(size_t i = 0; i < count; i++) {
+        tfmux_process_t *process = &processes[i];
+        printf("%-6lu %-8d %-10s %-16s %s\n", process->id, process->pid,
+                tfmux_state_name(process->state), process->name, process->command);
+    }
+
+    tfmux_list_free(processes, count);
+
+    return 0;
+}
+
+//
+// attach
+//
+static void attach_output(uint64_t id, const char *data, size_t length, void *userdata) {
+    if(!data) {
+        removed = true;
+        return;
+    }
+
+    while(length > 0) {
+        ssize_t n = write(STDOUT_FILENO, data, length);
+
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+
+            return;
+        }
+
+        data += n;
+        length -= n;
+    }
+}
+
+static void attach_winch(int signum) {
+    resized = 1;
+}
+
+static void attach_restore() {
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &saved);
+}
+
+static int attach_resize(tfmux_t *tfmux, uint64_t id) {
+    struct winsize size;
+
+    resized = 0;
+
+    if(ioctl(STDIN_FILENO, TIOCGWINSZ, &size) < 0 || size.ws_col == 0 || size.ws_row == 0)
+        return 0;
+
+    return tfmux_resize(tfmux, id, size.ws_col, size.ws_row);
+}
+
+static int command_attach(tfmux_t *tfmux, uint64_t id) {
+    struct sigaction action;
+    struct termios raw;
+    char buffer[4096];
+    int value = 0;
+
+    if(!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &saved) < 0) {
+        fprintf(stderr, "[-] attach: stdin is not a terminal\n");
+        return 1;
+    }
+
+    // interrupted poll is how window changes are noticed
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = attach_winch;
+    sigaction(SIGWINCH, &action, NULL);
+
+    if(attach_resize(tfmux, id) || tfmux_subscribe(tfmux, id, attach_output, NULL)) {
+        fprintf(stderr, "[-] attach: %s\n", tfmux_error(tfmux));
+        return 1;
+    }
+
+    raw = saved;
+    cfmakeraw(&raw);
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+    atexit(attach_restore);
+
+    struct pollfd fds[2] = {
+        { .fd = STDIN_FILENO, .events = POLLIN },
+        { .fd = tfmux_fd(tfmux), .events = POLLIN },
+    };
+
+    while(!removed) {
+        if(resized && attach_resize(tfmux, id)) {
+            value = 1;
+            break;
+        }
+
+        if(poll(fds, 2, -1) < 0) {
+            if(errno == EINTR)
+                continue;
+
+            value = 1;
+            break;
+        }
+
+        if(fds[1].revents && tfmux_poll(tfmux, 0) < 0) {
+            value = 1;
+            break;
+        }
+
+        if(!fds[0].revents)
+            continue;
+
+        ssize_t n = read(STDIN_FILENO, buffer, sizeof(buffer));
+        if(n <= 0)
+            break;
+
+        char *detach = memchr(buffer, DETACH_KEY, n);
+        if(detach)
+            n = detach - buffer;
+
+        if(n > 0 && tfmux_input(tfmux, id, buffer, n)) {
+            value = 1;
+            break;
+        }
+
+        if(detach)
+            break;
+    }
+
+    attach_restore();
+
+    if(value)
+        fprintf(stderr, "\r\n[-] attach: %s\r\n", tfmux_error(tfmux));
+    else if(removed)
+        fprintf(stderr, "\r\n[+] process removed\r\n");
+    else
+        fprintf(stderr, "\r\n[+] detached\r\n");
+
+    return value;
+}
+
+int main(int argc, char **argv) {
+    const char *path = getenv("TFMUX_CONTROL") ? getenv("TFMUX_CONTROL") : DEFAULT_SOCKET;
+    tfmux_t *tfmux;
+    int opt, value;
+
+    while((opt = getopt(argc, argv, "s:h")) != -1) {
+        switch(opt) {
+            case 's':
+                path = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if(optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if(!(tfmux = tfmux_connect(path))) {
+        fprintf(stderr, "[-] %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    if(strcmp(argv[optind], "list") == 0) {
+        value = command_list(tfmux);
+
+    } else if(strcmp(argv[optind], "attach") == 0 && optind + 1 < argc) {
+        value = command_attach(tfmux, strtoull(argv[optind + 1], NULL, 10));
+
+    } else {
+        usage(argv[0]);
+        value = 1;
+    }
+
+    tfmux_close(tfmux);
+
+    return value;
+}
@@ -0,0 +1,646 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "control.h"
+#include "tfmux.h"
+
+typedef struct tfmux_subscription {
+    uint32_t tag;                  // subscribe request tag
+    uint64_t id;                   // subscribed process
+    tfmux_output_cb callback;
+    void *userdata;
+
+} tfmux_subscription;
+
+struct tfmux {
+    int fd;
+    uint32_t tag;                  // last request tag
+    char *payload;                 // last frame payload
+    size_t size;                   // payload buffer size
+    char error[256];               // last error message
+    int fds[2];                    // descriptors received, not yet claimed
+    int received;
+    tfmux_subscription *subscriptions;
+    size_t count;
+};
+
+static char *states[] = {"created", "starting", "running", "stopping", "stopped", "crashed", "restarting"};
+
+const char *tfmux_state_name(int state) {
+    if(state < 0 || state >= (int) (sizeof(states) / sizeof(char *)))
+        return "unknown";
+
+    return states[state];
+}
+
+tfmux_t *tfmux_connect(const char *path) {
+    struct sockaddr_un address;
+    tfmux_t *tfmux;
+
+    if(strlen(path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+
+    if(!(tfmux = calloc(1, sizeof(tfmux_t))))
+        return NULL;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    if((tfmux->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        free(tfmux);
+        return NULL;
+    }
+
+    if(connect(tfmux->fd, (struct sockaddr *) &address, sizeof(address)) < 0) {
+        int error = errno;
+
+        close(tfmux->fd);
+        free(tfmux);
+
+        errno = error;
+        return NULL;
+    }
+
+    return tfmux;
+}
+
+static void tfmux_fds_close(tfmux_t *tfmux) {
+    for(int i = 0; i < tfmux->received; i++)
+        close(tfmux->fds[i]);
+
+    tfmux->received = 0;
+}
+
+void tfmux_close(tfmux_t *tfmux) {
+    tfmux_fds_close(tfmux);
+    close(tfmux->fd);
+    free(tfmux->payload);
+    free(tfmux->subscriptions);
+    free(tfmux);
+}
+
+int tfmux_fd(tfmux_t *tfmux) {
+    return tfmux->fd;
+}
+
+const char *tfmux_error(tfmux_t *tfmux) {
+    return tfmux->error;
+}
+
+static int tfmux_fail(tfmux_t *tfmux, const char *message) {
+    snprintf(tfmux->error, sizeof(tfmux->error), "%s", message);
+    return -1;
+}
+
+//
+// frames
+//
+// descriptors come along with a share reply
+static void tfmux_fds_collect(tfmux_t *tfmux, struct msghdr *message) {
+    struct cmsghdr *cmsg;
+
+    for(cmsg = CMSG_FIRSTHDR(message); cmsg; cmsg = CMSG_NXTHDR(message, cmsg)) {
+        if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+
+        int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int *fds = (int *) CMSG_DATA(cmsg);
+
+        tfmux_fds_close(tfmux);
+
+        for(int i = 0; i < count; i++) {
+            if(i < 2)
+                tfmux->fds[tfmux->received++] = fds[i];
+            else
+                close(fds[i]);
+        }
+    }
+}
+
+static int tfmux_read(tfmux_t *tfmux, void *target, size_t length) {
+    char control[CMSG_SPACE(sizeof(int) * 2)];
+    struct msghdr message;
+    struct iovec iov;
+    size_t done = 0;
+
+    while(done < length) {
+        iov.iov_base = (char *) target + done;
+        iov.iov_len = length - done;
+
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        ssize_t n = recvmsg(tfmux->fd, &message, MSG_CMSG_CLOEXEC);
+
+        if(n < 0 && errno == EINTR)
+            continue;
+
+        if(n <= 0)
+            return tfmux_fail(tfmux, n == 0 ? "connection closed" : strerror(errno));
+
+        if(message.msg_controllen > 0)
+            tfmux_fds_collect(tfmux, &message);
+
+        done += n;
+    }
+
+    return 0;
+}
+
+static int tfmux_frame(tfmux_t *tfmux, control_header *header) {
+    if(tfmux_read(tfmux, header, sizeof(control_header)))
+        return -1;
+
+    if(header->length > tfmux->size) {
+        char *payload;
+
+        if(!(payload = realloc(tfmux->payload, header->length)))
+            return tfmux_fail(tfmux, "out of memory");
+
+        tfmux->payload = payload;
+        tfmux->size = header->length;
+    }
+
+    return tfmux_read(tfmux, tfmux->payload, header->length);
+}
+
+static tfmux_subscription *tfmux_subscription_lookup(tfmux_t *tfmux, uint32_t tag) {
+    for(size_t i = 0; i < tfmux->count; i++)
+        if(tfmux->subscriptions[i].tag == tag)
+            return &tfmux->subscriptions[i];
+
+    return NULL;
+}
+
+static void tfmux_subscription_remove(tfmux_t *tfmux, tfmux_subscription *subscription) {
+    *subscription = tfmux->subscriptions[--tfmux->count];
+}
+
+// output and closed frames are handled here, returns 0 if the
+// frame is a reply to a request
+static int tfmux_dispatch(tfmux_t *tfmux, control_header *header) {
+    tfmux_subscription *subscription;
+
+    if(header->type != CONTROL_OUTPUT && header->type != CONTROL_CLOSED)
+        return 0;
+
+    if(!(subscription = tfmux_subscription_lookup(tfmux, header->tag)))
+        return 1;
+
+    if(header->type == CONTROL_OUTPUT) {
+        subscription->callback(subscription->id, tfmux->payload, header->length, subscription->userdata);
+        return 1;
+    }
+
+    // process removed, nothing more will come
+    tfmux_subscription copy = *subscription;
+    tfmux_subscription_remove(tfmux, subscription);
+    copy.callback(copy.id, NULL, 0, copy.userdata);
+
+    return 1;
+}
+
+//
+// requests
+//
+static uint32_t tfmux_sendv(tfmux_t *tfmux, uint8_t type, struct iovec *iov, int count) {
+    control_header header;
+    struct iovec vector[4];
+    size_t length = 0;
+    size_t total;
+
+    for(int i = 0; i < count; i++)
+        length += iov[i].iov_len;
+
+    memset(&header, 0, sizeof(header));
+    header.length = length;
+    header.tag = ++tfmux->tag ? tfmux->tag : ++tfmux->tag;
+    header.type = type;
+
+    vector[0].iov_base = &header;
+    vector[0].iov_len = sizeof(header);
+    memcpy(vector + 1, iov, sizeof(struct iovec) * count);
+    count += 1;
+    total = sizeof(header) + length;
+
+    struct iovec *current = vector;
+
+    while(total > 0) {
+        ssize_t n = writev(tfmux->fd, current, count);
+
+        if(n < 0 && errno == EINTR)
+            continue;
+
+        if(n < 0) {
+            tfmux_fail(tfmux, strerror(errno));
+            return 0;
+        }
+
+        total -= n;
+
+        // partial write, skipping what was sent
+        while(count > 0 && (size_t) n >= current->iov_len) {
+            n -= current->iov_len;
+            current++;
+            count--;
+        }
+
+        if(count > 0) {
+            current->iov_base = (char *) current->iov_base + n;
+            current->iov_len -= n;
+        }
+    }
+
+    return header.tag;
+}
+
+uint32_t tfmux_send(tfmux_t *tfmux, uint8_t type, const void *payload, size_t length) {
+    struct iovec iov = { .iov_base = (void *) payload, .iov_len = length };
+    return tfmux_sendv(tfmux, type, &iov, 1);
+}
+
+uint32_t tfmux_send_id(tfmux_t *tfmux, uint8_t type, uint64_t id, const void *data, size_t length) {
+    struct iovec iov[2] = {
+        { .iov_base = &id, .iov_len = sizeof(id) },
+        { .iov_base = (void *) data, .iov_len = length },
+    };
+
+    return tfmux_sendv(tfmux, type, iov, 2);
+}
+
+int tfmux_wait(tfmux_t *tfmux, uint32_t tag, tfmux_reply_t *reply) {
+    control_header header;
+
+    if(tag == 0)
+        return -1;
+
+    while(1) {
+        if(tfmux_frame(tfmux, &header))
+            return -1;
+
+        if(tfmux_dispatch(tfmux, &header))
+            continue;
+
+        // replies come in requests order
+        if(header.tag != tag)
+            return tfmux_fail(tfmux, "unexpected reply");
+
+        break;
+    }
+
+    reply->tag = header.tag;
+    reply->type = header.type;
+    reply->payload = tfmux->payload;
+    reply->length = header.length;
+
+    if(header.type == CONTROL_ERROR) {
+        snprintf(tfmux->error, sizeof(tfmux->error), "%.*s", (int) header.length, tfmux->payload);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int tfmux_call_id(tfmux_t *tfmux, uint8_t type, uint64_t id, tfmux_reply_t *reply) {
+    return tfmux_wait(tfmux, tfmux_send_id(tfmux, type, id, NULL, 0), reply);
+}
+
+int tfmux_start(tfmux_t *tfmux, char **argv, uint64_t *id, int32_t *pid) {
+    control_started started;
+    tfmux_reply_t reply;
+    size_t length = 0;
+
+    for(int i = 0; argv[i]; i++)
+        length += strlen(argv[i]) + 1;
+
+    if(length == 0)
+        return tfmux_fail(tfmux, "missing argv");
+
+    char *payload;
+    if(!(payload = malloc(length)))
+        return tfmux_fail(tfmux, "out of memory");
+
+    char *ptr = payload;
+    for(int i = 0; argv[i]; i++)
+        ptr = stpcpy(ptr, argv[i]) + 1;
+
+    uint32_t tag = tfmux_send(tfmux, CONTROL_START, payload, length);
+    free(payload);
+
+    if(tfmux_wait(tfmux, tag, &reply))
+        return -1;
+
+    if(reply.length < sizeof(started))
+        return tfmux_fail(tfmux, "invalid reply");
+
+    memcpy(&started, reply.payload, sizeof(started));
+
+    if(id)
+        *id = started.id;
+
+    if(pid)
+        *pid = started.pid;
+
+    return 0;
+}
+
+int tfmux_stop(tfmux_t *tfmux, uint64_t id) {
+    tfmux_reply_t reply;
+    return tfmux_call_id(tfmux, CONTROL_STOP, id, &reply);
+}
+
+int tfmux_list(tfmux_t *tfmux, tfmux_process_t **processes, size_t *count) {
+    tfmux_process_t *list = NULL;
+    control_process entry;
+    tfmux_reply_t reply;
+    size_t offset = 0;
+
+    *processes = NULL;
+    *count = 0;
+
+    if(tfmux_wait(tfmux, tfmux_send(tfmux, CONTROL_LIST, NULL, 0), &reply))
+        return -1;
+
+    while(reply.length - offset >= sizeof(entry)) {
+        memcpy(&entry, reply.payload + offset, sizeof(entry));
+        offset += sizeof(entry);
+
+        if(reply.length - offset < (size_t) entry.name_length + entry.command_length)
+            break;
+
+        tfmux_process_t *grown;
+        if(!(grown = realloc(list, sizeof(tfmux_process_t) * (*count + 1)))) {
+            tfmux_list_free(list, *count);
+            *count = 0;
+            return tfmux_fail(tfmux, "out of memory");
+        }
+
+        list = grown;
+
+        tfmux_process_t *process = &list[*count];
+        process->id = entry.id;
+        process->pid = entry.pid;
+        process->state = entry.state;
+        process->running = entry.running;
+        process->name = strndup(reply.payload + offset, entry.name_length);
+        process->command = strndup(reply.payload + offset + entry.name_length, entry.command_length);
+
+        offset += entry.name_length + entry.command_length;
+        *count += 1;
+    }
+
+    *processes = list;
+
+    return 0;
+}
+
+void tfmux_list_free(tfmux_process_t *processes, size_t count) {
+    for(size_t i = 0; i < count; i++) {
+        free(processes[i].name);
+        free(processes[i].command);
+    }
+
+    free(processes);
+}
+
+int tfmux_logs(tfmux_t *tfmux, uint64_t id, char **buffer, size_t *length) {
+    tfmux_reply_t reply;
+
+    if(tfmux_call_id(tfmux, CONTROL_LOGS, id, &reply))
+        return -1;
+
+    // keeping room for a terminating null byte
+    if(!(*buffer = malloc(reply.length + 1)))
+        return tfmux_fail(tfmux, "out of memory");
+
+    memcpy(*buffer, reply.payload, reply.length);
+    (*buffer)[reply.length] = '\0';
+    *length = reply.length;
+
+    return 0;
+}
+
+int tfmux_input(tfmux_t *tfmux, uint64_t id, const void *data, size_t length) {
+    tfmux_reply_t reply;
+    return tfmux_wait(tfmux, tfmux_send_id(tfmux, CONTROL_INPUT, id, data, length), &reply);
+}
+
+int tfmux_subscribe(tfmux_t *tfmux, uint64_t id, tfmux_output_cb callback, void *userdata) {
+    tfmux_subscription *subscriptions;
+    tfmux_reply_t reply;
+    uint32_t tag;
+
+    if(!(tag = tfmux_send_id(tfmux, CONTROL_SUBSCRIBE, id, NULL, 0)))
+        return -1;
+
+    if(!(subscriptions = realloc(tfmux->subscriptions, sizeof(tfmux_subscription) * (tfmux->count + 1))))
+        return tfmux_fail(tfmux, "out of memory");
+
+    // registered before the reply, output follows it right away
+    tfmux->subscriptions = subscriptions;
+    tfmux->subscriptions[tfmux->count++] = (tfmux_subscription) {
+        .tag = tag,
+        .id = id,
+        .callback = callback,
+        .userdata = userdata,
+    };
+
+    if(tfmux_wait(tfmux, tag, &reply)) {
+        tfmux_subscription *subscription;
+
+        if((subscription = tfmux_subscription_lookup(tfmux, tag)))
+            tfmux_subscription_remove(tfmux, subscription);
+
+        return -1;
+    }
+
+    return 0;
+}
+
+int tfmux_unsubscribe(tfmux_t *tfmux, uint64_t id) {
+    tfmux_reply_t reply;
+
+    if(tfmux_call_id(tfmux, CONTROL_UNSUBSCRIBE, id, &reply))
+        return -1;
+
+    for(size_t i = 0; i < tfmux->count; i++) {
+        if(tfmux->subscriptions[i].id == id) {
+            tfmux_subscription_remove(tfmux, &tfmux->subscriptions[i]);
+            break;
+        }
+    }
+
+    return 0;
+}
+
+int tfmux_resize(tfmux_t *tfmux, uint64_t id, uint16_t cols, uint16_t rows) {
+    control_size size = { .cols = cols, .rows = rows };
+    tfmux_reply_t reply;
+
+    return tfmux_wait(tfmux, tfmux_send_id(tfmux, CONTROL_RESIZE, id, &size, sizeof(size)), &reply);
+}
+
+//
+// shared output ring
+//
+int tfmux_share(tfmux_t *tfmux, uint64_t id, tfmux_ring_t *ring) {
+    tfmux_reply_t reply;
+    struct stat st;
+
+    tfmux_fds_close(tfmux);
+
+    if(tfmux_call_id(tfmux, CONTROL_SHARE, id, &reply))
+        return -1;
+
+    if(tfmux->received != 2)
+        return tfmux_fail(tfmux, "descriptors not received");
+
+    int memfd = tfmux->fds[0];
+    ring->event = tfmux->fds[1];
+    tfmux->received = 0;
+
+    if(fstat(memfd, &st) < 0 || st.st_size <= CONTROL_RING_HEADER) {
+        close(memfd);
+        close(ring->event);
+        return tfmux_fail(tfmux, "invalid shared ring");
+    }
+
+    void *memory = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, memfd, 0);
+    close(memfd);
+
+    if(memory == MAP_FAILED) {
+        close(ring->event);
+        return tfmux_fail(tfmux, strerror(errno));
+    }
+
+    ring->header = (const control_ring *) memory;
+    ring->data = (const char *) memory + CONTROL_RING_HEADER;
+    ring->length = st.st_size - CONTROL_RING_HEADER;
+
+    if(ring->header->magic != CONTROL_RING_MAGIC || ring->header->length != ring->length) {
+        tfmux_ring_close(ring);
+        return tfmux_fail(tfmux, "invalid shared ring");
+    }
+
+    return 0;
+}
+
+void tfmux_ring_close(tfmux_ring_t *ring) {
+    munmap((void *) ring->header, CONTROL_RING_HEADER + ring->length);
+    close(ring->event);
+}
+
+// consistent snapshot of the available range
+static void tfmux_ring_state(tfmux_ring_t *ring, uint64_t *first, uint64_t *written) {
+    const control_ring *header = ring->header;
+    uint64_t before, after, reserved;
+
+    do {
+        before = __atomic_load_n(&header->sequence, __ATOMIC_ACQUIRE);
+        *written = __atomic_load_n(&header->written, __ATOMIC_RELAXED);
+        reserved = __atomic_load_n(&header->reserved, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&header->sequence, __ATOMIC_RELAXED);
+
+    } while((before & 1) || before != after);
+
+    *first = (*written + reserved > ring->length) ? *written + reserved - ring->length : 0;
+}
+
+size_t tfmux_ring_read(tfmux_ring_t *ring, uint64_t *offset, char *target, size_t length) {
+    uint64_t first, written;
+
+    while(1) {
+        tfmux_ring_state(ring, &first, &written);
+
+        if(*offset < first)
+            *offset = first;
+
+        if(*offset >= written)
+            return 0;
+
+        size_t n = (written - *offset < length) ? written - *offset : length;
+        size_t position = *offset % ring->length;
+        size_t remain = ring->length - position;
+
+        if(remain >= n) {
+            memcpy(target, ring->data + position, n);
+
+        } else {
+            memcpy(target, ring->data + position, remain);
+            memcpy(target + remain, ring->data, n - remain);
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        // writer went past us while copying, starting again
+        // from what is still available
+        tfmux_ring_state(ring, &first, &written);
+
+        if(*offset >= first) {
+            *offset += n;
+            return n;
+        }
+    }
+}
+
+int tfmux_ring_wait(tfmux_ring_t *ring, int timeout) {
+    struct pollfd pfd = { .fd = ring->event, .events = POLLIN };
+    uint64_t value;
+    int n;
+
+    while((n = poll(&pfd, 1, timeout)) < 0 && errno == EINTR)
+        ;
+
+    if(n <= 0)
+        return n;
+
+    // counter is reset, wakeups are coalesced
+    if(read(ring->event, &value, sizeof(value)) < 0 && errno != EAGAIN)
+        return -1;
+
+    return 1;
+}
+
+int tfmux_poll(tfmux_t *tfmux, int timeout) {
+    struct pollfd pfd = { .fd = tfmux->fd, .events = POLLIN };
+    control_header header;
+    int dispatched = 0;
+    int n;
+
+    // only the first wait is blocking, then pending frames are drained
+    while((n = poll(&pfd, 1, dispatched ? 0 : timeout)) != 0) {
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+
+            return tfmux_fail(tfmux, strerror(errno));
+        }
+
+        if(tfmux_frame(tfmux, &header))
+            return -1;
+
+        if(!tfmux_dispatch(tfmux, &header))
+            return tfmux_fail(tfmux, "unexpected reply");
+
+        dispatched += 1;
+    }
+
+    return dispatched;
+}
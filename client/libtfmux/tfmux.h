@@ -0,0 +1,95 @@
+#ifndef LIBTFMUX_H
+#define LIBTFMUX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+//
+// tfmux control socket client
+//
+// calls are synchronous, output of subscribed processes received
+// while waiting for a reply is dispatched to the subscription callback,
+// requests can be pipelined with tfmux_send then tfmux_wait
+//
+typedef struct tfmux tfmux_t;
+
+// called with NULL data once the process is removed
+typedef void (*tfmux_output_cb)(uint64_t id, const char *data, size_t length, void *userdata);
+
+typedef struct tfmux_process {
+    uint64_t id;
+    int32_t pid;
+    int state;                     // see tfmux_state_name
+    int running;
+    char *name;                    // empty if unnamed
+    char *command;
+
+} tfmux_process_t;
+
+// process output ring mapped from shared memory
+typedef struct tfmux_ring {
+    const struct control_ring *header;
+    const char *data;              // ring data
+    size_t length;                 // ring data size
+    int event;                     // eventfd signaled on new output, while connected
+
+} tfmux_ring_t;
+
+typedef struct tfmux_reply {
+    uint32_t tag;
+    uint8_t type;                  // CONTROL_OK or CONTROL_ERROR
+    char *payload;                 // valid until the next call
+    size_t length;
+
+} tfmux_reply_t;
+
+// connect to the server control socket, NULL on error (errno is set)
+tfmux_t *tfmux_connect(const char *path);
+void tfmux_close(tfmux_t *tfmux);
+
+// connection descriptor, readable when output is pending
+int tfmux_fd(tfmux_t *tfmux);
+
+// last error message sent by the server
+const char *tfmux_error(tfmux_t *tfmux);
+
+// process state name from its numeric value
+const char *tfmux_state_name(int state);
+
+// all calls return 0 on success, -1 on error
+int tfmux_start(tfmux_t *tfmux, char **argv, uint64_t *id, int32_t *pid);
+int tfmux_stop(tfmux_t *tfmux, uint64_t id);
+int tfmux_list(tfmux_t *tfmux, tfmux_process_t **processes, size_t *count);
+void tfmux_list_free(tfmux_process_t *processes, size_t count);
+int tfmux_logs(tfmux_t *tfmux, uint64_t id, char **buffer, size_t *length);
+int tfmux_input(tfmux_t *tfmux, uint64_t id, const void *data, size_t length);
+int tfmux_subscribe(tfmux_t *tfmux, uint64_t id, tfmux_output_cb callback, void *userdata);
+int tfmux_unsubscribe(tfmux_t *tfmux, uint64_t id);
+int tfmux_resize(tfmux_t *tfmux, uint64_t id, uint16_t cols, uint16_t rows);
+
+// map the output ring of a process, reads are then done without
+// any request nor syscall, the ring stays valid once the process
+// is removed, until closed, new output is signaled as long as the
+// connection is kept open
+int tfmux_share(tfmux_t *tfmux, uint64_t id, tfmux_ring_t *ring);
+void tfmux_ring_close(tfmux_ring_t *ring);
+
+// copy output from offset, which is moved to the oldest data still
+// available if needed then past the data copied, returns bytes copied
+size_t tfmux_ring_read(tfmux_ring_t *ring, uint64_t *offset, char *target, size_t length);
+
+// wait up to timeout ms for new output (-1: forever), returns 1 if
+// new output was signaled, 0 on timeout, -1 on error
+int tfmux_ring_wait(tfmux_ring_t *ring, int timeout);
+
+// dispatch pending output, waiting up to timeout ms (-1: forever),
+// returns frames dispatched or -1 on error
+int tfmux_poll(tfmux_t *tfmux, int timeout);
+
+// pipelining, send returns the request tag (0 on error), replies
+// have to be waited for in the same order requests were sent
+uint32_t tfmux_send(tfmux_t *tfmux, uint8_t type, const void *payload, size_t length);
+uint32_t tfmux_send_id(tfmux_t *tfmux, uint8_t type, uint64_t id, const void *data, size_t length);
+int tfmux_wait(tfmux_t *tfmux, uint32_t tag, tfmux_reply_t *reply);
+
+#endif //LIBTFMUX_H
@@ -0,0 +1,55 @@
+# generate html.h from index.html with precompressed variants
+#
+#   cmake -DSOURCE_DIR=<src> -DXXD=<xxd> -DGZIP=<gzip> [-DBROTLI=<brotli>] -P html.cmake
+#
+# html.h provides index_html (identity), index_html_gz (gzip) and, when
+# brotli is available, index_html_br with INDEX_HTML_BROTLI defined,
+# INDEX_HTML_HASH is the content hash used as strong etag
+
+set(INPUT ${SOURCE_DIR}/index.html)
+set(OUTPUT ${SOURCE_DIR}/html.h)
+
+file(SHA256 ${INPUT} HASH)
+string(SUBSTRING ${HASH} 0 16 HASH)
+
+file(WRITE ${OUTPUT} "// generated from index.html, do not edit\n")
+file(APPEND ${OUTPUT} "#define INDEX_HTML_HASH \"${HASH}\"\n")
+
+macro(embed FILENAME)
+    execute_process(COMMAND ${XXD} -i ${FILENAME}
+            WORKING_DIRECTORY ${SOURCE_DIR}
+            OUTPUT_VARIABLE EMBEDDED
+            RESULT_VARIABLE RET)
+    if(NOT "${RET}" STREQUAL "0")
+        message(FATAL_ERROR "xxd failed on ${FILENAME}")
+    endif()
+    file(APPEND ${OUTPUT} "${EMBEDDED}")
+endmacro()
+
+embed(index.html)
+
+# gzip is mandatory, every browser supports it
+if(NOT GZIP)
+    message(FATAL_ERROR "gzip is needed to embed index.html")
+endif()
+
+execute_process(COMMAND ${GZIP} -9 -n -c index.html
+        WORKING_DIRECTORY ${SOURCE_DIR}
+        OUTPUT_FILE ${SOURCE_DIR}/index.html.gz
+        RESULT_VARIABLE RET)
+if(NOT "${RET}" STREQUAL "0")
+    message(FATAL_ERROR "gzip failed on index.html")
+endif()
+
+embed(index.html.gz)
+file(REMOVE ${SOURCE_DIR}/index.html.gz)
+
+if(BROTLI)
+    execute_process(COMMAND ${BROTLI} -q 11 -c index.html
+            WORKING_DIRECTORY ${SOURCE_DIR}
+            OUTPUT_FILE ${SOURCE_DIR}/index.html.br)
+
+    file(APPEND ${OUTPUT} "#define INDEX_HTML_BROTLI\n")
+    embed(index.html.br)
+    file(REMOVE ${SOURCE_DIR}/index.html.br)
+endif()
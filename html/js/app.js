@@ -178,7 +178,19 @@ var terminalContainer = document.getElementById('terminal-container'),
     textEncoder = new TextEncoder(),
     authToken = (typeof tty_auth_token !== 'undefined') ? tty_auth_token : null,
     autoReconnect = -1,
-    reconnectTimer, term, title, wsError;
+    latencyEnabled = /[?&]latency=1/.test(window.location.search),
+    reconnectTimer, pingTimer, latencyView, term, title, wsError;
+
+// round-trip latency display, opt-in with ?latency=1
+var showLatency = function(rtt) {
+    if (!latencyView) {
+        latencyView = document.createElement('div');
+        latencyView.style.cssText = 'position: fixed; top: 4px; right: 8px; z-index: 10; padding: 2px 6px;'
+            + 'font: 11px monospace; color: #d2d2d2; background: rgba(0, 0, 0, 0.6); border-radius: 3px;';
+        document.body.appendChild(latencyView);
+    }
+    latencyView.textContent = 'rtt ' + rtt.toFixed(1) + ' ms';
+};
 
 var openWs = function() {
     var path = window.location.pathname;
@@ -193,6 +205,11 @@ var openWs = function() {
     var sendData = function (data) {
         sendMessage('0' + data);
     };
+    var lastRtt = null;
+    var sendPing = function () {
+        // previous round-trip is reported to the server
+        sendMessage('2' + JSON.stringify({t: performance.now(), rtt: lastRtt}));
+    };
     var unloadCallback = function (event) {
         var message = 'Close terminal? this will also terminate the command.';
         (event || window.event).returnValue = message;
@@ -312,6 +329,12 @@ var openWs = function() {
         term.winptyCompatInit();
         term.fit();
         term.focus();
+
+        if (latencyEnabled) {
+            clearInterval(pingTimer);
+            pingTimer = setInterval(sendPing, 2000);
+            sendPing();
+        }
     };
 
     ws.onmessage = function(event) {
@@ -343,6 +366,11 @@ var openWs = function() {
                 autoReconnect = JSON.parse(textDecoder.decode(data));
                 console.log('Enabling reconnect: ' + autoReconnect + ' seconds');
                 break;
+            case '4':
+                var pong = JSON.parse(textDecoder.decode(data));
+                lastRtt = performance.now() - pong.t;
+                showLatency(lastRtt);
+                break;
             default:
                 console.log('Unknown command: ' + cmd);
                 break;
@@ -351,6 +379,7 @@ var openWs = function() {
 
     ws.onclose = function(event) {
         console.log('Websocket connection closed with code: ' + event.code);
+        clearInterval(pingTimer);
         if (term) {
             term.off('data');
             term.off('resize');
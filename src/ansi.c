@@ -0,0 +1,204 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <libwebsockets.h>
+
+#include "server.h"
+
+//
+// ansi escapes
+//
+// terminal output is full of escape sequences (colors, cursor moves,
+// titles), they are dropped to get the text a user actually sees,
+// sequences handled: CSI (ESC [ ... final), OSC (ESC ] ... BEL or ST),
+// DCS, SOS, PM, APC (ESC P|X|^|_ ... ST) and two bytes escapes
+//
+// most of the output is plain text between escapes, runs of plain
+// text are found 16 bytes at a time and copied at once
+//
+typedef enum ansi_state {
+    ANSI_TEXT,
+    ANSI_ESCAPE,                   // ESC received
+    ANSI_CSI,                      // control sequence parameters
+    ANSI_STRING,                   // string until ST (or BEL for OSC)
+    ANSI_STRING_ESCAPE,            // ESC within a string, maybe ST
+
+} ansi_state;
+
+// length of the run without ESC (and without carriage return or
+// backspace when controls is set)
+static size_t ansi_run(const char *source, size_t length, bool controls) {
+    size_t i = 0;
+
+#ifdef __SSE2__
+    const __m128i escape = _mm_set1_epi8(0x1b);
+    const __m128i cr = _mm_set1_epi8(controls ? '\r' : 0x1b);
+    const __m128i bs = _mm_set1_epi8(controls ? '\b' : 0x1b);
+
+    for(; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *) (source + i));
+        __m128i found = _mm_or_si128(_mm_cmpeq_epi8(block, escape),
+                _mm_or_si128(_mm_cmpeq_epi8(block, cr), _mm_cmpeq_epi8(block, bs)));
+
+        unsigned int mask = _mm_movemask_epi8(found);
+        if(mask)
+            return i + __builtin_ctz(mask);
+    }
+#endif
+
+    for(; i < length; i++) {
+        char c = source[i];
+
+        if(c == 0x1b || (controls && (c == '\r' || c == '\b')))
+            return i;
+    }
+
+    return length;
+}
+
+// escape sequence byte, returns the next state
+static ansi_state ansi_sequence(ansi_state state, unsigned char c) {
+    switch(state) {
+        case ANSI_ESCAPE:
+            if(c == '[')
+                return ANSI_CSI;
+
+            if(c == ']' || c == 'P' || c == 'X' || c == '^' || c == '_')
+                return ANSI_STRING;
+
+            // intermediate bytes, eg: charset
+            if(c >= 0x20 && c <= 0x2f)
+                return ANSI_ESCAPE;
+
+            return ANSI_TEXT;
+
+        case ANSI_CSI:
+            return (c >= 0x40 && c <= 0x7e) ? ANSI_TEXT : ANSI_CSI;
+
+        case ANSI_STRING:
+            if(c == 0x07)
+                return ANSI_TEXT;
+
+            return (c == 0x1b) ? ANSI_STRING_ESCAPE : ANSI_STRING;
+
+        case ANSI_STRING_ESCAPE:
+            return (c == '\\') ? ANSI_TEXT : ANSI_STRING;
+
+        default:
+            return ANSI_TEXT;
+    }
+}
+
+// copy source into target without escape sequences, map (optional)
+// gets for each byte kept its position in source, target needs to
+// be as large as source, returns the length kept
+size_t ansi_strip(const char *source, size_t length, char *target, uint32_t *map) {
+    ansi_state state = ANSI_TEXT;
+    size_t kept = 0;
+
+    for(size_t i = 0; i < length; ) {
+        if(state != ANSI_TEXT) {
+            state = ansi_sequence(state, (unsigned char) source[i++]);
+            continue;
+        }
+
+        size_t run = ansi_run(source + i, length - i, false);
+
+        memcpy(target + kept, source + i, run);
+
+        if(map)
+            for(size_t j = 0; j < run; j++)
+                map[kept + j] = (uint32_t) (i + j);
+
+        kept += run;
+        i += run;
+
+        // escape found
+        if(i < length) {
+            state = ANSI_ESCAPE;
+            i++;
+        }
+    }
+
+    return kept;
+}
+
+// text as displayed: escapes stripped and carriage returns (progress
+// bars redrawn on the same line), backspaces or erase in line
+// overwriting the current line, target needs to be as large as source (or be source itself),
+// returns its length
+size_t ansi_plain(const char *source, size_t length, char *target) {
+    ansi_state state = ANSI_TEXT;
+    size_t line = 0;               // current line beginning
+    size_t end = 0;                // current line end
+    size_t cursor = 0;             // where next byte goes
+
+    for(size_t i = 0; i < length; ) {
+        unsigned char c = (unsigned char) source[i];
+
+        if(state != ANSI_TEXT) {
+            // erase in line, what follows the cursor is gone
+            if(state == ANSI_CSI && c == 'K')
+                end = cursor;
+
+            state = ansi_sequence(state, c);
+            i++;
+            continue;
+        }
+
+        // appending, plain runs copied at once
+        if(cursor == end) {
+            size_t run = ansi_run(source + i, length - i, true);
+
+            if(run) {
+                memmove(target + cursor, source + i, run);
+
+                const char *newline = memrchr(target + cursor, '\n', run);
+                cursor = end = cursor + run;
+
+                if(newline)
+                    line = newline - target + 1;
+
+                i += run;
+                continue;
+            }
+        }
+
+        i++;
+
+        switch(c) {
+            case 0x1b:
+                state = ANSI_ESCAPE;
+                break;
+
+            case '\r':
+                cursor = line;
+                break;
+
+            case '\b':
+                if(cursor > line)
+                    cursor--;
+                break;
+
+            // line kept as displayed, next one starts after it
+            case '\n':
+                target[end] = '\n';
+                line = cursor = end = end + 1;
+                break;
+
+            default:
+                target[cursor++] = c;
+                if(cursor > end)
+                    end = cursor;
+                break;
+        }
+    }
+
+    return end;
+}
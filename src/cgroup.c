@@ -0,0 +1,287 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include <libwebsockets.h>
+#include <json.h>
+
+#include "server.h"
+#include "utils.h"
+
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+//
+// cgroup v2 process placement
+//
+// each process gets a leaf cgroup named by its id under the
+// cgroup root given with --cgroup, limits are written into the
+// leaf and the child moves itself into it before exec
+//
+static char *cgroup_root = NULL;
+static char *cgroup_controllers[] = {"+cpu", "+memory", "+pids", "+io"};
+
+static int cgroup_write(const char *path, const char *file, const char *value) {
+    char filename[512];
+    int fd;
+
+    snprintf(filename, sizeof(filename), "%s/%s", path, file);
+
+    if((fd = open(filename, O_WRONLY | O_CLOEXEC)) < 0)
+        return -1;
+
+    ssize_t len = write(fd, value, strlen(value));
+    close(fd);
+
+    return (len < 0) ? -1 : 0;
+}
+
+static int cgroup_read(const char *path, const char *file, char *buffer, size_t length) {
+    char filename[512];
+    int fd;
+
+    snprintf(filename, sizeof(filename), "%s/%s", path, file);
+
+    if((fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+
+    ssize_t len = read(fd, buffer, length - 1);
+    close(fd);
+
+    if(len < 0)
+        return -1;
+
+    buffer[len] = '\0';
+    return 0;
+}
+
+int cgroup_init(const char *root) {
+    char parent[512];
+    char controllers[256];
+
+    if(mkdir(root, 0755) < 0 && errno != EEXIST) {
+        warnp("cgroup: mkdir");
+        return 1;
+    }
+
+    if(cgroup_read(root, "cgroup.controllers", controllers, sizeof(controllers))) {
+        fprintf(stderr, "[-] cgroup: %s is not a cgroup v2 hierarchy\n", root);
+        return 1;
+    }
+
+    // controllers needs to be delegated by the parent first,
+    // this is best effort, parent can already provide them
+    snprintf(parent, sizeof(parent), "%s", root);
+    char *slash = strrchr(parent, '/');
+    if(slash && slash != parent) {
+        *slash = '\0';
+
+        for(size_t i = 0; i < sizeof(cgroup_controllers) / sizeof(char *); i++)
+            cgroup_write(parent, "cgroup.subtree_control", cgroup_controllers[i]);
+    }
+
+    if(cgroup_read(root, "cgroup.controllers", controllers, sizeof(controllers)) == 0)
+        verbose("[+] cgroup: %s, controllers: %s", root, controllers);
+
+    for(size_t i = 0; i < sizeof(cgroup_controllers) / sizeof(char *); i++) {
+        if(cgroup_write(root, "cgroup.subtree_control", cgroup_controllers[i]))
+            verbose("[-] cgroup: could not enable controller %s\n", cgroup_controllers[i] + 1);
+    }
+
+    cgroup_root = strdup(root);
+
+    return 0;
+}
+
+bool tty_limits_isset(tty_limits *limits) {
+    return limits->cpu_weight || limits->memory_max || limits->pids_max || limits->io_weight;
+}
+
+// create process leaf cgroup and write limits, nothing is done when
+// cgroups are not available, limits are then applied with setrlimit
+int cgroup_create(struct tty_process *process) {
+    tty_limits *limits = &process->options.limits;
+    char path[512], value[64];
+
+    if(cgroup_root == NULL)
+        return 1;
+
+    snprintf(path, sizeof(path), "%s/%lu", cgroup_root, process->id);
+
+    if(mkdir(path, 0755) < 0 && errno != EEXIST) {
+        warnp("cgroup: mkdir");
+        return 1;
+    }
+
+    process->cgroup = strdup(path);
+
+    if(limits->cpu_weight) {
+        sprintf(value, "%u", limits->cpu_weight);
+        if(cgroup_write(path, "cpu.weight", value))
+            warnp("cgroup: cpu.weight");
+    }
+
+    if(limits->memory_max) {
+        sprintf(value, "%lu", (unsigned long) limits->memory_max);
+        if(cgroup_write(path, "memory.max", value))
+            warnp("cgroup: memory.max");
+    }
+
+    if(limits->pids_max) {
+        sprintf(value, "%u", limits->pids_max);
+        if(cgroup_write(path, "pids.max", value))
+            warnp("cgroup: pids.max");
+    }
+
+    if(limits->io_weight) {
+        sprintf(value, "default %u", limits->io_weight);
+        if(cgroup_write(path, "io.weight", value))
+            warnp("cgroup: io.weight");
+    }
+
+    return 0;
+}
+
+void cgroup_remove(struct tty_process *process) {
+    if(process->cgroup == NULL)
+        return;
+
+    if(rmdir(process->cgroup) < 0)
+        warnp("cgroup: rmdir");
+
+    free(process->cgroup);
+    process->cgroup = NULL;
+}
+
+// fallback when cgroup are not available, weights are
+// mapped to nice level and best-effort io priority
+static void limits_apply_rlimit(tty_limits *limits) {
+    struct rlimit rlim;
+
+    if(limits->memory_max) {
+        rlim.rlim_cur = rlim.rlim_max = limits->memory_max;
+        if(setrlimit(RLIMIT_AS, &rlim) < 0)
+            perror("setrlimit: memory");
+    }
+
+    // this is per-user and not per-process tree, this is the
+    // closest we have without cgroup
+    if(limits->pids_max) {
+        rlim.rlim_cur = rlim.rlim_max = limits->pids_max;
+        if(setrlimit(RLIMIT_NPROC, &rlim) < 0)
+            perror("setrlimit: pids");
+    }
+
+    // cgroup weight 100 is nice 0, each nice level is a 1.25 ratio
+    if(limits->cpu_weight) {
+        int nice = 0;
+        double weight = 100;
+
+        while(nice < 19 && weight / 1.25 >= limits->cpu_weight) {
+            weight /= 1.25;
+            nice++;
+        }
+
+        while(nice > -20 && weight * 1.25 <= limits->cpu_weight) {
+            weight *= 1.25;
+            nice--;
+        }
+
+        if(setpriority(PRIO_PROCESS, 0, nice) < 0)
+            perror("setpriority");
+    }
+
+    // io weight 1..10000 mapped to best-effort levels 7..0
+    if(limits->io_weight) {
+        int level = 7 - (int) ((limits->io_weight - 1) * 8 / 10000);
+        int ioprio = (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | level;
+
+        if(syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio) < 0)
+            perror("ioprio_set");
+    }
+}
+
+// called from the child, before exec
+void limits_enter(struct tty_process *process) {
+    if(!tty_limits_isset(&process->options.limits))
+        return;
+
+    if(process->cgroup) {
+        if(cgroup_write(process->cgroup, "cgroup.procs", "0") == 0)
+            return;
+
+        perror("cgroup: cgroup.procs");
+    }
+
+    limits_apply_rlimit(&process->options.limits);
+}
+
+// flat keyed file: "key value" per line (eg: cpu.stat)
+static uint64_t cgroup_flat_value(char *buffer, const char *key) {
+    size_t keylen = strlen(key);
+
+    for(char *line = buffer; line; line = strchr(line, '\n')) {
+        if(*line == '\n')
+            line++;
+
+        if(strncmp(line, key, keylen) == 0 && line[keylen] == ' ')
+            return strtoull(line + keylen + 1, NULL, 10);
+    }
+
+    return 0;
+}
+
+// nested keyed file: "device key=value ..." per line (eg: io.stat)
+// values are summed across all the lines
+static uint64_t cgroup_nested_sum(const char *buffer, const char *key) {
+    size_t keylen = strlen(key);
+    uint64_t total = 0;
+
+    for(const char *match = buffer; (match = strstr(match, key)); match += keylen) {
+        if(match != buffer && match[-1] != ' ')
+            continue;
+
+        total += strtoull(match + keylen, NULL, 10);
+    }
+
+    return total;
+}
+
+// sampling current usage from a process cgroup (path), this
+// covers the whole process tree and not only the child
+int cgroup_sample(const char *cgroup, tty_stats *stats) {
+    char buffer[4096];
+
+    if(cgroup == NULL)
+        return 1;
+
+    stats->cgroup = true;
+
+    if(cgroup_read(cgroup, "memory.current", buffer, sizeof(buffer)) == 0)
+        stats->cgroup_memory = strtoull(buffer, NULL, 10);
+
+    if(cgroup_read(cgroup, "pids.current", buffer, sizeof(buffer)) == 0)
+        stats->cgroup_pids = strtoull(buffer, NULL, 10);
+
+    if(cgroup_read(cgroup, "cpu.stat", buffer, sizeof(buffer)) == 0)
+        stats->cpu_time = cgroup_flat_value(buffer, "usage_usec") / 1000;
+
+    if(cgroup_read(cgroup, "io.stat", buffer, sizeof(buffer)) == 0) {
+        stats->io_read = cgroup_nested_sum(buffer, "rbytes=");
+        stats->io_write = cgroup_nested_sum(buffer, "wbytes=");
+    }
+
+    return 0;
+}
@@ -0,0 +1,1073 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <libwebsockets.h>
+
+#include "server.h"
+#include "probes.h"
+#include "control.h"
+#include "utils.h"
+
+#define CONTROL_EVENTS 32
+#define CONTROL_BACKLOG 16
+#define CONTROL_HIGHWATER (BUF_SIZE * 8) // pending output pausing subscriptions and requests
+
+//
+// control socket
+//
+// binary rpc for local agents, one thread owns the listening socket
+// and every connection through one epoll set, subscribed processes
+// output is pulled from their logs ring like websocket viewers do,
+// the thread is woken up by an eventfd when new output is committed
+//
+// handlers hold a reference on the process they use, subscriptions
+// and shares too, a start is answered once the process left its
+// starting states, requests after it wait in the client input
+//
+typedef struct control_subscription {
+    uint32_t tag;                  // subscribe request tag
+    struct tty_process *process;   // subscribed process
+    uint64_t offset;               // next process logs offset to send
+
+    LIST_ENTRY(control_subscription) list;
+} control_subscription;
+
+// descriptors sent along with the output byte at offset
+typedef struct control_attachment {
+    size_t offset;                 // output offset of the reply
+    int fds[2];                    // descriptors, closed once sent
+    int count;
+
+    STAILQ_ENTRY(control_attachment) next;
+} control_attachment;
+
+// shared ring handed to a client, its eventfd is signaled on
+// process output as long as the client stays connected
+typedef struct control_share {
+    int event;                     // eventfd, the client got a copy
+    struct tty_process *process;   // shared process
+
+    LIST_ENTRY(control_share) shares;  // process shares (process mutex)
+    LIST_ENTRY(control_share) list;    // client shares
+} control_share;
+
+typedef struct control_client {
+    int fd;                        // connection socket
+    uint32_t events;               // epoll events registered
+    struct tty_process *starting;  // process started, not answered yet
+    uint32_t starting_tag;         // start request tag
+    char *input;                   // received, not yet handled
+    size_t input_length;
+    size_t input_size;
+    char *output;                  // replies waiting to be sent
+    size_t output_length;
+    size_t output_sent;
+    size_t output_size;
+
+    LIST_HEAD(, control_subscription) subscriptions;
+    LIST_HEAD(, control_share) shares;
+    STAILQ_HEAD(, control_attachment) attachments;
+    LIST_ENTRY(control_client) list;
+} control_client;
+
+static int control_epoll = -1;
+static int control_listener = -1;
+static int control_wakeup = -1;
+static bool control_pending;
+static bool control_stopping;
+static int control_starts;             // clients waiting for a start
+static char *control_path;
+static pthread_t control_thread;
+static pthread_mutex_t control_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(, control_client) control_clients = LIST_HEAD_INITIALIZER(control_clients);
+
+//
+// replies
+//
+static char *control_output_reserve(control_client *client, size_t length) {
+    if(client->output_length + length > client->output_size) {
+        client->output_size = client->output_length + length + BUF_SIZE;
+        client->output = xrealloc(client->output, client->output_size);
+    }
+
+    return client->output + client->output_length;
+}
+
+// reply header is written first, its length is set once the payload
+// is appended, the offset is kept since the buffer can be moved
+static size_t control_reply_begin(control_client *client, uint8_t type, uint32_t tag) {
+    control_header header = { .length = 0, .tag = tag, .type = type };
+    size_t offset = client->output_length;
+
+    memcpy(control_output_reserve(client, sizeof(header)), &header, sizeof(header));
+    client->output_length += sizeof(header);
+
+    return offset;
+}
+
+static void control_reply_end(control_client *client, size_t offset) {
+    uint32_t length = client->output_length - offset - sizeof(control_header);
+    memcpy(client->output + offset, &length, sizeof(length));
+}
+
+static void control_reply(control_client *client, uint8_t type, uint32_t tag, const void *payload, size_t length) {
+    size_t offset = control_reply_begin(client, type, tag);
+
+    if(length) {
+        memcpy(control_output_reserve(client, length), payload, length);
+        client->output_length += length;
+    }
+
+    control_reply_end(client, offset);
+}
+
+static void control_error(control_client *client, uint32_t tag, const char *message) {
+    control_reply(client, CONTROL_ERROR, tag, message, strlen(message));
+}
+
+static void control_events(control_client *client, uint32_t events) {
+    struct epoll_event event;
+
+    if(client->events == events)
+        return;
+
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.ptr = client;
+
+    if(epoll_ctl(control_epoll, EPOLL_CTL_MOD, client->fd, &event) < 0)
+        warnp("control: epoll_ctl");
+
+    client->events = events;
+}
+
+static void control_attachment_free(control_client *client) {
+    control_attachment *attachment = STAILQ_FIRST(&client->attachments);
+
+    STAILQ_REMOVE_HEAD(&client->attachments, next);
+
+    for(int i = 0; i < attachment->count; i++)
+        close(attachment->fds[i]);
+
+    free(attachment);
+}
+
+// send output up to the next attachment, or starting with it
+static ssize_t control_write(control_client *client) {
+    control_attachment *attachment = STAILQ_FIRST(&client->attachments);
+    size_t length = client->output_length - client->output_sent;
+    char control[CMSG_SPACE(sizeof(int) * 2)];
+    struct msghdr message;
+    struct iovec iov;
+
+    if(!attachment || attachment->offset > client->output_sent) {
+        if(attachment)
+            length = attachment->offset - client->output_sent;
+
+        return send(client->fd, client->output + client->output_sent, length, MSG_NOSIGNAL);
+    }
+
+    iov.iov_base = client->output + client->output_sent;
+    iov.iov_len = length;
+
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = CMSG_SPACE(sizeof(int) * attachment->count);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * attachment->count);
+    memcpy(CMSG_DATA(cmsg), attachment->fds, sizeof(int) * attachment->count);
+
+    ssize_t n = sendmsg(client->fd, &message, MSG_NOSIGNAL);
+
+    if(n > 0)
+        control_attachment_free(client);
+
+    return n;
+}
+
+// requests are not read while a start is pending
+static uint32_t control_input_events(control_client *client) {
+    return client->starting ? 0 : EPOLLIN;
+}
+
+// returns non-zero if the connection is broken
+static int control_flush(control_client *client) {
+    while(client->output_sent < client->output_length) {
+        ssize_t n = control_write(client);
+
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                return 1;
+
+            // client is not reading, no more requests are handled
+            // until its replies are sent
+            if(client->output_length - client->output_sent > CONTROL_HIGHWATER)
+                control_events(client, EPOLLOUT);
+            else
+                control_events(client, control_input_events(client) | EPOLLOUT);
+
+            return 0;
+        }
+
+        client->output_sent += n;
+    }
+
+    client->output_length = 0;
+    client->output_sent = 0;
+    control_events(client, control_input_events(client));
+
+    return 0;
+}
+
+// copy pending output of subscribed processes, a client too far
+// behind loses data overwritten in the meantime, returns true if
+// output was left behind because of the high watermark
+static bool control_pump(control_client *client) {
+    control_subscription *subscription;
+
+    LIST_FOREACH(subscription, &client->subscriptions, list) {
+        struct tty_process *process = subscription->process;
+
+        while(1) {
+            if(client->output_length >= CONTROL_HIGHWATER)
+                return true;
+
+            size_t offset = control_reply_begin(client, CONTROL_OUTPUT, subscription->tag);
+            char *target = control_output_reserve(client, BUF_SIZE);
+
+            pthread_mutex_lock(&process->mutex);
+
+            if(subscription->offset < circular_first(process->logs))
+                subscription->offset = circular_first(process->logs);
+
+            size_t n = circular_read(process->logs, subscription->offset, target, BUF_SIZE);
+
+            pthread_mutex_unlock(&process->mutex);
+
+            if(n == 0) {
+                client->output_length = offset;
+                break;
+            }
+
+            subscription->offset += n;
+            client->output_length += n;
+            control_reply_end(client, offset);
+        }
+    }
+
+    return false;
+}
+
+static int control_send(control_client *client) {
+    bool more;
+
+    do {
+        more = control_pump(client);
+
+        if(control_flush(client))
+            return 1;
+
+    } while(more && client->output_length == 0);
+
+    return 0;
+}
+
+//
+// requests
+//
+// process referenced by the request, to be released by the handler
+static struct tty_process *control_lookup(control_client *client, control_header *header, char *payload) {
+    struct tty_process *process;
+    uint64_t id;
+
+    if(header->length < sizeof(id)) {
+        control_error(client, header->tag, "missing id");
+        return NULL;
+    }
+
+    memcpy(&id, payload, sizeof(id));
+
+    if(!(process = process_lookup(id)))
+        control_error(client, header->tag, "invalid id");
+
+    return process;
+}
+
+// answer a pending start once the process is spawned (or failed),
+// returns true if it was answered
+static bool control_start_check(control_client *client) {
+    struct tty_process *process = client->starting;
+
+    pthread_mutex_lock(&process->mutex);
+
+    if(process->state == CREATED || process->state == STARTING) {
+        pthread_mutex_unlock(&process->mutex);
+        return false;
+    }
+
+    control_started started = { .id = process->id, .pid = process->pid };
+
+    pthread_mutex_unlock(&process->mutex);
+
+    control_reply(client, CONTROL_OK, client->starting_tag, &started, sizeof(started));
+
+    client->starting = NULL;
+    __atomic_sub_fetch(&control_starts, 1, __ATOMIC_SEQ_CST);
+    process_release(process);
+
+    return true;
+}
+
+static void control_start(control_client *client, control_header *header, char *payload) {
+    int argc = 0;
+
+    if(header->length == 0 || payload[header->length - 1] != '\0') {
+        control_error(client, header->tag, "missing argv");
+        return;
+    }
+
+    for(size_t i = 0; i < header->length; i++)
+        if(payload[i] == '\0')
+            argc++;
+
+    // argv points into the request, the process keeps a copy
+    char **argv = xmalloc(sizeof(char *) * (argc + 1));
+    char *str = payload;
+
+    for(int i = 0; i < argc; i++) {
+        argv[i] = str;
+        str += strlen(str) + 1;
+    }
+
+    argv[argc] = NULL;
+
+    if(strlen(argv[0]) == 0) {
+        free(argv);
+        control_error(client, header->tag, "invalid argv");
+        return;
+    }
+
+    verbose("[+] control: starting process: %s [with %d args]\n", argv[0], argc - 1);
+    struct tty_process *process = process_new(server, argc, argv, NULL);
+    free(argv);
+
+    // referenced before being published, it can't be removed meanwhile
+    if(process) {
+        process_hold(process);
+
+        if(!process_launch(server, process)) {
+            process_release(process);
+            process = NULL;
+        }
+    }
+
+    if(!process) {
+        control_error(client, header->tag, "internal error while starting the process");
+        return;
+    }
+
+    // answered once spawned, without blocking other clients
+    client->starting = process;
+    client->starting_tag = header->tag;
+    __atomic_add_fetch(&control_starts, 1, __ATOMIC_SEQ_CST);
+
+    control_start_check(client);
+}
+
+static void control_stop(control_client *client, control_header *header, char *payload, struct tty_process *process) {
+    verbose("[+] control: requesting stopping process: %lu\n", process->id);
+
+    // waiting for dependencies or a restart can be cancelled too
+    if(!process->running && process->state != CREATED && process->state != RESTARTING) {
+        control_error(client, header->tag, "process already stopped");
+        return;
+    }
+
+    if(!(tty_server_process_stop(process))) {
+        control_error(client, header->tag, "internal error while stopping the process");
+        return;
+    }
+
+    control_reply(client, CONTROL_OK, header->tag, NULL, 0);
+}
+
+static void control_list(control_client *client, control_header *header) {
+    struct tty_process *process;
+    size_t offset = control_reply_begin(client, CONTROL_OK, header->tag);
+
+    server_lock(&server->mutex);
+
+    LIST_FOREACH(process, &server->processes, list) {
+        pthread_mutex_lock(&process->mutex);
+
+        const char *name = process->options.name ? process->options.name : "";
+
+        control_process entry = {
+            .id = process->id,
+            .pid = process->pid,
+            .state = process->state,
+            .running = process->running,
+            .name_length = strlen(name),
+            .command_length = strlen(process->command),
+        };
+
+        size_t length = sizeof(entry) + entry.name_length + entry.command_length;
+        char *target = control_output_reserve(client, length);
+
+        memcpy(target, &entry, sizeof(entry));
+        memcpy(target + sizeof(entry), name, entry.name_length);
+        memcpy(target + sizeof(entry) + entry.name_length, process->command, entry.command_length);
+        client->output_length += length;
+
+        pthread_mutex_unlock(&process->mutex);
+    }
+
+    server_unlock(&server->mutex);
+
+    control_reply_end(client, offset);
+}
+
+static void control_logs(control_client *client, control_header *header, char *payload, struct tty_process *process) {
+    size_t offset = control_reply_begin(client, CONTROL_OK, header->tag);
+
+    pthread_mutex_lock(&process->mutex);
+
+    uint64_t first = circular_first(process->logs);
+    size_t length = process->logs->written - first;
+    char *target = control_output_reserve(client, length);
+
+    client->output_length += circular_read(process->logs, first, target, length);
+
+    pthread_mutex_unlock(&process->mutex);
+
+    control_reply_end(client, offset);
+}
+
+static void control_input(control_client *client, control_header *header, char *payload, struct tty_process *process) {
+    if(server->readonly) {
+        control_error(client, header->tag, "readonly");
+        return;
+    }
+
+    if(process->pty < 0) {
+        control_error(client, header->tag, "process not running");
+        return;
+    }
+
+    size_t length = header->length - sizeof(uint64_t);
+
+    if(length && uring_write(process, payload + sizeof(uint64_t), length) < 0) {
+        warnp("control: write input to pty failed");
+        control_error(client, header->tag, "could not write input");
+        return;
+    }
+
+    control_reply(client, CONTROL_OK, header->tag, NULL, 0);
+}
+
+static void control_resize(control_client *client, control_header *header, char *payload, struct tty_process *process) {
+    control_size size;
+
+    if(header->length < sizeof(uint64_t) + sizeof(size)) {
+        control_error(client, header->tag, "missing size");
+        return;
+    }
+
+    memcpy(&size, payload + sizeof(uint64_t), sizeof(size));
+
+    if(size.cols == 0 || size.rows == 0) {
+        control_error(client, header->tag, "invalid size");
+        return;
+    }
+
+    struct winsize winsize = {
+        .ws_col = size.cols,
+        .ws_row = size.rows,
+    };
+
+    process_resize(process, &winsize);
+    control_reply(client, CONTROL_OK, header->tag, NULL, 0);
+}
+
+static void control_share_free(control_share *share) {
+    struct tty_process *process = share->process;
+
+    pthread_mutex_lock(&process->mutex);
+    LIST_REMOVE(share, shares);
+    __atomic_sub_fetch(&process->sharers, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&process->mutex);
+
+    LIST_REMOVE(share, list);
+    close(share->event);
+    process_release(process);
+    free(share);
+}
+
+// hand the process logs ring over, mapped by the client itself
+static void control_share_ring(control_client *client, control_header *header, char *payload, struct tty_process *process) {
+    int event = -1, copy = -1;
+
+    // being removed, sharers were already detached
+    if(__atomic_load_n(&process->removed, __ATOMIC_SEQ_CST)) {
+        control_error(client, header->tag, "invalid id");
+        return;
+    }
+
+    int ring = circular_share(process->logs);
+
+    if(ring >= 0 && (event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) >= 0)
+        copy = fcntl(event, F_DUPFD_CLOEXEC, 0);
+
+    if(copy < 0) {
+        warnp("control: share");
+
+        if(ring >= 0)
+            close(ring);
+
+        if(event >= 0)
+            close(event);
+
+        control_error(client, header->tag, "shared memory not available");
+        return;
+    }
+
+    control_share *share = xmalloc(sizeof(control_share));
+    share->event = event;
+    share->process = process;
+    LIST_INSERT_HEAD(&client->shares, share, list);
+
+    // released when the share is dropped
+    process_hold(process);
+
+    pthread_mutex_lock(&process->mutex);
+    LIST_INSERT_HEAD(&process->shares, share, shares);
+    __atomic_add_fetch(&process->sharers, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&process->mutex);
+
+    // descriptors are closed once sent
+    control_attachment *attachment = xmalloc(sizeof(control_attachment));
+    attachment->offset = client->output_length;
+    attachment->fds[0] = ring;
+    attachment->fds[1] = copy;
+    attachment->count = 2;
+    STAILQ_INSERT_TAIL(&client->attachments, attachment, next);
+
+    control_reply(client, CONTROL_OK, header->tag, NULL, 0);
+}
+
+static void control_subscription_free(control_subscription *subscription) {
+    LIST_REMOVE(subscription, list);
+    __atomic_sub_fetch(&subscription->process->subscribers, 1, __ATOMIC_SEQ_CST);
+    process_release(subscription->process);
+    free(subscription);
+}
+
+static control_subscription *control_subscription_lookup(control_client *client, struct tty_process *process) {
+    control_subscription *subscription;
+
+    LIST_FOREACH(subscription, &client->subscriptions, list)
+        if(subscription->process == process)
+            return subscription;
+
+    return NULL;
+}
+
+static void control_subscribe(control_client *client, control_header *header, char *payload, struct tty_process *process) {
+    if(control_subscription_lookup(client, process)) {
+        control_error(client, header->tag, "already subscribed");
+        return;
+    }
+
+    // being removed, subscribers were already detached
+    if(__atomic_load_n(&process->removed, __ATOMIC_SEQ_CST)) {
+        control_error(client, header->tag, "invalid id");
+        return;
+    }
+
+    control_subscription *subscription = xmalloc(sizeof(control_subscription));
+    subscription->tag = header->tag;
+    subscription->process = process;
+    process_hold(process);
+
+    // initial output is sent from the oldest data available
+    pthread_mutex_lock(&process->mutex);
+    subscription->offset = circular_first(process->logs);
+    pthread_mutex_unlock(&process->mutex);
+
+    LIST_INSERT_HEAD(&client->subscriptions, subscription, list);
+    __atomic_add_fetch(&process->subscribers, 1, __ATOMIC_SEQ_CST);
+
+    // acknowledged before any output frame
+    control_reply(client, CONTROL_OK, header->tag, NULL, 0);
+}
+
+static void control_unsubscribe(control_client *client, control_header *header, char *payload, struct tty_process *process) {
+    control_subscription *subscription;
+
+    if(!(subscription = control_subscription_lookup(client, process))) {
+        control_error(client, header->tag, "not subscribed");
+        return;
+    }
+
+    control_subscription_free(subscription);
+    control_reply(client, CONTROL_OK, header->tag, NULL, 0);
+}
+
+static void control_handle(control_client *client, control_header *header, char *payload) {
+    struct tty_process *process = NULL;
+
+    switch(header->type) {
+        case CONTROL_START:
+            control_start(client, header, payload);
+            return;
+        case CONTROL_LIST:
+            control_list(client, header);
+            return;
+        case CONTROL_STOP:
+        case CONTROL_LOGS:
+        case CONTROL_INPUT:
+        case CONTROL_SUBSCRIBE:
+        case CONTROL_UNSUBSCRIBE:
+        case CONTROL_RESIZE:
+        case CONTROL_SHARE:
+            break;
+        default:
+            control_error(client, header->tag, "unknown request");
+            return;
+    }
+
+    // referenced for the whole request
+    if(!(process = control_lookup(client, header, payload)))
+        return;
+
+    switch(header->type) {
+        case CONTROL_STOP:
+            control_stop(client, header, payload, process);
+            break;
+        case CONTROL_LOGS:
+            control_logs(client, header, payload, process);
+            break;
+        case CONTROL_INPUT:
+            control_input(client, header, payload, process);
+            break;
+        case CONTROL_SUBSCRIBE:
+            control_subscribe(client, header, payload, process);
+            break;
+        case CONTROL_UNSUBSCRIBE:
+            control_unsubscribe(client, header, payload, process);
+            break;
+        case CONTROL_RESIZE:
+            control_resize(client, header, payload, process);
+            break;
+        case CONTROL_SHARE:
+            control_share_ring(client, header, payload, process);
+            break;
+    }
+
+    process_release(process);
+}
+
+// handle every complete request received, stops at a pending start,
+// returns non-zero if the client sent an invalid request
+static int control_requests(control_client *client) {
+    size_t used = 0;
+
+    while(!client->starting && client->input_length - used >= sizeof(control_header)) {
+        control_header header;
+        memcpy(&header, client->input + used, sizeof(header));
+
+        if(header.length > CONTROL_PAYLOAD_MAX) {
+            fprintf(stderr, "[-] control: request too large, closing client\n");
+            return 1;
+        }
+
+        size_t length = sizeof(header) + header.length;
+
+        // incomplete, making room for the whole request
+        if(client->input_length - used < length) {
+            if(client->input_size < length) {
+                client->input_size = length;
+                client->input = xrealloc(client->input, client->input_size);
+            }
+
+            break;
+        }
+
+        control_handle(client, &header, client->input + used + sizeof(header));
+        used += length;
+    }
+
+    memmove(client->input, client->input + used, client->input_length - used);
+    client->input_length -= used;
+
+    return 0;
+}
+
+// read what is available and handle every complete request,
+// returns non-zero if the connection is closed or broken
+static int control_read(control_client *client) {
+    ssize_t n;
+
+    if(client->input_size - client->input_length < BUF_SIZE) {
+        client->input_size = client->input_length + BUF_SIZE;
+        client->input = xrealloc(client->input, client->input_size);
+    }
+
+    while((n = recv(client->fd, client->input + client->input_length, client->input_size - client->input_length, 0)) < 0) {
+        if(errno == EINTR)
+            continue;
+
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : 1;
+    }
+
+    if(n == 0)
+        return 1;
+
+    client->input_length += n;
+
+    return control_requests(client);
+}
+
+//
+// connections
+//
+static void control_accept() {
+    struct epoll_event event;
+    control_client *client;
+    int fd;
+
+    if((fd = accept4(control_listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0) {
+        warnp("control: accept");
+        return;
+    }
+
+    client = xmalloc(sizeof(control_client));
+    memset(client, 0, sizeof(control_client));
+    client->fd = fd;
+    client->events = EPOLLIN;
+    LIST_INIT(&client->subscriptions);
+    LIST_INIT(&client->shares);
+    STAILQ_INIT(&client->attachments);
+
+    memset(&event, 0, sizeof(event));
+    event.events = client->events;
+    event.data.ptr = client;
+
+    if(epoll_ctl(control_epoll, EPOLL_CTL_ADD, fd, &event) < 0) {
+        warnp("control: epoll_ctl");
+        close(fd);
+        free(client);
+        return;
+    }
+
+    LIST_INSERT_HEAD(&control_clients, client, list);
+    verbose("[+] control: client connected\n");
+}
+
+static void control_client_close(control_client *client) {
+    if(client->starting) {
+        __atomic_sub_fetch(&control_starts, 1, __ATOMIC_SEQ_CST);
+        process_release(client->starting);
+    }
+
+    while(!LIST_EMPTY(&client->subscriptions))
+        control_subscription_free(LIST_FIRST(&client->subscriptions));
+
+    while(!LIST_EMPTY(&client->shares))
+        control_share_free(LIST_FIRST(&client->shares));
+
+    while(!STAILQ_EMPTY(&client->attachments))
+        control_attachment_free(client);
+
+    epoll_ctl(control_epoll, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+
+    LIST_REMOVE(client, list);
+    free(client->input);
+    free(client->output);
+    free(client);
+
+    verbose("[+] control: client disconnected\n");
+}
+
+// subscribed processes produced output, broken connections are
+// left to their own epoll event to be closed
+static void control_notified() {
+    control_client *client;
+    uint64_t value;
+
+    if(read(control_wakeup, &value, sizeof(value)) < 0 && errno != EAGAIN)
+        warnp("control: eventfd read");
+
+    // flag is cleared first, output committed while
+    // pumping will wake the thread up again
+    __atomic_store_n(&control_pending, false, __ATOMIC_SEQ_CST);
+
+    LIST_FOREACH(client, &control_clients, list) {
+        // requests left behind the start are handled now
+        if(client->starting && control_start_check(client) && control_requests(client))
+            shutdown(client->fd, SHUT_RDWR);
+
+        if(!LIST_EMPTY(&client->subscriptions) || client->output_length)
+            control_send(client);
+    }
+}
+
+static void *control_run(void *args) {
+    struct epoll_event events[CONTROL_EVENTS];
+
+    while(1) {
+        int n = epoll_wait(control_epoll, events, CONTROL_EVENTS, -1);
+
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+
+            warnp("control: epoll_wait");
+            break;
+        }
+
+        pthread_mutex_lock(&control_lock);
+
+        // clients are closed by control_close
+        if(__atomic_load_n(&control_stopping, __ATOMIC_SEQ_CST)) {
+            pthread_mutex_unlock(&control_lock);
+            break;
+        }
+
+        for(int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+
+            if(ptr == &control_listener) {
+                control_accept();
+                continue;
+            }
+
+            if(ptr == &control_wakeup) {
+                control_notified();
+                continue;
+            }
+
+            control_client *client = (control_client *) ptr;
+            int broken = 0;
+
+            if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                broken = control_read(client);
+
+            if(!broken)
+                broken = control_send(client);
+
+            if(broken)
+                control_client_close(client);
+        }
+
+        pthread_mutex_unlock(&control_lock);
+    }
+
+    return NULL;
+}
+
+static int control_watch(int fd, void *ptr) {
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = ptr;
+
+    return epoll_ctl(control_epoll, EPOLL_CTL_ADD, fd, &event);
+}
+
+static void control_cleanup() {
+    if(control_listener >= 0)
+        close(control_listener);
+
+    if(control_wakeup >= 0)
+        close(control_wakeup);
+
+    if(control_epoll >= 0)
+        close(control_epoll);
+
+    control_listener = control_wakeup = control_epoll = -1;
+}
+
+int control_init(const char *path) {
+    struct sockaddr_un address;
+
+    if(strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "[-] control: socket path too long: %s\n", path);
+        return 1;
+    }
+
+    if((control_listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        warnp("control: socket");
+        return 1;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    // stale socket of a previous instance (or before a hot restart)
+    unlink(path);
+
+    // only reachable by the user running the server
+    mode_t mask = umask(0177);
+    int value = bind(control_listener, (struct sockaddr *) &address, sizeof(address));
+    umask(mask);
+
+    if(value < 0 || listen(control_listener, CONTROL_BACKLOG) < 0) {
+        warnp("control: bind");
+        control_cleanup();
+        return 1;
+    }
+
+    if((control_epoll = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        warnp("control: epoll_create1");
+        control_cleanup();
+        return 1;
+    }
+
+    if((control_wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+        warnp("control: eventfd");
+        control_cleanup();
+        return 1;
+    }
+
+    if(control_watch(control_listener, &control_listener) < 0 || control_watch(control_wakeup, &control_wakeup) < 0) {
+        warnp("control: epoll_ctl");
+        control_cleanup();
+        return 1;
+    }
+
+    if(pthread_create(&control_thread, NULL, control_run, NULL)) {
+        warnp("control: pthread_create");
+        control_cleanup();
+        return 1;
+    }
+
+    control_path = strdup(path);
+    verbose("[+] control: listening on %s\n", path);
+
+    return 0;
+}
+
+// stop the control thread, clients are closed, their subscriptions
+// and shares are dropped
+void control_close() {
+    uint64_t value = 1;
+
+    if(!control_path)
+        return;
+
+    unlink(control_path);
+
+    __atomic_store_n(&control_stopping, true, __ATOMIC_SEQ_CST);
+
+    if(write(control_wakeup, &value, sizeof(value)) < 0)
+        warnp("control: eventfd write");
+
+    pthread_join(control_thread, NULL);
+
+    pthread_mutex_lock(&control_lock);
+
+    while(!LIST_EMPTY(&control_clients))
+        control_client_close(LIST_FIRST(&control_clients));
+
+    pthread_mutex_unlock(&control_lock);
+
+    control_cleanup();
+
+    free(control_path);
+    control_path = NULL;
+}
+
+// a process changed state, pending starts are checked again
+void control_changed() {
+    uint64_t value = 1;
+
+    if(!__atomic_load_n(&control_starts, __ATOMIC_SEQ_CST))
+        return;
+
+    if(__atomic_exchange_n(&control_pending, true, __ATOMIC_SEQ_CST))
+        return;
+
+    if(write(control_wakeup, &value, sizeof(value)) < 0)
+        warnp("control: eventfd write");
+}
+
+// process output committed, wakes the control thread up once
+// if anyone is subscribed to this process
+void control_notify(struct tty_process *process) {
+    control_share *share;
+    uint64_t value = 1;
+
+    // shared ring consumers are signaled directly
+    if(__atomic_load_n(&process->sharers, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&process->mutex);
+
+        LIST_FOREACH(share, &process->shares, shares)
+            if(write(share->event, &value, sizeof(value)) < 0 && errno != EAGAIN)
+                warnp("control: eventfd write");
+
+        pthread_mutex_unlock(&process->mutex);
+    }
+
+    if(!__atomic_load_n(&process->subscribers, __ATOMIC_SEQ_CST))
+        return;
+
+    if(__atomic_exchange_n(&control_pending, true, __ATOMIC_SEQ_CST))
+        return;
+
+    if(write(control_wakeup, &value, sizeof(value)) < 0)
+        warnp("control: eventfd write");
+}
+
+// process is going away, subscribers are told and dropped
+void control_detach(struct tty_process *process) {
+    control_subscription *subscription;
+    control_share *share, *temp;
+    control_client *client;
+
+    if(!__atomic_load_n(&process->subscribers, __ATOMIC_SEQ_CST) && !__atomic_load_n(&process->sharers, __ATOMIC_SEQ_CST))
+        return;
+
+    pthread_mutex_lock(&control_lock);
+
+    LIST_FOREACH(client, &control_clients, list) {
+        // mapped rings stay valid, no more wakeups
+        LIST_FOREACH_SAFE(share, &client->shares, list, temp)
+            if(share->process == process)
+                control_share_free(share);
+
+        if(!(subscription = control_subscription_lookup(client, process)))
+            continue;
+
+        control_reply(client, CONTROL_CLOSED, subscription->tag, NULL, 0);
+        control_subscription_free(subscription);
+
+        // broken connections are closed by the control thread
+        control_flush(client);
+    }
+
+    pthread_mutex_unlock(&control_lock);
+}
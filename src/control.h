@@ -0,0 +1,94 @@
+#ifndef TFMUX_CONTROL_H
+#define TFMUX_CONTROL_H
+
+#include <stdint.h>
+
+//
+// control socket protocol
+//
+// every message is a fixed header followed by its payload, integers
+// are in host byte order (unix socket, local host only)
+//
+// requests are handled in order and can be pipelined, each one gets
+// exactly one reply (ok or error) carrying the request tag back,
+// subscriptions then keep sending output frames with the tag of the
+// subscribe request
+//
+typedef struct control_header {
+    uint32_t length;               // payload length, header excluded
+    uint32_t tag;                  // request tag, chosen by the client
+    uint8_t type;                  // request or reply type
+    uint8_t reserved[3];
+
+} __attribute__((packed)) control_header;
+
+#define CONTROL_PAYLOAD_MAX 1048576 // request payload limit (1M)
+
+// requests
+#define CONTROL_START 0x01         // argv, each string NUL terminated
+#define CONTROL_STOP 0x02          // uint64 id
+#define CONTROL_LIST 0x03          // none
+#define CONTROL_LOGS 0x04          // uint64 id
+#define CONTROL_INPUT 0x05         // uint64 id, then raw input
+#define CONTROL_SUBSCRIBE 0x06     // uint64 id
+#define CONTROL_UNSUBSCRIBE 0x07   // uint64 id
+#define CONTROL_RESIZE 0x08        // uint64 id, control_size
+#define CONTROL_SHARE 0x09         // uint64 id, replied with ring and eventfd
+
+// replies
+#define CONTROL_OK 0x80            // request specific payload
+#define CONTROL_ERROR 0x81         // error message, not terminated
+#define CONTROL_OUTPUT 0x82        // raw process output (subscription)
+#define CONTROL_CLOSED 0x83        // subscribed process removed
+
+// start reply
+typedef struct control_started {
+    uint64_t id;
+    int32_t pid;
+
+} __attribute__((packed)) control_started;
+
+// resize request, after the id
+typedef struct control_size {
+    uint16_t cols;
+    uint16_t rows;
+
+} __attribute__((packed)) control_size;
+
+// list reply, one per process, followed by name and command
+// (not terminated, name is empty if the process has none)
+typedef struct control_process {
+    uint64_t id;
+    int32_t pid;
+    uint8_t state;                 // tty_process_state value
+    uint8_t running;
+    uint16_t name_length;
+    uint32_t command_length;
+
+} __attribute__((packed)) control_process;
+
+//
+// shared output ring
+//
+// a share reply carries two descriptors (SCM_RIGHTS): the process logs
+// ring memfd, read-only, and an eventfd signaled on new output
+//
+// the memfd starts with the header page followed by the ring data,
+// byte at absolute offset o is at data[o % length], available range
+// is [written + reserved - length, written), header fields are read
+// under the sequence seqlock (odd while updated) and a copy is only
+// valid if the available range still covers it once copied
+//
+#define CONTROL_RING_MAGIC 0x474e5258554d4654ULL // "TFMUXRNG"
+#define CONTROL_RING_HEADER 4096
+
+typedef struct control_ring {
+    uint64_t magic;
+    uint64_t length;               // ring data size
+    uint64_t sequence;             // seqlock sequence
+    uint64_t written;              // bytes written since creation
+    uint64_t reserved;             // bytes being overwritten
+
+} control_ring;
+
+#endif //TFMUX_CONTROL_H
@@ -0,0 +1,282 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <libwebsockets.h>
+#include <json.h>
+
+#include "server.h"
+#include "utils.h"
+
+//
+// events log
+//
+// events are kept serialized in a ring, each one with a sequence
+// number, consumers ask for events after the last sequence they saw
+// and are told when some of them were already overwritten
+//
+// sequence numbers go on across hot restarts, the log itself is not
+// handed over, a cursor older than the restart or ahead of the log
+// (another instance) gets the lost flag as well
+//
+// streams (server-sent events) are owned by the service thread which
+// accepted them, new events only flag the services and wake them up,
+// each thread then asks for writable callbacks on its own streams
+//
+#define EVENTS_BATCH 256
+
+typedef struct tty_event {
+    uint64_t seq;
+    const char *type;
+    char *json;
+
+} tty_event;
+
+static tty_event events[EVENTS_LOG];
+static uint64_t events_seq = 0;
+static uint64_t events_base = 0;   // last sequence of the previous instance
+static pthread_mutex_t events_lock = PTHREAD_MUTEX_INITIALIZER;
+static int events_streams = 0;
+
+static void events_wakeup() {
+    bool wakeup = false;
+
+    for(int i = 0; i < server->threads; i++)
+        if(!__atomic_exchange_n(&server->services[i].events, true, __ATOMIC_SEQ_CST))
+            wakeup = true;
+
+    if(wakeup)
+        lws_cancel_service(context);
+}
+
+// oldest sequence still available, events lock held
+static uint64_t events_first() {
+    uint64_t first = (events_seq >= EVENTS_LOG) ? events_seq - EVENTS_LOG + 1 : 1;
+
+    return (first > events_base) ? first : events_base + 1;
+}
+
+// last sequence, handed over on hot restart
+uint64_t events_last() {
+    pthread_mutex_lock(&events_lock);
+    uint64_t seq = events_seq;
+    pthread_mutex_unlock(&events_lock);
+
+    return seq;
+}
+
+// sequence handed over by the previous instance, before any event
+void events_resume(uint64_t seq) {
+    pthread_mutex_lock(&events_lock);
+    events_seq = events_base = seq;
+    pthread_mutex_unlock(&events_lock);
+}
+
+// record an event (ownership of event is taken), returns its sequence
+uint64_t events_emit(const char *type, size_t id, struct json_object *event) {
+    struct json_object *root = json_object_new_object();
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    pthread_mutex_lock(&events_lock);
+
+    uint64_t seq = ++events_seq;
+    tty_event *slot = &events[seq % EVENTS_LOG];
+
+    json_object_object_add(root, "seq", json_object_new_int64(seq));
+    json_object_object_add(root, "time", json_object_new_int64(now.tv_sec * 1000 + now.tv_nsec / 1000000));
+    json_object_object_add(root, "type", json_object_new_string(type));
+    json_object_object_add(root, "id", json_object_new_int64(id));
+
+    if(event) {
+        json_object_object_foreach(event, key, value)
+            json_object_object_add(root, key, json_object_get(value));
+    }
+
+    free(slot->json);
+    slot->json = strdup(json_object_to_json_string(root));
+    slot->type = type;
+    slot->seq = seq;
+
+    pthread_mutex_unlock(&events_lock);
+
+    json_object_put(root);
+    json_object_put(event);
+
+    if(__atomic_load_n(&events_streams, __ATOMIC_SEQ_CST))
+        events_wakeup();
+
+    return seq;
+}
+
+// report process state changes, called on every process change
+// (process or server mutex held)
+void events_process(struct tty_process *process) {
+    if(process->reported == (int) process->state)
+        return;
+
+    struct json_object *event = json_object_new_object();
+    json_object_object_add(event, "state", json_object_new_string(__process_states[process->state]));
+
+    if(process->reported < 0) {
+        if(process->options.name)
+            json_object_object_add(event, "name", json_object_new_string(process->options.name));
+
+        json_object_object_add(event, "command", json_object_new_string(process->command));
+
+    } else {
+        json_object_object_add(event, "previous", json_object_new_string(__process_states[process->reported]));
+    }
+
+    if(process->state == RUNNING)
+        json_object_object_add(event, "pid", json_object_new_int(process->pid));
+
+    events_emit(process->reported < 0 ? "created" : "state", process->id, event);
+    process->reported = process->state;
+}
+
+// serialized events newer than since, lost is set when some of
+// them are not available anymore
+char *events_since(uint64_t since) {
+    size_t length = 64;
+    bool lost = false;
+
+    pthread_mutex_lock(&events_lock);
+
+    uint64_t first = events_first();
+
+    // cursor not issued by this log, the consumer starts over
+    if(since > events_seq) {
+        lost = true;
+        since = first - 1;
+    }
+
+    // a fresh consumer (since 0) just gets what is left
+    if(since + 1 < first) {
+        lost = since > 0;
+        since = first - 1;
+    }
+
+    for(uint64_t seq = since + 1; seq <= events_seq; seq++)
+        length += strlen(events[seq % EVENTS_LOG].json) + 1;
+
+    char *json = xmalloc(length);
+    char *ptr = json + sprintf(json, "{\"seq\":%lu,\"lost\":%s,\"events\":[",
+            (unsigned long) events_seq, lost ? "true" : "false");
+
+    for(uint64_t seq = since + 1; seq <= events_seq; seq++) {
+        if(seq > since + 1)
+            *ptr++ = ',';
+
+        ptr = stpcpy(ptr, events[seq % EVENTS_LOG].json);
+    }
+
+    pthread_mutex_unlock(&events_lock);
+
+    strcpy(ptr, "]}");
+
+    return json;
+}
+
+void events_resize(struct tty_process *process) {
+    struct json_object *event = json_object_new_object();
+    json_object_object_add(event, "cols", json_object_new_int(process->size.ws_col));
+    json_object_object_add(event, "rows", json_object_new_int(process->size.ws_row));
+
+    events_emit("resize", process->id, event);
+}
+
+// server-sent events following since, up to EVENTS_BATCH of them,
+// since is moved to the last one, NULL when nothing is pending
+char *events_sse(uint64_t *since, size_t *length) {
+    char *sse = NULL;
+    size_t size = 0;
+
+    pthread_mutex_lock(&events_lock);
+
+    uint64_t first = events_first();
+    uint64_t last = events_seq;
+    bool lost = false;
+
+    // cursor not issued by this log, consumer is told to fetch
+    // the full state again
+    if(*since > last) {
+        lost = true;
+        *since = first - 1;
+    }
+
+    if(*since >= last && !lost) {
+        pthread_mutex_unlock(&events_lock);
+        return NULL;
+    }
+
+    // consumer is told to fetch the full state again
+    if(*since + 1 < first) {
+        lost = *since > 0;
+        *since = first - 1;
+    }
+
+    if(last - *since > EVENTS_BATCH)
+        last = *since + EVENTS_BATCH;
+
+    size = 64;
+    for(uint64_t seq = *since + 1; seq <= last; seq++)
+        size += strlen(events[seq % EVENTS_LOG].json) + 64;
+
+    sse = xmalloc(size);
+    char *ptr = sse;
+
+    if(lost)
+        ptr += sprintf(ptr, "event: lost\ndata: {}\n\n");
+
+    for(uint64_t seq = *since + 1; seq <= last; seq++) {
+        tty_event *event = &events[seq % EVENTS_LOG];
+        ptr += sprintf(ptr, "id: %lu\nevent: %s\ndata: %s\n\n", (unsigned long) seq, event->type, event->json);
+    }
+
+    pthread_mutex_unlock(&events_lock);
+
+    *since = last;
+    *length = ptr - sse;
+
+    return sse;
+}
+
+// streams are only touched by their service thread
+void events_stream_add(struct pss_http *pss, struct lws *wsi, uint64_t since) {
+    tty_service *service = &server->services[lws_get_tsi(wsi)];
+
+    pss->wsi = wsi;
+    pss->stream = true;
+    pss->seq = since;
+    LIST_INSERT_HEAD(&service->streams, pss, streams);
+
+    __atomic_add_fetch(&events_streams, 1, __ATOMIC_SEQ_CST);
+}
+
+void events_stream_remove(struct pss_http *pss) {
+    if(!pss->stream)
+        return;
+
+    LIST_REMOVE(pss, streams);
+    pss->stream = false;
+
+    __atomic_sub_fetch(&events_streams, 1, __ATOMIC_SEQ_CST);
+}
+
+// called on the service thread when woken up by new events
+void events_flush(int tsi) {
+    tty_service *service = &server->services[tsi];
+    struct pss_http *pss;
+
+    if(!__atomic_exchange_n(&service->events, false, __ATOMIC_SEQ_CST))
+        return;
+
+    LIST_FOREACH(pss, &service->streams, streams)
+        lws_callback_on_writable(pss->wsi);
+}
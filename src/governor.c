@@ -0,0 +1,374 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#else
+#include <zlib.h>
+#endif
+
+#include <libwebsockets.h>
+#include <json.h>
+
+#include "server.h"
+#include "probes.h"
+#include "control.h"
+#include "utils.h"
+
+//
+// scrollback memory governor
+//
+// rings of every process stay allocated for their whole life, with a
+// lot of idle processes they are most of the memory used, when rings
+// resident size goes over the budget, rings of the processes idle for
+// the longest time (no output, no viewer, no subscriber, never shared)
+// are compressed and their pages given back to the kernel
+//
+// candidates are collected under the server lock, referenced, then
+// compressed one at a time under their own process mutex only
+//
+// rings ever shared are left alone, consumers may still have them
+// mapped and read the memory directly
+//
+// a frozen ring is thawed by the first access (circular_read, reserve,
+// share), under the process mutex like any ring access, offsets are
+// kept as is so readers and the line index never notice
+//
+#define GOVERNOR_INTERVAL 10           // seconds between passes
+#define GOVERNOR_IDLE 60               // seconds without output to be frozen
+
+typedef struct governor_candidate {
+    struct tty_process *process;
+    time_t since;
+    size_t resident;
+
+} governor_candidate;
+
+static pthread_t governor_thread;
+static uint64_t governor_budget;
+static long governor_pagesize;
+
+// counters (atomic)
+static uint64_t governor_compressed;   // frozen rings compressed size
+static uint64_t governor_uncompressed; // frozen rings data size
+static uint64_t governor_freezes;
+static uint64_t governor_thaws;
+
+//
+// ring freezing
+//
+
+// give pages of ring positions [start, end) back to the kernel,
+// pages partially covered are kept
+static void circular_release(circbuf_t *circular, size_t start, size_t end) {
+    uintptr_t base = (uintptr_t) circular->buffer;
+    uintptr_t from = (base + start + governor_pagesize - 1) & ~(governor_pagesize - 1);
+    uintptr_t to = (base + end) & ~(governor_pagesize - 1);
+
+    if(to <= from)
+        return;
+
+    if(circular->memfd >= 0) {
+        off_t offset = CONTROL_RING_HEADER + (from - base);
+
+        if(fallocate(circular->memfd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, to - from) < 0)
+            warnp("governor: fallocate");
+
+        return;
+    }
+
+    if(madvise((void *) from, to - from, MADV_DONTNEED) < 0)
+        warnp("governor: madvise");
+}
+
+// ring bytes actually backed by memory
+size_t circular_resident(circbuf_t *circular) {
+    if(circular->frozen)
+        return 0;
+
+    return (circular->written < circular->length) ? circular->written : circular->length;
+}
+
+// compress ring content and release its memory, process mutex held
+int circular_freeze(circbuf_t *circular) {
+    uint64_t first = circular_first(circular);
+    size_t length = circular->written - first;
+    char *data, *compressed;
+    size_t size;
+
+    if(circular->frozen || circular->exported || length == 0)
+        return 1;
+
+    data = xmalloc(length);
+    circular_read(circular, first, data, length);
+
+#ifdef WITH_ZSTD
+    size = ZSTD_compressBound(length);
+    compressed = xmalloc(size);
+    size = ZSTD_compress(compressed, size, data, length, 1);
+
+    if(ZSTD_isError(size)) {
+        free(data);
+        free(compressed);
+        return 1;
+    }
+#else
+    uLongf bound = compressBound(length);
+    compressed = xmalloc(bound);
+
+    if(compress2((Bytef *) compressed, &bound, (Bytef *) data, length, 1) != Z_OK) {
+        free(data);
+        free(compressed);
+        return 1;
+    }
+
+    size = bound;
+#endif
+
+    free(data);
+
+    circular->frozen = xrealloc(compressed, size);
+    circular->frozen_length = size;
+    circular->frozen_first = first;
+    circular->frozen_written = circular->written;
+
+    // positions of the frozen data, can be wrapping
+    size_t position = first % circular->length;
+
+    if(position + length <= circular->length) {
+        circular_release(circular, position, position + length);
+
+    } else {
+        circular_release(circular, position, circular->length);
+        circular_release(circular, 0, position + length - circular->length);
+    }
+
+    __atomic_add_fetch(&governor_compressed, size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&governor_uncompressed, length, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&governor_freezes, 1, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+// decompress frozen data back in place, process mutex held
+void circular_thaw(circbuf_t *circular) {
+    size_t length = circular->frozen_written - circular->frozen_first;
+    char *data = xmalloc(length);
+    size_t size;
+
+#ifdef WITH_ZSTD
+    size = ZSTD_decompress(data, length, circular->frozen, circular->frozen_length);
+    if(ZSTD_isError(size))
+        size = 0;
+#else
+    uLongf inflated = length;
+    if(uncompress((Bytef *) data, &inflated, (Bytef *) circular->frozen, circular->frozen_length) != Z_OK)
+        inflated = 0;
+
+    size = inflated;
+#endif
+
+    if(size != length) {
+        fprintf(stderr, "[-] governor: scrollback cannot be restored\n");
+        memset(data, 0, length);
+    }
+
+    // output committed while frozen (a read pending when it was
+    // frozen) overwrote the oldest bytes, they are not restored
+    uint64_t first = circular_first(circular);
+    uint64_t offset = circular->frozen_first;
+
+    if(offset < first)
+        offset = first;
+
+    for(; offset < circular->frozen_written; ) {
+        size_t position = offset % circular->length;
+        size_t chunk = circular->frozen_written - offset;
+
+        if(chunk > circular->length - position)
+            chunk = circular->length - position;
+
+        memcpy(circular->buffer + position, data + (offset - circular->frozen_first), chunk);
+        offset += chunk;
+    }
+
+    __atomic_sub_fetch(&governor_compressed, circular->frozen_length, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&governor_uncompressed, length, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&governor_thaws, 1, __ATOMIC_RELAXED);
+
+    free(data);
+    free(circular->frozen);
+    circular->frozen = NULL;
+}
+
+// released with the ring, counters updated
+void circular_unfreeze(circbuf_t *circular) {
+    if(!circular->frozen)
+        return;
+
+    __atomic_sub_fetch(&governor_compressed, circular->frozen_length, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&governor_uncompressed, circular->frozen_written - circular->frozen_first, __ATOMIC_RELAXED);
+
+    free(circular->frozen);
+    circular->frozen = NULL;
+}
+
+//
+// governor
+//
+static int governor_compare(const void *a, const void *b) {
+    const governor_candidate *x = a, *y = b;
+
+    return (x->since > y->since) - (x->since < y->since);
+}
+
+static void governor_pass(time_t now) {
+    struct tty_process *process;
+    governor_candidate *candidates = NULL;
+    size_t count = 0, allocated = 0;
+    uint64_t resident = 0;
+
+    server_lock(&server->mutex);
+
+    LIST_FOREACH(process, &server->processes, list) {
+        uint64_t output = __atomic_load_n(&process->output_bytes, __ATOMIC_RELAXED);
+
+        pthread_mutex_lock(&process->mutex);
+
+        size_t size = circular_resident(process->logs);
+        resident += size;
+
+        if(output != process->idle_output || !process->idle_since) {
+            process->idle_output = output;
+            process->idle_since = now;
+        }
+
+        bool idle = size && now - process->idle_since >= GOVERNOR_IDLE && !process->logs->exported &&
+                    LIST_EMPTY(&process->viewers) && !process->subscribers && !process->sharers;
+
+        pthread_mutex_unlock(&process->mutex);
+
+        if(!idle)
+            continue;
+
+        if(count == allocated) {
+            allocated = allocated ? allocated * 2 : 64;
+            candidates = xrealloc(candidates, sizeof(governor_candidate) * allocated);
+        }
+
+        // released once the pass is over
+        process_hold(process);
+        candidates[count++] = (governor_candidate) { process, process->idle_since, size };
+    }
+
+    server_unlock(&server->mutex);
+
+    if(resident > governor_budget && count) {
+        // idle for the longest time first
+        qsort(candidates, count, sizeof(governor_candidate), governor_compare);
+
+        for(size_t i = 0; i < count && resident > governor_budget; i++) {
+            process = candidates[i].process;
+
+            pthread_mutex_lock(&process->mutex);
+
+            // attached, removed or written since the scan
+            if(!__atomic_load_n(&process->removed, __ATOMIC_SEQ_CST) && LIST_EMPTY(&process->viewers) && !process->sharers && !circular_freeze(process->logs))
+                resident -= candidates[i].resident;
+
+            pthread_mutex_unlock(&process->mutex);
+        }
+
+        verbose("[+] governor: scrollback resident %lu bytes (budget %lu)\n", (unsigned long) resident, (unsigned long) governor_budget);
+    }
+
+    for(size_t i = 0; i < count; i++)
+        process_release(candidates[i].process);
+
+    free(candidates);
+}
+
+static void *governor_run(void *args) {
+    struct timespec now;
+
+    while(!force_exit) {
+        sleep(GOVERNOR_INTERVAL);
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        governor_pass(now.tv_sec);
+    }
+
+    return NULL;
+}
+
+int governor_init(uint64_t budget) {
+    governor_budget = budget;
+    governor_pagesize = sysconf(_SC_PAGESIZE);
+
+    if(pthread_create(&governor_thread, NULL, governor_run, NULL)) {
+        warnp("governor: pthread_create");
+        return 1;
+    }
+
+    pthread_detach(governor_thread);
+
+    verbose("[+] governor: scrollback budget: %lu bytes\n", (unsigned long) budget);
+
+    return 0;
+}
+
+// global counters, frozen rings are counted as compressed
+struct json_object *governor_json() {
+    struct json_object *root = json_object_new_object();
+    struct tty_process *process;
+    uint64_t resident = 0, frozen = 0, capacity = 0;
+
+    server_lock(&server->mutex);
+
+    LIST_FOREACH(process, &server->processes, list) {
+        pthread_mutex_lock(&process->mutex);
+
+        resident += circular_resident(process->logs);
+        capacity += process->logs->length;
+        frozen += (process->logs->frozen != NULL);
+
+        pthread_mutex_unlock(&process->mutex);
+    }
+
+    server_unlock(&server->mutex);
+
+    json_object_object_add(root, "budget", json_object_new_int64(governor_budget));
+    json_object_object_add(root, "capacity", json_object_new_int64(capacity));
+    json_object_object_add(root, "resident", json_object_new_int64(resident));
+    json_object_object_add(root, "frozen", json_object_new_int64(frozen));
+    json_object_object_add(root, "compressed", json_object_new_int64(__atomic_load_n(&governor_compressed, __ATOMIC_RELAXED)));
+    json_object_object_add(root, "uncompressed", json_object_new_int64(__atomic_load_n(&governor_uncompressed, __ATOMIC_RELAXED)));
+    json_object_object_add(root, "freezes", json_object_new_int64(__atomic_load_n(&governor_freezes, __ATOMIC_RELAXED)));
+    json_object_object_add(root, "thaws", json_object_new_int64(__atomic_load_n(&governor_thaws, __ATOMIC_RELAXED)));
+
+    return root;
+}
+
+// process mutex must be held
+struct json_object *governor_process_json(circbuf_t *circular) {
+    struct json_object *root = json_object_new_object();
+
+    json_object_object_add(root, "size", json_object_new_int64(circular->length));
+    json_object_object_add(root, "resident", json_object_new_int64(circular_resident(circular)));
+
+    if(circular->frozen) {
+        json_object_object_add(root, "compressed", json_object_new_int64(circular->frozen_length));
+        json_object_object_add(root, "uncompressed", json_object_new_int64(circular->frozen_written - circular->frozen_first));
+    }
+
+    return root;
+}
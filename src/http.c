@@ -1,3 +1,4 @@
+#include <stdlib.h>
 #include <string.h>
 #include <libwebsockets.h>
 #include <json.h>
@@ -6,6 +7,7 @@
 #include <sys/queue.h>
 
 #include "server.h"
+#include "probes.h"
 #include "html.h"
 #include "utils.h"
 
@@ -62,14 +64,114 @@ int check_auth(struct lws *wsi) {
     return -1;
 }
 
+static int http_response_headers(struct callback_response *r, unsigned int status, char *ctype, size_t length, char *etag, char *encoding) {
+    if(lws_add_http_header_status(r->wsi, status, &r->p, r->end))
+        return 1;
+
+    if(ctype && lws_add_http_header_by_token(r->wsi, WSI_TOKEN_HTTP_CONTENT_TYPE, ctype, strlen(ctype), &r->p, r->end))
+        return 1;
+
+    // representation selected from accept-encoding
+    if(encoding) {
+        if(lws_add_http_header_by_token(r->wsi, WSI_TOKEN_HTTP_VARY, "Accept-Encoding", 15, &r->p, r->end))
+            return 1;
+
+        if(strcmp(encoding, "identity") && lws_add_http_header_by_token(r->wsi, WSI_TOKEN_HTTP_CONTENT_ENCODING, encoding, strlen(encoding), &r->p, r->end))
+            return 1;
+    }
+
+    if(etag) {
+        if(lws_add_http_header_by_token(r->wsi, WSI_TOKEN_HTTP_ETAG, etag, strlen(etag), &r->p, r->end))
+            return 1;
+
+        // clients can keep it but need to revalidate it
+        if(lws_add_http_header_by_token(r->wsi, WSI_TOKEN_HTTP_CACHE_CONTROL, "no-cache", 8, &r->p, r->end))
+            return 1;
+    }
+
+    if(lws_add_http_header_content_length(r->wsi, length, &r->p, r->end))
+        return 1;
+
+    if(lws_finalize_http_header(r->wsi, &r->p, r->end))
+        return 1;
+
+    int flags = LWS_WRITE_HTTP_HEADERS;
+
+#ifdef LWS_WITH_HTTP2
+    // headers only response, the h2 stream ends here
+    if(!length)
+        flags |= LWS_WRITE_H2_STREAM_END;
+#endif
+
+    if(lws_write(r->wsi, r->buffer + LWS_PRE, r->p - (r->buffer + LWS_PRE), flags) < 0)
+        return 1;
+
+    return 0;
+}
+
+static int http_response_body(struct callback_response *r, size_t length, char *buffer) {
+    // no body, transaction is already completed
+    if(!buffer || !length)
+        return lws_http_transaction_completed(r->wsi) ? -1 : 0;
+
+    r->pss->buffer = r->pss->ptr = xmalloc(length);
+    memcpy(r->pss->buffer, buffer, length);
+    r->pss->len = length;
+    r->pss->shared = false;
+    lws_callback_on_writable(r->wsi);
+
+    return 0;
+}
+
+static void http_response_release(struct pss_http *pss) {
+    if(!pss->shared)
+        free(pss->buffer);
+
+    pss->buffer = pss->ptr = NULL;
+    pss->len = 0;
+    pss->shared = false;
+}
+
+// body sent straight from static memory, never copied nor freed
+static int http_response_body_static(struct callback_response *r, size_t length, const unsigned char *buffer) {
+    r->pss->buffer = r->pss->ptr = (char *) buffer;
+    r->pss->len = length;
+    r->pss->shared = true;
+    lws_callback_on_writable(r->wsi);
+
+    return 0;
+}
+
 static int http_response(struct callback_response *r, char *ctype, size_t length, char *buffer) {
+    if(http_response_headers(r, HTTP_STATUS_OK, ctype, length, NULL, NULL))
+        return 1;
+
+    return http_response_body(r, length, buffer);
+}
+
+static int http_response_etag(struct callback_response *r, char *ctype, size_t length, char *buffer, char *etag) {
+    if(http_response_headers(r, HTTP_STATUS_OK, ctype, length, etag, NULL))
+        return 1;
+
+    return http_response_body(r, length, buffer);
+}
+
+static int http_response_not_modified(struct callback_response *r, char *etag) {
+    if(http_response_headers(r, HTTP_STATUS_NOT_MODIFIED, NULL, 0, etag, NULL))
+        return 1;
+
+    return http_response_body(r, 0, NULL);
+}
+
+// streamed response, without length, it lasts until the connection closes
+static int http_response_stream(struct callback_response *r, char *ctype) {
     if(lws_add_http_header_status(r->wsi, HTTP_STATUS_OK, &r->p, r->end))
         return 1;
 
     if(lws_add_http_header_by_token(r->wsi, WSI_TOKEN_HTTP_CONTENT_TYPE, ctype, strlen(ctype), &r->p, r->end))
         return 1;
 
-    if(lws_add_http_header_content_length(r->wsi, length, &r->p, r->end))
+    if(lws_add_http_header_by_token(r->wsi, WSI_TOKEN_HTTP_CACHE_CONTROL, "no-cache", 8, &r->p, r->end))
         return 1;
 
     if(lws_finalize_http_header(r->wsi, &r->p, r->end))
@@ -78,16 +180,100 @@ static int http_response(struct callback_response *r, char *ctype, size_t length
     if(lws_write(r->wsi, r->buffer + LWS_PRE, r->p - (r->buffer + LWS_PRE), LWS_WRITE_HTTP_HEADERS) < 0)
         return 1;
 
-    if(!buffer)
+    // idle streams are expected
+    lws_set_timeout(r->wsi, NO_PENDING_TIMEOUT, 0);
+
+    return 0;
+}
+
+// check if client already have this version (If-None-Match)
+static int http_etag_match(struct lws *wsi, char *etag) {
+    int length = lws_hdr_total_length(wsi, WSI_TOKEN_HTTP_IF_NONE_MATCH);
+    if(length <= 0)
         return 0;
 
-    r->pss->buffer = r->pss->ptr = strdup(buffer);
-    r->pss->len = length;
-    lws_callback_on_writable(r->wsi);
+    char buf[length + 1];
+    if(lws_hdr_copy(wsi, buf, sizeof(buf), WSI_TOKEN_HTTP_IF_NONE_MATCH) <= 0)
+        return 0;
+
+    return strstr(buf, etag) != NULL || strcmp(buf, "*") == 0;
+}
+
+// check if client accepts a content coding (Accept-Encoding)
+static int http_accept_encoding(struct lws *wsi, const char *coding) {
+    char *token, *params, *ptr;
+
+    int length = lws_hdr_total_length(wsi, WSI_TOKEN_HTTP_ACCEPT_ENCODING);
+    if(length <= 0)
+        return 0;
+
+    char buf[length + 1];
+    if(lws_hdr_copy(wsi, buf, sizeof(buf), WSI_TOKEN_HTTP_ACCEPT_ENCODING) <= 0)
+        return 0;
+
+    ptr = buf;
+
+    while((token = strsep(&ptr, ",")) != NULL) {
+        while(*token == ' ')
+            token++;
+
+        if((params = strchr(token, ';')))
+            *params++ = '\0';
+
+        size_t len = strlen(token);
+        while(len > 0 && token[len - 1] == ' ')
+            token[--len] = '\0';
+
+        if(strcasecmp(token, coding))
+            continue;
+
+        // explicitly refused with q=0
+        if(params && (params = strstr(params, "q=")) && strtod(params + 2, NULL) == 0)
+            return 0;
+
+        return 1;
+    }
 
     return 0;
 }
 
+// embedded index.html, the best precompressed variant is served
+// from static memory, etag is strong and differs per variant
+static int http_response_index(struct callback_response *r) {
+    const unsigned char *buffer = index_html;
+    size_t length = index_html_len;
+    char *encoding = "identity";
+    char etag[64];
+
+    if(http_accept_encoding(r->wsi, "gzip")) {
+        buffer = index_html_gz;
+        length = index_html_gz_len;
+        encoding = "gzip";
+    }
+
+#ifdef INDEX_HTML_BROTLI
+    if(http_accept_encoding(r->wsi, "br")) {
+        buffer = index_html_br;
+        length = index_html_br_len;
+        encoding = "br";
+    }
+#endif
+
+    snprintf(etag, sizeof(etag), "\"%s-%s\"", INDEX_HTML_HASH, encoding);
+
+    if(http_etag_match(r->wsi, etag)) {
+        if(http_response_headers(r, HTTP_STATUS_NOT_MODIFIED, NULL, 0, etag, encoding))
+            return 1;
+
+        return http_response_body(r, 0, NULL);
+    }
+
+    if(http_response_headers(r, HTTP_STATUS_OK, "text/html", length, etag, encoding))
+        return 1;
+
+    return http_response_body_static(r, length, buffer);
+}
+
 //
 // json status
 //
@@ -133,27 +319,63 @@ int http_die_response_json_error(struct callback_response *r, char *msg) {
 //
 // methods
 //
-static inline int http_method_is_get(struct lws *wsi) {
-    return lws_hdr_total_length(wsi, WSI_TOKEN_GET_URI);
+static int http_request_method(struct lws *wsi) {
+    if(lws_hdr_total_length(wsi, WSI_TOKEN_GET_URI))
+        return HTTP_GET;
+
+    if(lws_hdr_total_length(wsi, WSI_TOKEN_POST_URI))
+        return HTTP_POST;
+
+#if defined(LWS_WITH_HTTP_UNCOMMON_HEADERS) || defined(LWS_HTTP_HEADERS_ALL)
+    if(lws_hdr_total_length(wsi, WSI_TOKEN_PUT_URI))
+        return HTTP_PUT;
+
+    if(lws_hdr_total_length(wsi, WSI_TOKEN_DELETE_URI))
+        return HTTP_DELETE;
+#endif
+
+    return -1;
+}
+
+// status only response, connection is kept alive
+static int http_die_status(struct callback_response *r, unsigned int status) {
+    if(lws_return_http_status(r->wsi, status, NULL))
+        return -1;
+
+    return lws_http_transaction_completed(r->wsi) ? -1 : 0;
 }
 
-static inline int http_method_is_post(struct lws *wsi) {
-    return lws_hdr_total_length(wsi, WSI_TOKEN_POST_URI);
+// request id from json body ("id") or url argument (id=)
+static int http_request_id(struct callback_response *r, size_t *id) {
+    struct json_object *value;
+    char arg[32];
+
+    if(r->pss->body && json_object_object_get_ex(r->pss->body, "id", &value)) {
+        *id = json_object_get_int64(value);
+        return 0;
+    }
+
+    if(lws_get_urlarg_by_name(r->wsi, "id=", arg, sizeof(arg))) {
+        *id = strtoul(arg, NULL, 10);
+        return 0;
+    }
+
+    return 1;
 }
 
 //
 // routing
 //
 static int routing_get_root(struct callback_response *r) {
-    lws_return_http_status(r->wsi, HTTP_STATUS_NOT_FOUND, NULL);
-    return 0;
+    return http_die_status(r, HTTP_STATUS_NOT_FOUND);
 }
 
-static int routing_get_id(struct callback_response *r, char *id) {
+static int routing_get_id(struct callback_response *r) {
+    char *id = r->pss->path + 8;
+
     if(strlen(id) == 0) {
         printf("[-] routing_get_id: id not defined\n");
-        lws_return_http_status(r->wsi, HTTP_STATUS_NOT_FOUND, NULL);
-        return 1;
+        return http_die_status(r, HTTP_STATUS_NOT_FOUND);
     }
 
     size_t iid = strtoul(id, NULL, 10);
@@ -164,16 +386,17 @@ static int routing_get_id(struct callback_response *r, char *id) {
     // anyway, but we can at least ensure it's an integer...
     if(iid == 0) {
         printf("[-] routing_get_id: invalid id\n");
-        lws_return_http_status(r->wsi, HTTP_STATUS_NOT_FOUND, NULL);
-        return 1;
+        return http_die_status(r, HTTP_STATUS_NOT_FOUND);
     }
 
     if(server->index == NULL)
-        return http_response(r, "text/html", index_html_len, index_html);
+        return http_response_index(r);
 
     int n = lws_serve_http_file(r->wsi, server->index, "text/html", NULL, 0);
     if(n < 0 || (n > 0 && lws_http_transaction_completed(r->wsi)))
         return 1;
+
+    return 0;
 }
 
 static int routing_get_auth_token(struct callback_response *r) {
@@ -185,15 +408,34 @@ static int routing_get_auth_token(struct callback_response *r) {
 
 // api
 
-static int routing_get_api_processes(struct callback_response *r) {
-    struct json_object *root = json_object_new_object();
-    struct json_object *processes = json_object_new_array();
+//
+// processes listing
+//
+// serialized listing is cached and rebuilt only when the server
+// listing version changed, clients can revalidate it with an etag
+// or ask only what changed since a version they already have
+//
+typedef struct listing_cache_t {
+    uint64_t version;
+    uint64_t stats_version;
+    char *json;
+    size_t length;
 
-    struct tty_process *proc;
+} listing_cache_t;
 
-    pthread_mutex_lock(&server->mutex);
+static listing_cache_t listing_cache[2]; // without and with stats
+static pthread_mutex_t listing_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// server mutex must be held, only processes changed after
+// since are added (all of them with since set to zero)
+static struct json_object *processes_json(int stats, uint64_t since) {
+    struct json_object *processes = json_object_new_array();
+    struct tty_process *proc;
 
     LIST_FOREACH(proc, &server->processes, list) {
+        if(proc->version <= since)
+            continue;
+
         struct json_object *process = json_object_new_object();
 
         json_object_object_add(process, "pid", json_object_new_int64(proc->pid));
@@ -201,6 +443,9 @@ static int routing_get_api_processes(struct callback_response *r) {
         json_object_object_add(process, "state", json_object_new_string(tty_server_process_state(proc)));
         json_object_object_add(process, "id", json_object_new_int64(proc->id));
 
+        if(proc->options.name)
+            json_object_object_add(process, "name", json_object_new_string(proc->options.name));
+
         if(WIFEXITED(proc->wstatus))
             if(WEXITSTATUS(proc->wstatus))
                 json_object_object_add(process, "status", json_object_new_int64(WEXITSTATUS(proc->wstatus)));
@@ -208,72 +453,74 @@ static int routing_get_api_processes(struct callback_response *r) {
         if(*proc->error)
             json_object_object_add(process, "error", json_object_new_string(*proc->error));
 
-        json_object_array_add(processes, process);
-    }
+        json_object_object_add(process, "restart", json_object_new_string(restart_policy_name(proc->options.restart)));
+        json_object_object_add(process, "restarts", json_object_new_int(proc->restart.restarts));
 
-    pthread_mutex_unlock(&server->mutex);
+        if(proc->restart.exhausted)
+            json_object_object_add(process, "error", json_object_new_string("restart limit reached"));
 
-    json_object_object_add(root, "processes", processes);
+        if(tty_limits_isset(&proc->options.limits)) {
+            tty_limits *limits = &proc->options.limits;
+            struct json_object *jlimits = json_object_new_object();
 
-    char *jsondumps = strdup(json_object_to_json_string(root));
-    json_object_put(root);
+            json_object_object_add(jlimits, "cpu_weight", json_object_new_int64(limits->cpu_weight));
+            json_object_object_add(jlimits, "memory_max", json_object_new_int64(limits->memory_max));
+            json_object_object_add(jlimits, "pids_max", json_object_new_int64(limits->pids_max));
+            json_object_object_add(jlimits, "io_weight", json_object_new_int64(limits->io_weight));
+            json_object_object_add(jlimits, "cgroup", json_object_new_boolean(proc->cgroup != NULL));
+            json_object_object_add(process, "limits", jlimits);
+        }
 
-    int value = http_response(r, "application/json", strlen(jsondumps), jsondumps);
-    free(jsondumps);
+        // resources usage, sampled in background
+        if(stats) {
+            pthread_mutex_lock(&proc->mutex);
+            json_object_object_add(process, "stats", stats_json(&proc->stats));
+            json_object_object_add(process, "scrollback", governor_process_json(proc->logs));
+            pthread_mutex_unlock(&proc->mutex);
+        }
 
-    return value;
+        json_object_array_add(processes, process);
+    }
 
+    return processes;
 }
 
-static int routing_get_api_process_start(struct callback_response *r) {
-    char cmdline[512];
-    char *binary = NULL;
-    char **argv = NULL;
-    int argc = 0;
-
-    while(lws_hdr_copy_fragment(r->wsi, cmdline, sizeof(cmdline), WSI_TOKEN_HTTP_URI_ARGS, argc) > 0) {
-        if(strncmp(cmdline, "arg[]=", 6) == 0)
-            argc += 1;
-    }
-
-    if(argc == 0) {
-        char *status = http_response_json_error("missing cmdline");
+static int routing_get_api_processes_delta(struct callback_response *r, int stats, uint64_t since) {
+    struct json_object *root = json_object_new_object();
+    struct json_object *removed = json_object_new_array();
+    uint64_t version = __atomic_load_n(&server->version, __ATOMIC_SEQ_CST);
+    int full = 0;
 
-        int value = http_response(r, "application/json", strlen(status), status);
-        free(status);
+    json_object_object_add(root, "version", json_object_new_int64(version));
 
-        return value;
+    // nothing changed, fast path
+    if(since >= version) {
+        json_object_object_add(root, "processes", json_object_new_array());
+        json_object_object_add(root, "removed", removed);
+        goto response;
     }
 
-    argv = xmalloc(sizeof(char *) * argc);
-    int j = 0;
+    server_lock(&server->mutex);
 
-    for(int i = 0; ; i++) {
-        if(lws_hdr_copy_fragment(r->wsi, cmdline, sizeof(cmdline), WSI_TOKEN_HTTP_URI_ARGS, i) < 0)
-            break;
+    // some removals were forgotten, delta can't be trusted
+    if(server->removed_count > REMOVED_LOG)
+        if(server->removed[server->removed_count % REMOVED_LOG].version > since)
+            full = 1;
 
-        if(strncmp(cmdline, "arg[]=", 6) == 0) {
-            argv[j] = strdup(cmdline + 6);
-            j += 1;
-        }
+    if(!full) {
+        for(size_t i = 0; i < server->removed_count && i < REMOVED_LOG; i++)
+            if(server->removed[i].version > since)
+                json_object_array_add(removed, json_object_new_int64(server->removed[i].id));
     }
 
-    verbose("[+] api: starting process: %s [with %d args]\n", argv[0], argc - 1);
-    struct tty_process *proc = tty_server_process_start(server, argc, argv);
-
-    // waiting for process to be ready
-    pthread_mutex_lock(&proc->mutex);
-
-    while(proc->state == CREATED || proc->state == STARTING)
-        pthread_cond_wait(&proc->notifier, &proc->mutex);
+    json_object_object_add(root, "processes", processes_json(stats, full ? 0 : since));
 
-    struct json_object *root = json_object_new_object();
-    json_object_object_add(root, "status", json_object_new_string("success"));
-    json_object_object_add(root, "pid", json_object_new_int64(proc->pid));
-    json_object_object_add(root, "id", json_object_new_int64(proc->id));
+    server_unlock(&server->mutex);
 
-    pthread_mutex_unlock(&proc->mutex);
+    json_object_object_add(root, "removed", removed);
+    json_object_object_add(root, "full", json_object_new_boolean(full));
 
+response:;
     char *jsondumps = strdup(json_object_to_json_string(root));
     json_object_put(root);
 
@@ -283,186 +530,1012 @@ static int routing_get_api_process_start(struct callback_response *r) {
     return value;
 }
 
-static int routing_get_api_process_stop(struct callback_response *r) {
-    const char *ppid;
-    char pid[32];
+static int routing_get_api_processes(struct callback_response *r) {
+    char arg[32], etag[64];
+    int stats = 0;
 
-    if(!(ppid = lws_get_urlarg_by_name(r->wsi, "id=", pid, sizeof(pid))))
-        return http_die_response_json_error(r, "missing id");
+    if(lws_get_urlarg_by_name(r->wsi, "stats=", arg, sizeof(arg)))
+        stats = atoi(arg);
 
-    size_t iid = strtoul(ppid, NULL, 10);
-    verbose("[+] api: requesting stopping process: %lu\n", iid);
+    if(lws_get_urlarg_by_name(r->wsi, "since=", arg, sizeof(arg)))
+        return routing_get_api_processes_delta(r, stats, strtoull(arg, NULL, 10));
 
-    // looking for and killing processes
-    struct tty_process *process;
-    if(!(process = process_getby_id(iid)))
-        return http_die_response_json_error(r, "invalid id");
+    // version is fetched before building, any change happening
+    // while building will invalidate the cache on next call
+    uint64_t version = __atomic_load_n(&server->version, __ATOMIC_SEQ_CST);
+    uint64_t stats_version = stats ? __atomic_load_n(&server->stats_version, __ATOMIC_SEQ_CST) : 0;
 
-    if(!process->running)
-        return http_die_response_json_error(r, "process already stopped");
+    snprintf(etag, sizeof(etag), "\"%lu-%lu\"", (unsigned long) version, (unsigned long) stats_version);
 
-    if(!(tty_server_process_stop(process)))
-        return http_die_response_json_error(r, "internal error while stopping the process");
+    if(http_etag_match(r->wsi, etag))
+        return http_response_not_modified(r, etag);
 
-    return http_die_response_json_ok(r);
-}
+    pthread_mutex_lock(&listing_mutex);
 
-static int routing_get_api_process_logs(struct callback_response *r) {
-    const char *ppid;
-    char pid[32];
+    listing_cache_t *cache = &listing_cache[stats ? 1 : 0];
 
-    if(!(ppid = lws_get_urlarg_by_name(r->wsi, "id=", pid, sizeof(pid))))
-        return http_die_response_json_error(r, "missing id");
+    if(!cache->json || cache->version != version || cache->stats_version != stats_version) {
+        struct json_object *root = json_object_new_object();
 
-    size_t iid = strtoul(ppid, NULL, 10);
-    verbose("[+] api: requesting process logs: %lu\n", iid);
+        server_lock(&server->mutex);
+        json_object_object_add(root, "processes", processes_json(stats, 0));
+        server_unlock(&server->mutex);
 
-    // looking up for processes
-    struct tty_process *process;
-    if(!(process = process_getby_id(iid)))
-        return http_die_response_json_error(r, "invalid id");
+        json_object_object_add(root, "version", json_object_new_int64(version));
 
-    // fetching logs.
-    buffer_t *logs = circular_get(process->logs, 0);
+        free(cache->json);
+        cache->json = strdup(json_object_to_json_string(root));
+        cache->length = strlen(cache->json);
+        cache->version = version;
+        cache->stats_version = stats_version;
 
-    int value = http_response(r, "text/plain", logs->length, logs->buffer);
-    buffer_free(logs);
+        json_object_put(root);
+    }
+
+    int value = http_response_etag(r, "application/json", cache->length, cache->json, etag);
+
+    pthread_mutex_unlock(&listing_mutex);
 
     return value;
 }
 
-static int routing_get_api_process_clean(struct callback_response *r) {
-    struct tty_process *proc;
-    struct tty_process *temp;
+// parsing optional process settings from url arguments
+static char *process_options_from_args(struct lws *wsi, tty_process_options *options) {
+    char value[64];
 
-    verbose("[+] api: requesting cleaning processes\n");
+    tty_process_options_default(options);
 
-    pthread_mutex_lock(&server->mutex);
+    if(lws_get_urlarg_by_name(wsi, "restart=", value, sizeof(value)))
+        if(restart_policy_parse(value, &options->restart))
+            return "invalid restart policy";
 
-    LIST_FOREACH_SAFE(proc, &server->processes, list, temp) {
-        if(proc->state != STOPPED && proc->state != CRASHED)
-            continue;
+    if(lws_get_urlarg_by_name(wsi, "max-restarts=", value, sizeof(value)))
+        if((options->max_restarts = atoi(value)) < 0)
+            return "invalid max-restarts";
+
+    if(lws_get_urlarg_by_name(wsi, "restart-window=", value, sizeof(value)))
+        if((options->restart_window = atoi(value)) <= 0)
+            return "invalid restart-window";
 
-        printf("[+] api: cleaning id: %lu\n", proc->id);
+    if(lws_get_urlarg_by_name(wsi, "cpu-weight=", value, sizeof(value)))
+        if((options->limits.cpu_weight = atoi(value)) < 1 || options->limits.cpu_weight > 10000)
+            return "invalid cpu-weight";
 
-        pthread_mutex_unlock(&server->mutex);
-        process_remove(proc);
-        pthread_mutex_lock(&server->mutex);
+    if(lws_get_urlarg_by_name(wsi, "memory-max=", value, sizeof(value)))
+        if(parse_size(value, &options->limits.memory_max))
+            return "invalid memory-max";
+
+    if(lws_get_urlarg_by_name(wsi, "pids-max=", value, sizeof(value))) {
+        if(atoi(value) < 1)
+            return "invalid pids-max";
+
+        options->limits.pids_max = atoi(value);
     }
 
-    pthread_mutex_unlock(&server->mutex);
+    if(lws_get_urlarg_by_name(wsi, "io-weight=", value, sizeof(value)))
+        if((options->limits.io_weight = atoi(value)) < 1 || options->limits.io_weight > 10000)
+            return "invalid io-weight";
 
-    return http_die_response_json_ok(r);
+    return NULL;
 }
 
 //
-// callback
+// process starts
 //
-int callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len) {
-    struct pss_http *pss = (struct pss_http *) user;
-    unsigned char buffer[4096 + LWS_PRE], *p, *end;
-    char buf[256], name[100], rip[50];
+// a start is answered once the process left its starting states,
+// waiting for dependencies can last, the request is parked on its
+// service thread meanwhile, process changes flag the services and
+// wake them up, each one then checks its own parked requests
+//
+static int http_starts = 0;
 
-    struct callback_response r = {
-        .wsi = wsi,
-        .pss = pss,
-        .buffer = buffer,
-        .p = p,
-        .end = end,
-    };
+// started process, referenced before being published so
+// it cannot be removed before the answer
+static struct tty_process *http_process_start(int argc, char **argv, tty_process_options *options) {
+    struct tty_process *proc;
 
-    switch (reason) {
-        case LWS_CALLBACK_HTTP: {
-            if(len < 1) {
-                lws_return_http_status(wsi, HTTP_STATUS_BAD_REQUEST, NULL);
-                goto try_to_reuse;
-            }
+    if(!(proc = process_new(server, argc, argv, options)))
+        return NULL;
 
-            // initialize context
-            r.p = r.buffer + LWS_PRE;
-            r.end = r.p + sizeof(buffer) - LWS_PRE;
+    process_hold(proc);
 
-            if(http_method_is_get(wsi))
-                goto routing_get;
+    if(!process_launch(server, proc)) {
+        process_release(proc);
+        return NULL;
+    }
 
-            /*
-            if(http_method_is_post(wsi))
-                goto routing_post;
-            */
+    return proc;
+}
 
-            // method not allowed
-            lws_return_http_status(wsi, HTTP_STATUS_BAD_REQUEST, NULL);
-            goto try_to_reuse;
+static void http_start_remove(struct pss_http *pss) {
+    if(!pss->starting)
+        return;
 
-            //
-            // GET
-            //
-routing_get:
-            snprintf(pss->path, sizeof(pss->path), "%s", (const char *)in);
-            lws_get_peer_addresses(wsi, lws_get_socket_fd(wsi), name, sizeof(name), rip, sizeof(rip));
-            verbose("[+] http: %s - %s (%s)\n", (char *) in, rip, name);
+    LIST_REMOVE(pss, starts);
+    process_release(pss->starting);
+    pss->starting = NULL;
 
-            switch (check_auth(wsi)) {
-                case 0:
-                    break;
-                case -1:
-                    goto try_to_reuse;
-                case 1:
-                default:
-                    return 1;
-            }
+    __atomic_sub_fetch(&http_starts, 1, __ATOMIC_SEQ_CST);
+}
 
+// parked until the process is spawned, its id is sent then
+static int http_response_process_started(struct callback_response *r, struct tty_process *proc) {
+    if(!proc)
+        return http_die_response_json_error(r, "internal error while starting the process");
 
-            if(strcmp(pss->path, "/") == 0)
-                return routing_get_root(&r);
+    tty_service *service = &server->services[lws_get_tsi(r->wsi)];
 
-            if(strncmp(pss->path, "/attach/", 8) == 0)
-                return routing_get_id(&r, pss->path + 8);
+    r->pss->wsi = r->wsi;
+    r->pss->starting = proc;
+    LIST_INSERT_HEAD(&service->starts, r->pss, starts);
+    __atomic_add_fetch(&http_starts, 1, __ATOMIC_SEQ_CST);
 
-            if(strncmp(pss->path, "/auth_token.js", 14) == 0)
-                return routing_get_auth_token(&r);
+    lws_callback_on_writable(r->wsi);
 
-            if(strcmp(pss->path, "/api/processes") == 0)
-                return routing_get_api_processes(&r);
+    return 0;
+}
 
-            if(strcmp(pss->path, "/api/process/start") == 0)
-                return routing_get_api_process_start(&r);
+// called from the writable callback, nothing is sent while
+// the process is still starting
+static int http_start_answer(struct callback_response *r) {
+    struct tty_process *proc = r->pss->starting;
 
-            if(strcmp(pss->path, "/api/process/stop") == 0)
-                return routing_get_api_process_stop(&r);
+    pthread_mutex_lock(&proc->mutex);
 
-            if(strcmp(pss->path, "/api/process/logs") == 0)
-                return routing_get_api_process_logs(&r);
+    if(proc->state == CREATED || proc->state == STARTING) {
+        pthread_mutex_unlock(&proc->mutex);
+        return 0;
+    }
 
-            if(strcmp(pss->path, "/api/process/clean") == 0)
-                return routing_get_api_process_clean(&r);
+    struct json_object *root = json_object_new_object();
+    json_object_object_add(root, "status", json_object_new_string("success"));
+    json_object_object_add(root, "pid", json_object_new_int64(proc->pid));
+    json_object_object_add(root, "id", json_object_new_int64(proc->id));
 
-            // anything else, not found
-            lws_return_http_status(wsi, HTTP_STATUS_NOT_FOUND, NULL);
-            goto try_to_reuse;
-        }
+    pthread_mutex_unlock(&proc->mutex);
 
-        case LWS_CALLBACK_HTTP_WRITEABLE:
-            if (pss->len <= 0)
-                goto try_to_reuse;
+    http_start_remove(r->pss);
 
-            if (pss ->ptr - pss->buffer == pss->len) {
-                if (pss->buffer != (char *) index_html) free(pss->buffer);
-                goto try_to_reuse;
-            }
+    char *jsondumps = strdup(json_object_to_json_string(root));
+    json_object_put(root);
 
-            int n = sizeof(buffer) - LWS_PRE;
-            if (pss->ptr - pss->buffer + n > pss->len)
-                n = (int) (pss->len - (pss->ptr - pss->buffer));
+    int value = http_response(r, "application/json", strlen(jsondumps), jsondumps);
+    free(jsondumps);
 
-            memcpy(buffer + LWS_PRE, pss->ptr, n);
-            pss->ptr += n;
-            if (lws_write_http(wsi, buffer + LWS_PRE, (size_t) n) < n) {
-                if (pss->buffer != (char *) index_html) free(pss->buffer);
-                return -1;
-            }
+    return value;
+}
+
+// process changed, services with parked starts are woken up
+void http_changed() {
+    bool wakeup = false;
+
+    if(!__atomic_load_n(&http_starts, __ATOMIC_SEQ_CST))
+        return;
+
+    for(int i = 0; i < server->threads; i++)
+        if(!__atomic_exchange_n(&server->services[i].started, true, __ATOMIC_SEQ_CST))
+            wakeup = true;
+
+    if(wakeup)
+        lws_cancel_service(context);
+}
+
+// called on the service thread when woken up by process changes
+void http_flush(int tsi) {
+    tty_service *service = &server->services[tsi];
+    struct pss_http *pss;
+
+    if(!__atomic_exchange_n(&service->started, false, __ATOMIC_SEQ_CST))
+        return;
+
+    LIST_FOREACH(pss, &service->starts, starts)
+        lws_callback_on_writable(pss->wsi);
+}
+
+static int routing_get_api_process_start(struct callback_response *r) {
+    tty_process_options options;
+    char cmdline[512];
+    char **argv = NULL;
+    char *error;
+    int argc = 0;
+
+    while(lws_hdr_copy_fragment(r->wsi, cmdline, sizeof(cmdline), WSI_TOKEN_HTTP_URI_ARGS, argc) > 0) {
+        if(strncmp(cmdline, "arg[]=", 6) == 0)
+            argc += 1;
+    }
+
+    if(argc == 0)
+        return http_die_response_json_error(r, "missing cmdline");
+
+    if((error = process_options_from_args(r->wsi, &options)))
+        return http_die_response_json_error(r, error);
+
+    argv = xmalloc(sizeof(char *) * (argc + 1));
+    int j = 0;
+
+    for(int i = 0; ; i++) {
+        if(lws_hdr_copy_fragment(r->wsi, cmdline, sizeof(cmdline), WSI_TOKEN_HTTP_URI_ARGS, i) < 0)
+            break;
+
+        if(strncmp(cmdline, "arg[]=", 6) == 0) {
+            argv[j] = strdup(cmdline + 6);
+            j += 1;
+        }
+    }
+
+    argv[j] = NULL;
+
+    verbose("[+] api: starting process: %s [with %d args]\n", argv[0], argc - 1);
+    struct tty_process *proc = http_process_start(argc, argv, &options);
+    strv_free(argv);
+
+    return http_response_process_started(r, proc);
+}
+
+// same process spec as a manifest entry, name is optional
+static int routing_post_api_process_start(struct callback_response *r) {
+    tty_process_options options;
+    struct tty_process *proc = NULL;
+    char **argv = NULL;
+    char *error;
+    int argc = 0;
+
+    if(!json_object_is_type(r->pss->body, json_type_object))
+        return http_die_response_json_error(r, "invalid process spec");
+
+    if((error = process_spec_parse(r->pss->body, &argv, &options))) {
+        strv_free(argv);
+        tty_process_options_free(&options);
+        return http_die_response_json_error(r, error);
+    }
+
+    while(argv[argc])
+        argc++;
+
+    verbose("[+] api: starting process: %s [with %d args]\n", argv[0], argc - 1);
+
+    // names are unique, the lookup and insertion are not atomic
+    // but this is only a safeguard against user mistakes
+    server_lock(&server->mutex);
+    int exists = options.name && process_getby_name(options.name);
+    server_unlock(&server->mutex);
+
+    if(!exists)
+        proc = http_process_start(argc, argv, &options);
+
+    strv_free(argv);
+    tty_process_options_free(&options);
+
+    if(exists)
+        return http_die_response_json_error(r, "name already in use");
+
+    return http_response_process_started(r, proc);
+}
+
+static int routing_api_process_stop(struct callback_response *r) {
+    size_t iid;
+
+    if(http_request_id(r, &iid))
+        return http_die_response_json_error(r, "missing id");
+
+    verbose("[+] api: requesting stopping process: %lu\n", iid);
+
+    // looking for and killing processes
+    struct tty_process *process;
+    if(!(process = process_lookup(iid)))
+        return http_die_response_json_error(r, "invalid id");
+
+    char *error = NULL;
+
+    if(!process->running && process->state != RESTARTING)
+        error = "process already stopped";
+    else if(!(tty_server_process_stop(process)))
+        error = "internal error while stopping the process";
+
+    process_release(process);
+
+    if(error)
+        return http_die_response_json_error(r, error);
+
+    return http_die_response_json_ok(r);
+}
+
+// beginning of the last count lines of text (a trailing newline
+// does not start an extra empty line)
+static size_t logs_tail_lines(const char *text, size_t length, size_t count) {
+    size_t position = length;
+
+    if(position > 0 && text[position - 1] == '\n')
+        position--;
+
+    while(count-- > 0) {
+        const char *newline = memrchr(text, '\n', position);
+        if(!newline)
+            return 0;
+
+        position = newline - text;
+    }
+
+    return position + 1;
+}
+
+static int routing_get_api_process_logs(struct callback_response *r) {
+    const char *ppid;
+    char pid[32], arg[32];
+    bool plain = false;
+    long lines = 0;
+
+    if(!(ppid = lws_get_urlarg_by_name(r->wsi, "id=", pid, sizeof(pid))))
+        return http_die_response_json_error(r, "missing id");
+
+    if(lws_get_urlarg_by_name(r->wsi, "plain=", arg, sizeof(arg)))
+        plain = atoi(arg);
+
+    if(lws_get_urlarg_by_name(r->wsi, "lines=", arg, sizeof(arg)))
+        lines = strtol(arg, NULL, 10);
+
+    size_t iid = strtoul(ppid, NULL, 10);
+    verbose("[+] api: requesting process logs: %lu\n", iid);
+
+    // looking up for processes
+    struct tty_process *process;
+    if(!(process = process_lookup(iid)))
+        return http_die_response_json_error(r, "invalid id");
+
+    // raw logs, as they are
+    if(!plain && !lines) {
+        pthread_mutex_lock(&process->mutex);
+        buffer_t *logs = circular_get(process->logs, 0);
+        pthread_mutex_unlock(&process->mutex);
+
+        process_release(process);
+
+        int value = http_response(r, "text/plain", logs->length, logs->buffer);
+        buffer_free(logs);
+
+        return value;
+    }
+
+    // tail starts from the line index, not from the oldest logs
+    size_t skip = 0;
+    uint64_t offset = (lines < 0) ? lines_tail(process, -lines, &skip) : 0;
+
+    pthread_mutex_lock(&process->mutex);
+
+    uint64_t first = circular_first(process->logs);
+    if(offset < first) {
+        offset = first;
+        skip = 0;
+    }
+
+    size_t length = process->logs->written - offset;
+    char *raw = xmalloc(length + 1);
+    length = circular_read(process->logs, offset, raw, length);
+
+    pthread_mutex_unlock(&process->mutex);
+    process_release(process);
+
+    char *text = raw;
+
+    while(skip-- > 0 && (text = memchr(text, '\n', length - (text - raw))))
+        text++;
+
+    if(!text)
+        text = raw + length;
+
+    length -= text - raw;
+
+    // converted in place, plain text is never longer
+    if(plain)
+        length = ansi_plain(text, length, text);
+
+    if(lines < 0) {
+        size_t start = logs_tail_lines(text, length, -lines);
+        text += start;
+        length -= start;
+    }
+
+    if(lines > 0) {
+        const char *end = text;
+
+        for(long i = 0; i < lines && end; i++)
+            if((end = memchr(end, '\n', length - (end - text))))
+                end++;
+
+        if(end)
+            length = end - text;
+    }
+
+    int value = http_response(r, "text/plain", length, text);
+    free(raw);
+
+    return value;
+}
+
+static int routing_get_api_process_record(struct callback_response *r) {
+    const char *ppid;
+    char pid[32], arg[32];
+    double from = 0, to = -1;
+
+    if(!(ppid = lws_get_urlarg_by_name(r->wsi, "id=", pid, sizeof(pid))))
+        return http_die_response_json_error(r, "missing id");
+
+    size_t iid = strtoul(ppid, NULL, 10);
+    verbose("[+] api: requesting process recording: %lu\n", iid);
+
+    struct tty_process *process;
+    if(!(process = process_lookup(iid)))
+        return http_die_response_json_error(r, "invalid id");
+
+    // segments listing, for players seeking themselves
+    if(lws_get_urlarg_by_name(r->wsi, "index=", arg, sizeof(arg)) && atoi(arg)) {
+        struct json_object *root = record_json(process);
+        process_release(process);
+
+        if(!root)
+            return http_die_response_json_error(r, "process not recorded");
+
+        char *jsondumps = strdup(json_object_to_json_string(root));
+        json_object_put(root);
+
+        int value = http_response(r, "application/json", strlen(jsondumps), jsondumps);
+        free(jsondumps);
+
+        return value;
+    }
+
+    if(lws_get_urlarg_by_name(r->wsi, "from=", arg, sizeof(arg)))
+        from = strtod(arg, NULL);
+
+    if(lws_get_urlarg_by_name(r->wsi, "to=", arg, sizeof(arg)))
+        to = strtod(arg, NULL);
+
+    if(from < 0)
+        from = 0;
+
+    size_t length;
+    char *cast = record_replay(process, from, to, &length);
+    process_release(process);
+
+    if(!cast)
+        return http_die_response_json_error(r, "process not recorded");
+
+    int value = http_response(r, "application/x-asciicast", length, cast);
+    free(cast);
+
+    return value;
+}
+
+static int routing_get_api_scrollback(struct callback_response *r) {
+    struct json_object *root = governor_json();
+
+    char *jsondumps = strdup(json_object_to_json_string(root));
+    json_object_put(root);
+
+    int value = http_response(r, "application/json", strlen(jsondumps), jsondumps);
+    free(jsondumps);
+
+    return value;
+}
+
+static int routing_get_api_latency(struct callback_response *r) {
+    char arg[32];
+    size_t id = 0;
+
+    if(lws_get_urlarg_by_name(r->wsi, "id=", arg, sizeof(arg)))
+        id = strtoul(arg, NULL, 10);
+
+    struct json_object *root = latency_json(id);
+
+    char *jsondumps = strdup(json_object_to_json_string(root));
+    json_object_put(root);
+
+    int value = http_response(r, "application/json", strlen(jsondumps), jsondumps);
+    free(jsondumps);
+
+    return value;
+}
+
+static int routing_get_api_tls(struct callback_response *r) {
+    struct json_object *root = tls_json();
+
+    char *jsondumps = strdup(json_object_to_json_string(root));
+    json_object_put(root);
+
+    int value = http_response(r, "application/json", strlen(jsondumps), jsondumps);
+    free(jsondumps);
+
+    return value;
+}
+
+static int routing_get_api_search(struct callback_response *r) {
+    search_options options = { .context = 64, .limit = 100 };
+    char query[256], arg[32];
+    char *error = NULL;
+
+    if(!lws_get_urlarg_by_name(r->wsi, "q=", query, sizeof(query)))
+        return http_die_response_json_error(r, "missing query");
+
+    if(lws_get_urlarg_by_name(r->wsi, "regex=", arg, sizeof(arg)))
+        options.regex = atoi(arg);
+
+    if(lws_get_urlarg_by_name(r->wsi, "icase=", arg, sizeof(arg)))
+        options.icase = atoi(arg);
+
+    if(lws_get_urlarg_by_name(r->wsi, "ansi=", arg, sizeof(arg)))
+        options.ansi = atoi(arg);
+
+    if(lws_get_urlarg_by_name(r->wsi, "context=", arg, sizeof(arg)))
+        options.context = strtoul(arg, NULL, 10);
+
+    if(lws_get_urlarg_by_name(r->wsi, "limit=", arg, sizeof(arg)))
+        options.limit = strtoul(arg, NULL, 10);
+
+    if(lws_get_urlarg_by_name(r->wsi, "id=", arg, sizeof(arg)))
+        options.id = strtoul(arg, NULL, 10);
+
+    if(options.context > 1024)
+        options.context = 1024;
+
+    if(options.limit == 0 || options.limit > 10000)
+        options.limit = 10000;
+
+    verbose("[+] api: searching processes logs: %s\n", query);
+
+    // answered once the workers are done, see HTTP_WRITEABLE
+    if(search_request(r->pss, r->wsi, query, &options, &error))
+        return http_die_response_json_error(r, error);
+
+    return 0;
+}
+
+static int routing_get_api_events(struct callback_response *r) {
+    uint64_t since = 0;
+    char arg[128];
+
+    if(lws_get_urlarg_by_name(r->wsi, "since=", arg, sizeof(arg)))
+        since = strtoull(arg, NULL, 10);
+
+#ifdef LWS_WITH_CUSTOM_HEADERS
+    // EventSource reconnecting, resumes after the last event received
+    if(lws_hdr_custom_copy(r->wsi, arg, sizeof(arg), "last-event-id:", 14) > 0)
+        since = strtoull(arg, NULL, 10);
+#endif
+
+    // server-sent events, pushed as they happen
+    if(lws_get_urlarg_by_name(r->wsi, "stream=", arg, sizeof(arg)) ||
+       (lws_hdr_copy(r->wsi, arg, sizeof(arg), WSI_TOKEN_HTTP_ACCEPT) > 0 && strstr(arg, "text/event-stream"))) {
+
+        if(http_response_stream(r, "text/event-stream"))
+            return 1;
+
+        events_stream_add(r->pss, r->wsi, since);
+        lws_callback_on_writable(r->wsi);
+
+        return 0;
+    }
+
+    char *jsondumps = events_since(since);
+    int value = http_response(r, "application/json", strlen(jsondumps), jsondumps);
+    free(jsondumps);
+
+    return value;
+}
+
+static int routing_get_api_process_watch(struct callback_response *r) {
+    struct tty_process *process;
+    size_t iid;
+
+    if(http_request_id(r, &iid))
+        return http_die_response_json_error(r, "missing id");
+
+    if(!(process = process_lookup(iid)))
+        return http_die_response_json_error(r, "invalid id");
+
+    struct json_object *root = json_object_new_object();
+    json_object_object_add(root, "status", json_object_new_string("success"));
+    json_object_object_add(root, "watches", watch_json(process));
+    process_release(process);
+
+    char *jsondumps = strdup(json_object_to_json_string(root));
+    json_object_put(root);
+
+    int value = http_response(r, "application/json", strlen(jsondumps), jsondumps);
+    free(jsondumps);
+
+    return value;
+}
+
+static int routing_post_api_process_watch(struct callback_response *r) {
+    struct tty_process *process;
+    char *error;
+    size_t iid, watch;
+
+    if(!json_object_is_type(r->pss->body, json_type_object))
+        return http_die_response_json_error(r, "invalid watch rule");
+
+    if(http_request_id(r, &iid))
+        return http_die_response_json_error(r, "missing id");
+
+    if(!(process = process_lookup(iid)))
+        return http_die_response_json_error(r, "invalid id");
+
+    watch = watch_add(process, r->pss->body, &error);
+    process_release(process);
+
+    if(!watch)
+        return http_die_response_json_error(r, error);
+
+    struct json_object *root = json_object_new_object();
+    json_object_object_add(root, "status", json_object_new_string("success"));
+    json_object_object_add(root, "watch", json_object_new_int64(watch));
+
+    char *jsondumps = strdup(json_object_to_json_string(root));
+    json_object_put(root);
+
+    int value = http_response(r, "application/json", strlen(jsondumps), jsondumps);
+    free(jsondumps);
+
+    return value;
+}
+
+static int routing_delete_api_process_watch(struct callback_response *r) {
+    struct tty_process *process;
+    struct json_object *value;
+    size_t iid, watch = 0;
+    char arg[32];
+
+    if(http_request_id(r, &iid))
+        return http_die_response_json_error(r, "missing id");
+
+    if(r->pss->body && json_object_object_get_ex(r->pss->body, "watch", &value))
+        watch = json_object_get_int64(value);
+    else if(lws_get_urlarg_by_name(r->wsi, "watch=", arg, sizeof(arg)))
+        watch = strtoul(arg, NULL, 10);
+
+    if(!(process = process_lookup(iid)))
+        return http_die_response_json_error(r, "invalid id");
+
+    int missing = watch_remove(process, watch);
+    process_release(process);
+
+    if(missing)
+        return http_die_response_json_error(r, "invalid watch");
+
+    return http_die_response_json_ok(r);
+}
+
+static int routing_api_process_clean(struct callback_response *r) {
+    struct tty_process *proc;
+    struct tty_process **removed = NULL;
+    size_t count = 0;
+
+    verbose("[+] api: requesting cleaning processes\n");
+
+    // collected first, the list can change once unlocked
+    server_lock(&server->mutex);
+
+    LIST_FOREACH(proc, &server->processes, list) {
+        if(proc->state != STOPPED && proc->state != CRASHED)
+            continue;
+
+        removed = xrealloc(removed, sizeof(struct tty_process *) * (count + 1));
+        removed[count++] = proc;
+        process_hold(proc);
+    }
+
+    server_unlock(&server->mutex);
+
+    for(size_t i = 0; i < count; i++) {
+        printf("[+] api: cleaning id: %lu\n", removed[i]->id);
+
+        process_remove(removed[i]);
+        process_release(removed[i]);
+    }
+
+    free(removed);
+
+    return http_die_response_json_ok(r);
+}
+
+static int routing_delete_api_process(struct callback_response *r) {
+    size_t iid;
+
+    if(http_request_id(r, &iid))
+        return http_die_response_json_error(r, "missing id");
+
+    verbose("[+] api: requesting removing process: %lu\n", iid);
+
+    struct tty_process *process;
+    if(!(process = process_lookup(iid)))
+        return http_die_response_json_error(r, "invalid id");
+
+    if(process->state != STOPPED && process->state != CRASHED) {
+        process_release(process);
+        return http_die_response_json_error(r, "process still running");
+    }
+
+    process_remove(process);
+    process_release(process);
+
+    return http_die_response_json_ok(r);
+}
+
+//
+// routes
+//
+typedef struct http_route {
+    http_method method;
+    char *path;
+    bool prefix;                   // path only needs to match the beginning
+    int (*handler)(struct callback_response *r);
+
+} http_route;
+
+static const http_route routes[] = {
+    {HTTP_GET, "/", false, routing_get_root},
+    {HTTP_GET, "/attach/", true, routing_get_id},
+    {HTTP_GET, "/auth_token.js", true, routing_get_auth_token},
+    {HTTP_GET, "/api/processes", false, routing_get_api_processes},
+    {HTTP_GET, "/api/process/start", false, routing_get_api_process_start},
+    {HTTP_GET, "/api/process/stop", false, routing_api_process_stop},
+    {HTTP_GET, "/api/process/logs", false, routing_get_api_process_logs},
+    {HTTP_GET, "/api/process/record", false, routing_get_api_process_record},
+    {HTTP_GET, "/api/process/clean", false, routing_api_process_clean},
+    {HTTP_GET, "/api/search", false, routing_get_api_search},
+    {HTTP_GET, "/api/scrollback", false, routing_get_api_scrollback},
+    {HTTP_GET, "/api/tls", false, routing_get_api_tls},
+    {HTTP_GET, "/api/latency", false, routing_get_api_latency},
+    {HTTP_GET, "/api/events", false, routing_get_api_events},
+    {HTTP_GET, "/api/process/watch", false, routing_get_api_process_watch},
+    {HTTP_POST, "/api/process/start", false, routing_post_api_process_start},
+    {HTTP_POST, "/api/process/stop", false, routing_api_process_stop},
+    {HTTP_POST, "/api/process/clean", false, routing_api_process_clean},
+    {HTTP_POST, "/api/process/watch", false, routing_post_api_process_watch},
+    {HTTP_DELETE, "/api/process", false, routing_delete_api_process},
+    {HTTP_DELETE, "/api/process/watch", false, routing_delete_api_process_watch},
+};
+
+// route handler call, traced
+static int http_route_run(const http_route *route, struct callback_response *r) {
+    PROBE2(http__route, route->method, route->path);
+    int value = route->handler(r);
+    PROBE3(http__route__done, route->method, route->path, value);
+
+    return value;
+}
+
+// route lookup, path known but not for this method sets allowed
+static const http_route *http_route_lookup(int method, char *path, bool *allowed) {
+    *allowed = true;
+
+    for(size_t i = 0; i < sizeof(routes) / sizeof(routes[0]); i++) {
+        const http_route *route = &routes[i];
+
+        if(route->prefix && strncmp(path, route->path, strlen(route->path)))
+            continue;
+
+        if(!route->prefix && strcmp(path, route->path))
+            continue;
+
+        if(route->method == method)
+            return route;
+
+        *allowed = false;
+    }
+
+    return NULL;
+}
+
+static void http_request_reset(struct pss_http *pss) {
+    if(pss->body)
+        json_object_put(pss->body);
+
+    if(pss->tokener)
+        json_tokener_free(pss->tokener);
+
+    pss->route = NULL;
+    pss->tokener = NULL;
+    pss->body = NULL;
+    pss->body_len = 0;
+    pss->body_error = false;
+}
+
+//
+// callback
+//
+int callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len) {
+    struct pss_http *pss = (struct pss_http *) user;
+    unsigned char buffer[4096 + LWS_PRE], *p, *end;
+    char buf[256], name[100], rip[50];
+
+    struct callback_response r = {
+        .wsi = wsi,
+        .pss = pss,
+        .buffer = buffer,
+        .p = p,
+        .end = end,
+    };
+
+    // initialize context
+    r.p = r.buffer + LWS_PRE;
+    r.end = r.p + sizeof(buffer) - LWS_PRE;
+
+    switch (reason) {
+        case LWS_CALLBACK_HTTP: {
+            if(len < 1)
+                return http_die_status(&r, HTTP_STATUS_BAD_REQUEST);
+
+            int method = http_request_method(wsi);
+            bool allowed;
+
+            snprintf(pss->path, sizeof(pss->path), "%s", (const char *)in);
+            lws_get_peer_addresses(wsi, lws_get_socket_fd(wsi), name, sizeof(name), rip, sizeof(rip));
+            verbose("[+] http: %s - %s (%s)\n", (char *) in, rip, name);
+
+            http_request_reset(pss);
+
+            switch (check_auth(wsi)) {
+                case 0:
+                    break;
+                case -1:
+                    goto try_to_reuse;
+                case 1:
+                default:
+                    return 1;
+            }
+
+            if(!(pss->route = http_route_lookup(method, pss->path, &allowed)))
+                return http_die_status(&r, allowed ? HTTP_STATUS_NOT_FOUND : HTTP_STATUS_METHOD_NOT_ALLOWED);
+
+            // request without body, handled right away
+            if(method == HTTP_GET || lws_hdr_total_length(wsi, WSI_TOKEN_HTTP_CONTENT_LENGTH) <= 0)
+                return http_route_run(pss->route, &r);
+
+            // body is streamed to the json parser, the request is
+            // handled on completion
+            pss->tokener = json_tokener_new();
+            break;
+        }
+
+        case LWS_CALLBACK_HTTP_BODY: {
+            if(!pss->tokener || pss->body_error)
+                break;
+
+            if((pss->body_len += len) > HTTP_BODY_MAX) {
+                pss->body_error = true;
+                break;
+            }
+
+            struct json_object *body = json_tokener_parse_ex(pss->tokener, (const char *) in, (int) len);
+            enum json_tokener_error error = json_tokener_get_error(pss->tokener);
+
+            if(error == json_tokener_continue)
+                break;
+
+            // one json value per request, trailing data is rejected
+            if(error != json_tokener_success || pss->body) {
+                if(body)
+                    json_object_put(body);
+
+                pss->body_error = true;
+                break;
+            }
+
+            pss->body = body;
+            break;
+        }
+
+        case LWS_CALLBACK_HTTP_BODY_COMPLETION: {
+            // body of a request already answered
+            if(!pss->tokener)
+                break;
+
+            int value;
+
+            if(pss->body_len > HTTP_BODY_MAX)
+                value = http_die_response_json_error(&r, "request body too large");
+
+            else if(pss->body_error || !pss->body)
+                value = http_die_response_json_error(&r, "invalid json body");
+
+            else value = http_route_run(pss->route, &r);
+
+            http_request_reset(pss);
+            return value;
+        }
+
+        case LWS_CALLBACK_HTTP_WRITEABLE: {
+            // process start, answered once spawned
+            if(pss->starting) {
+                if(http_start_answer(&r))
+                    return -1;
+
+                break;
+            }
+
+            // search request, result once every process is scanned
+            if(pss->search) {
+                struct json_object *root;
+
+                if(!(root = search_response(pss)))
+                    break;
+
+                char *jsondumps = strdup(json_object_to_json_string(root));
+                json_object_put(root);
+
+                int value = http_response(&r, "application/json", strlen(jsondumps), jsondumps);
+                free(jsondumps);
+
+                if(value)
+                    return -1;
+
+                break;
+            }
+
+            // events stream, next batch of pending events
+            if(pss->stream && !pss->buffer) {
+                size_t length;
+                char *sse;
+
+                if(!(sse = events_sse(&pss->seq, &length)))
+                    break;
+
+                pss->buffer = pss->ptr = sse;
+                pss->len = length;
+                pss->shared = false;
+            }
+
+            if(!pss->buffer)
+                break;
+
+            size_t sent = pss->ptr - pss->buffer;
+            size_t n = sizeof(buffer) - LWS_PRE;
+            if(sent + n > pss->len)
+                n = pss->len - sent;
+
+            // last chunk is flagged, the response stream ends with it
+            int done = (sent + n == pss->len);
+            int final = done && !pss->stream;
+
+            memcpy(buffer + LWS_PRE, pss->ptr, n);
+            pss->ptr += n;
+
+            if(lws_write(wsi, buffer + LWS_PRE, n, final ? LWS_WRITE_HTTP_FINAL : LWS_WRITE_HTTP) < (int) n) {
+                http_response_release(pss);
+                return -1;
+            }
+
+            if(!done) {
+                lws_callback_on_writable(wsi);
+                break;
+            }
+
+            http_response_release(pss);
+
+            // stream stays open, more events may be pending already
+            if(pss->stream) {
+                lws_callback_on_writable(wsi);
+                break;
+            }
+
+            goto try_to_reuse;
+        }
+
+        case LWS_CALLBACK_CLOSED_HTTP:
+            events_stream_remove(pss);
+            search_request_remove(pss);
+            http_start_remove(pss);
+
+            if(pss->buffer)
+                http_response_release(pss);
+
+            http_request_reset(pss);
+            break;
 
-            lws_callback_on_writable(wsi);
+        // server tls context created, sessions resumption set up
+        case LWS_CALLBACK_OPENSSL_LOAD_EXTRA_SERVER_VERIFY_CERTS:
+            tls_context_setup((SSL_CTX *) user);
             break;
 
         case LWS_CALLBACK_OPENSSL_PERFORM_CLIENT_CERT_VERIFICATION:
@@ -0,0 +1,273 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/queue.h>
+
+#include <libwebsockets.h>
+#include <json.h>
+
+#include "server.h"
+#include "probes.h"
+#include "utils.h"
+
+//
+// echo latency
+//
+// with --latency, one keystroke per process at a time is followed
+// along its path: received from the websocket, written to the pty,
+// first output read back from the pty, output frame written to the
+// websocket of the client who typed it, stage durations go to log2
+// histograms (microseconds) of the process and of the client
+//
+// browsers can also send pings, answered right away, they report
+// the round-trip they measured with the next ping
+//
+#define LATENCY_TIMEOUT 5000000000ULL  // probe given up without output (ns)
+
+static const char *latency_stages[LATENCY_STAGES] = {
+    "input",                       // websocket receive to pty write
+    "process",                     // pty write to output read
+    "output",                      // output read to websocket write
+    "echo",                        // websocket receive to websocket write
+    "rtt",                         // browser measured round-trip
+};
+
+uint64_t latency_now() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void latency_add(tty_histogram *histogram, uint64_t ns) {
+    uint64_t us = ns / 1000;
+    int bucket = us ? 64 - __builtin_clzll(us) : 0;
+
+    if(bucket >= LATENCY_BUCKETS)
+        bucket = LATENCY_BUCKETS - 1;
+
+    __atomic_add_fetch(&histogram->buckets[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->sum, us, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+    while(us > max && !__atomic_compare_exchange_n(&histogram->max, &max, us, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void latency_record(struct tty_client *client, int stage, uint64_t ns) {
+    latency_add(&client->process->latency.stages[stage], ns);
+    latency_add(&client->latency.stages[stage], ns);
+}
+
+// input written to the pty, received is the websocket receive time
+void latency_input(struct tty_client *client, uint64_t received) {
+    struct tty_process *process = client->process;
+    tty_probe *probe = &process->probe;
+
+    if(!server->latency)
+        return;
+
+    uint64_t now = latency_now();
+
+    pthread_mutex_lock(&process->mutex);
+
+    // one keystroke followed at a time, silent input is given up
+    if(probe->state == PROBE_IDLE || now - probe->received > LATENCY_TIMEOUT) {
+        if(probe->client)
+            probe->client->probing = false;
+
+        probe->client = client;
+        probe->received = received;
+        probe->written = now;
+        probe->state = PROBE_OUTPUT;
+        client->probing = true;
+    }
+
+    pthread_mutex_unlock(&process->mutex);
+}
+
+// output committed, process mutex held
+void latency_output(struct tty_process *process, size_t length) {
+    tty_probe *probe = &process->probe;
+
+    if(probe->state != PROBE_OUTPUT)
+        return;
+
+    probe->read = latency_now();
+    probe->offset = process->logs->written - length;
+    probe->state = PROBE_SEND;
+}
+
+// frame written to the client, up to its offset
+void latency_sent(struct tty_client *client) {
+    struct tty_process *process = client->process;
+    tty_probe *probe = &process->probe;
+
+    if(!client->probing)
+        return;
+
+    pthread_mutex_lock(&process->mutex);
+
+    if(probe->client != client || probe->state != PROBE_SEND || client->offset <= probe->offset) {
+        pthread_mutex_unlock(&process->mutex);
+        return;
+    }
+
+    uint64_t now = latency_now();
+
+    latency_record(client, LATENCY_INPUT, probe->written - probe->received);
+    latency_record(client, LATENCY_PROCESS, probe->read - probe->written);
+    latency_record(client, LATENCY_OUTPUT, now - probe->read);
+    latency_record(client, LATENCY_ECHO, now - probe->received);
+
+    probe->client = NULL;
+    probe->state = PROBE_IDLE;
+    client->probing = false;
+
+    pthread_mutex_unlock(&process->mutex);
+}
+
+// client leaving, process mutex held
+void latency_detach(struct tty_client *client) {
+    tty_probe *probe = &client->process->probe;
+
+    if(probe->client != client)
+        return;
+
+    probe->client = NULL;
+    probe->state = PROBE_IDLE;
+}
+
+// ping received, payload is sent back as is, round-trip measured
+// by the browser for the previous ping is recorded
+void latency_ping(struct tty_client *client, const char *payload, size_t length) {
+    struct json_object *value, *ping;
+
+    if(length > sizeof(client->ping))
+        return;
+
+    memcpy(client->ping, payload, length);
+    client->ping_length = length;
+    lws_callback_on_writable(client->wsi);
+
+    // answered anyway, only recorded with --latency
+    if(!server->latency)
+        return;
+
+    // payload is not nul terminated
+    char *copy = strndup(payload, length);
+    ping = json_tokener_parse(copy);
+    free(copy);
+
+    if(!ping)
+        return;
+
+    if(json_object_object_get_ex(ping, "rtt", &value) && (json_object_is_type(value, json_type_double) || json_object_is_type(value, json_type_int))) {
+        double rtt = json_object_get_double(value);
+
+        if(rtt >= 0)
+            latency_record(client, LATENCY_RTT, rtt * 1000000);
+    }
+
+    json_object_put(ping);
+}
+
+//
+// api
+//
+
+// smallest bucket upper bound covering the given ratio of samples
+static uint64_t latency_percentile(tty_histogram *histogram, uint64_t count, double ratio) {
+    uint64_t wanted = count * ratio, seen = 0;
+
+    for(int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+
+        if(seen > wanted || (seen == count && seen))
+            return 1ULL << i;
+    }
+
+    return 0;
+}
+
+static struct json_object *latency_histogram_json(tty_histogram *histogram) {
+    struct json_object *root = json_object_new_object();
+    struct json_object *buckets = json_object_new_array();
+    uint64_t count = __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+    uint64_t sum = __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED);
+
+    json_object_object_add(root, "count", json_object_new_int64(count));
+
+    if(!count)
+        return root;
+
+    json_object_object_add(root, "mean_us", json_object_new_int64(sum / count));
+    json_object_object_add(root, "p50_us", json_object_new_int64(latency_percentile(histogram, count, 0.5)));
+    json_object_object_add(root, "p90_us", json_object_new_int64(latency_percentile(histogram, count, 0.9)));
+    json_object_object_add(root, "p99_us", json_object_new_int64(latency_percentile(histogram, count, 0.99)));
+    json_object_object_add(root, "max_us", json_object_new_int64(__atomic_load_n(&histogram->max, __ATOMIC_RELAXED)));
+
+    // bucket n counts samples below 2^n us
+    for(int i = 0; i < LATENCY_BUCKETS; i++)
+        json_object_array_add(buckets, json_object_new_int64(__atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED)));
+
+    json_object_object_add(root, "buckets", buckets);
+
+    return root;
+}
+
+static struct json_object *latency_stages_json(tty_latency *latency) {
+    struct json_object *root = json_object_new_object();
+
+    for(int i = 0; i < LATENCY_STAGES; i++)
+        json_object_object_add(root, latency_stages[i], latency_histogram_json(&latency->stages[i]));
+
+    return root;
+}
+
+// processes (all or one) histograms with their clients
+struct json_object *latency_json(size_t id) {
+    struct json_object *root = json_object_new_object();
+    struct json_object *processes = json_object_new_array();
+    struct tty_process *process;
+    struct tty_client *client;
+
+    json_object_object_add(root, "enabled", json_object_new_boolean(server->latency));
+
+    server_lock(&server->mutex);
+
+    LIST_FOREACH(process, &server->processes, list) {
+        if(id && process->id != id)
+            continue;
+
+        struct json_object *entry = json_object_new_object();
+        struct json_object *clients = json_object_new_array();
+
+        json_object_object_add(entry, "id", json_object_new_int64(process->id));
+        json_object_object_add(entry, "stages", latency_stages_json(&process->latency));
+
+        LIST_FOREACH(client, &server->clients, list) {
+            if(client->process != process)
+                continue;
+
+            struct json_object *jclient = json_object_new_object();
+            json_object_object_add(jclient, "address", json_object_new_string(client->address));
+            json_object_object_add(jclient, "stages", latency_stages_json(&client->latency));
+            json_object_array_add(clients, jclient);
+        }
+
+        json_object_object_add(entry, "clients", clients);
+        json_object_array_add(processes, entry);
+    }
+
+    server_unlock(&server->mutex);
+
+    json_object_object_add(root, "processes", processes);
+
+    return root;
+}
@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <libwebsockets.h>
+
+#include "server.h"
+#include "utils.h"
+
+//
+// logs line index
+//
+// built on the first line query of a process then kept up to date on
+// each query, only logs written since the previous query are scanned,
+// a checkpoint (offset of the line beginning) is kept every
+// LINES_CHECKPOINT lines, a tail query starts from the checkpoint
+// before the wanted line and only walks a few lines forward
+//
+#define LINES_CHECKPOINT 64
+#define LINES_INDEX 4096
+#define LINES_CHUNK 65536
+
+struct tty_lines {
+    uint64_t origin;               // offset of line 0
+    uint64_t scanned;              // logs indexed up to this offset
+    uint64_t count;                // newlines seen
+    bool ended;                    // last byte indexed is a newline
+    uint64_t checkpoints[LINES_INDEX]; // line (n * LINES_CHECKPOINT) offset
+    pthread_mutex_t mutex;
+};
+
+// index new logs, lines mutex held
+static void lines_update(struct tty_process *process, struct tty_lines *lines) {
+    char *chunk = xmalloc(LINES_CHUNK);
+
+    while(1) {
+        pthread_mutex_lock(&process->mutex);
+
+        uint64_t first = circular_first(process->logs);
+
+        // logs overwritten before being indexed, line numbers keep
+        // going on, counting from the oldest data available
+        if(lines->scanned < first)
+            lines->scanned = first;
+
+        size_t length = process->logs->written - lines->scanned;
+        if(length > LINES_CHUNK)
+            length = LINES_CHUNK;
+
+        if(length)
+            length = circular_read(process->logs, lines->scanned, chunk, length);
+
+        pthread_mutex_unlock(&process->mutex);
+
+        if(length == 0)
+            break;
+
+        for(char *ptr = chunk; (ptr = memchr(ptr, '\n', length - (ptr - chunk))); ptr++) {
+            if(++lines->count % LINES_CHECKPOINT == 0)
+                lines->checkpoints[(lines->count / LINES_CHECKPOINT) % LINES_INDEX] = lines->scanned + (ptr - chunk) + 1;
+        }
+
+        lines->scanned += length;
+        lines->ended = (chunk[length - 1] == '\n');
+    }
+
+    free(chunk);
+}
+
+// offset to read from to get the last count lines, skip is set to the
+// lines to drop from there
+uint64_t lines_tail(struct tty_process *process, size_t count, size_t *skip) {
+    struct tty_lines *lines;
+
+    pthread_mutex_lock(&process->mutex);
+
+    // created once, released with the process
+    if(!(lines = process->lines)) {
+        lines = xmalloc(sizeof(struct tty_lines));
+        memset(lines, 0, sizeof(struct tty_lines));
+        pthread_mutex_init(&lines->mutex, NULL);
+
+        lines->origin = lines->scanned = circular_first(process->logs);
+        lines->checkpoints[0] = lines->origin;
+        process->lines = lines;
+    }
+
+    pthread_mutex_unlock(&process->mutex);
+
+    pthread_mutex_lock(&lines->mutex);
+
+    lines_update(process, lines);
+
+    // line being written counts, if any
+    uint64_t total = lines->count + (lines->ended ? 0 : 1);
+    uint64_t wanted = (total > count) ? total - count : 0;
+    uint64_t checkpoint = wanted / LINES_CHECKPOINT;
+
+    // oldest checkpoints were overwritten
+    if(lines->count / LINES_CHECKPOINT >= LINES_INDEX && checkpoint <= lines->count / LINES_CHECKPOINT - LINES_INDEX)
+        checkpoint = lines->count / LINES_CHECKPOINT - LINES_INDEX + 1;
+
+    uint64_t offset = checkpoint ? lines->checkpoints[checkpoint % LINES_INDEX] : lines->origin;
+    *skip = (wanted > checkpoint * LINES_CHECKPOINT) ? wanted - checkpoint * LINES_CHECKPOINT : 0;
+
+    pthread_mutex_unlock(&lines->mutex);
+
+    return offset;
+}
+
+void lines_free(struct tty_process *process) {
+    if(!process->lines)
+        return;
+
+    pthread_mutex_destroy(&process->lines->mutex);
+    free(process->lines);
+    process->lines = NULL;
+}
@@ -0,0 +1,492 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <sys/queue.h>
+
+#include <libwebsockets.h>
+#include <json.h>
+
+#include "server.h"
+#include "probes.h"
+#include "utils.h"
+
+//
+// processes manifest
+//
+// {"processes": [{
+//     "name": "api", "argv": ["/usr/bin/api", "--debug"],
+//     "env": {"PORT": "8080"}, "cwd": "/var/lib/api", "scrollback": "1M",
+//     "restart": "on-failure", "max-restarts": 5, "restart-window": 60,
+//     "limits": {"cpu-weight": 100, "memory-max": "512M", "pids-max": 64, "io-weight": 100},
+//     "depends": ["db"]
+// }]}
+//
+// every entry gets its own thread right away, so independent entries
+// are spawned in parallel while dependent ones wait for their
+// dependencies to be running, a reload (SIGHUP) only stops entries
+// removed or changed and starts new or changed ones
+//
+typedef struct manifest_entry {
+    int argc;
+    char **argv;
+    tty_process_options options;
+
+} manifest_entry;
+
+static char *manifest_filename = NULL;
+static pthread_t manifest_thread;
+static sem_t manifest_reload;
+static pthread_mutex_t manifest_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t manifest_generation;   // loads started (manifest lock)
+
+#define MANIFEST_STOP_GRACE 10         // seconds before a stopping process is killed
+
+static void manifest_entries_free(manifest_entry *entries, int count) {
+    for(int i = 0; i < count; i++) {
+        strv_free(entries[i].argv);
+        tty_process_options_free(&entries[i].options);
+    }
+
+    free(entries);
+}
+
+// NULL terminated array from a json array of strings
+static char **manifest_strv(struct json_object *array) {
+    size_t length = json_object_array_length(array);
+    char **strv = xmalloc(sizeof(char *) * (length + 1));
+
+    memset(strv, 0, sizeof(char *) * (length + 1));
+
+    for(size_t i = 0; i < length; i++) {
+        struct json_object *item = json_object_array_get_idx(array, i);
+
+        if(!json_object_is_type(item, json_type_string)) {
+            strv_free(strv);
+            return NULL;
+        }
+
+        strv[i] = strdup(json_object_get_string(item));
+    }
+
+    return strv;
+}
+
+static char *manifest_limits(struct json_object *object, tty_limits *limits) {
+    struct json_object *value;
+
+    if(json_object_object_get_ex(object, "cpu-weight", &value))
+        if((limits->cpu_weight = json_object_get_int(value)) < 1 || limits->cpu_weight > 10000)
+            return "invalid cpu-weight";
+
+    if(json_object_object_get_ex(object, "memory-max", &value))
+        if(parse_size(json_object_get_string(value), &limits->memory_max))
+            return "invalid memory-max";
+
+    if(json_object_object_get_ex(object, "pids-max", &value)) {
+        if(json_object_get_int(value) < 1)
+            return "invalid pids-max";
+
+        limits->pids_max = json_object_get_int(value);
+    }
+
+    if(json_object_object_get_ex(object, "io-weight", &value))
+        if((limits->io_weight = json_object_get_int(value)) < 1 || limits->io_weight > 10000)
+            return "invalid io-weight";
+
+    return NULL;
+}
+
+// parse a process spec (manifest entry or api request), name is
+// optional here, argv and options needs to be freed even on error
+char *process_spec_parse(struct json_object *object, char ***argv, tty_process_options *options) {
+    struct json_object *value;
+    uint64_t scrollback;
+
+    tty_process_options_default(options);
+    *argv = NULL;
+
+    if(json_object_object_get_ex(object, "name", &value)) {
+        if(!json_object_is_type(value, json_type_string))
+            return "invalid name";
+
+        options->name = strdup(json_object_get_string(value));
+    }
+
+    if(!json_object_object_get_ex(object, "argv", &value) || !json_object_is_type(value, json_type_array))
+        return "missing argv";
+
+    if(!(*argv = manifest_strv(value)) || !(*argv)[0])
+        return "invalid argv";
+
+    if(json_object_object_get_ex(object, "env", &value)) {
+        if(!json_object_is_type(value, json_type_object))
+            return "invalid env";
+
+        size_t count = 0;
+        options->env = xmalloc(sizeof(char *) * (json_object_object_length(value) + 1));
+
+        json_object_object_foreach(value, key, val) {
+            const char *str = json_object_get_string(val);
+
+            options->env[count] = xmalloc(strlen(key) + strlen(str) + 2);
+            sprintf(options->env[count++], "%s=%s", key, str);
+        }
+
+        options->env[count] = NULL;
+    }
+
+    if(json_object_object_get_ex(object, "cwd", &value))
+        options->cwd = strdup(json_object_get_string(value));
+
+    if(json_object_object_get_ex(object, "scrollback", &value)) {
+        if(parse_size(json_object_get_string(value), &scrollback) || scrollback < BUF_SIZE)
+            return "invalid scrollback";
+
+        options->scrollback = scrollback;
+    }
+
+    if(json_object_object_get_ex(object, "restart", &value))
+        if(restart_policy_parse(json_object_get_string(value), &options->restart))
+            return "invalid restart policy";
+
+    if(json_object_object_get_ex(object, "max-restarts", &value))
+        if((options->max_restarts = json_object_get_int(value)) < 0)
+            return "invalid max-restarts";
+
+    if(json_object_object_get_ex(object, "restart-window", &value))
+        if((options->restart_window = json_object_get_int(value)) <= 0)
+            return "invalid restart-window";
+
+    if(json_object_object_get_ex(object, "weight", &value)) {
+        options->weight = json_object_get_int(value);
+        if(options->weight < 1 || options->weight > 10000)
+            return "invalid weight";
+    }
+
+    if(json_object_object_get_ex(object, "limits", &value)) {
+        char *error;
+
+        if(!json_object_is_type(value, json_type_object))
+            return "invalid limits";
+
+        if((error = manifest_limits(value, &options->limits)))
+            return error;
+    }
+
+    if(json_object_object_get_ex(object, "depends", &value)) {
+        if(!json_object_is_type(value, json_type_array) || !(options->depends = manifest_strv(value)))
+            return "invalid depends";
+    }
+
+    // recording directory, false disables the default one
+    if(json_object_object_get_ex(object, "record", &value)) {
+        free(options->record);
+        options->record = NULL;
+
+        if(json_object_is_type(value, json_type_string))
+            options->record = strdup(json_object_get_string(value));
+        else if(!json_object_is_type(value, json_type_boolean) || json_object_get_boolean(value))
+            return "invalid record";
+    }
+
+    return NULL;
+}
+
+static char *manifest_entry_parse(struct json_object *object, manifest_entry *entry) {
+    char *error;
+
+    if((error = process_spec_parse(object, &entry->argv, &entry->options)))
+        return error;
+
+    if(entry->options.name == NULL)
+        return "missing name";
+
+    while(entry->argv[entry->argc])
+        entry->argc++;
+
+    return NULL;
+}
+
+static manifest_entry *manifest_lookup(manifest_entry *entries, int count, const char *name) {
+    for(int i = 0; i < count; i++)
+        if(strcmp(entries[i].options.name, name) == 0)
+            return &entries[i];
+
+    return NULL;
+}
+
+// depth-first walk, visiting: 1 in progress, 2 done
+static int manifest_cycle(manifest_entry *entries, int count, int index, char *visiting) {
+    char **depends = entries[index].options.depends;
+
+    if(visiting[index] == 1)
+        return 1;
+
+    if(visiting[index] == 2)
+        return 0;
+
+    visiting[index] = 1;
+
+    for(int i = 0; depends && depends[i]; i++) {
+        manifest_entry *depend = manifest_lookup(entries, count, depends[i]);
+
+        if(manifest_cycle(entries, count, depend - entries, visiting))
+            return 1;
+    }
+
+    visiting[index] = 2;
+
+    return 0;
+}
+
+static manifest_entry *manifest_parse(const char *filename, int *count) {
+    struct json_object *root, *processes;
+    manifest_entry *entries;
+    char *error = NULL;
+    int length, index = 0;
+
+    if(!(root = json_object_from_file(filename))) {
+        fprintf(stderr, "[-] manifest: %s: %s\n", filename, json_util_get_last_err());
+        return NULL;
+    }
+
+    if(!json_object_object_get_ex(root, "processes", &processes) || !json_object_is_type(processes, json_type_array)) {
+        fprintf(stderr, "[-] manifest: %s: missing processes list\n", filename);
+        json_object_put(root);
+        return NULL;
+    }
+
+    length = json_object_array_length(processes);
+    entries = xmalloc(sizeof(manifest_entry) * (length ? length : 1));
+    memset(entries, 0, sizeof(manifest_entry) * (length ? length : 1));
+
+    for(*count = 0; *count < length && !error; (*count)++) {
+        struct json_object *object = json_object_array_get_idx(processes, *count);
+        index = *count;
+
+        if(!json_object_is_type(object, json_type_object))
+            error = "invalid entry";
+        else
+            error = manifest_entry_parse(object, &entries[*count]);
+
+        if(!error && manifest_lookup(entries, *count, entries[*count].options.name))
+            error = "duplicated name";
+    }
+
+    json_object_put(root);
+
+    for(int i = 0; i < *count && !error; i++) {
+        char **depends = entries[i].options.depends;
+        index = i;
+
+        for(int j = 0; depends && depends[j] && !error; j++)
+            if(!manifest_lookup(entries, *count, depends[j]))
+                error = "unknown dependency";
+    }
+
+    if(!error) {
+        char *visiting = xmalloc(*count + 1);
+        memset(visiting, 0, *count + 1);
+
+        for(int i = 0; i < *count && !error; i++) {
+            index = i;
+
+            if(manifest_cycle(entries, *count, i, visiting))
+                error = "dependency cycle";
+        }
+
+        free(visiting);
+    }
+
+    if(error) {
+        fprintf(stderr, "[-] manifest: %s: entry %d: %s\n", filename, index, error);
+        manifest_entries_free(entries, *count);
+        return NULL;
+    }
+
+    return entries;
+}
+
+static bool manifest_string_equal(const char *a, const char *b) {
+    if(a == NULL || b == NULL)
+        return a == b;
+
+    return strcmp(a, b) == 0;
+}
+
+// process still matches its manifest entry
+static bool manifest_entry_equal(manifest_entry *entry, struct tty_process *process) {
+    tty_process_options *a = &entry->options;
+    tty_process_options *b = &process->options;
+
+    return strv_equal(entry->argv, process->argv) &&
+           a->restart == b->restart &&
+           a->max_restarts == b->max_restarts &&
+           a->restart_window == b->restart_window &&
+           memcmp(&a->limits, &b->limits, sizeof(tty_limits)) == 0 &&
+           a->scrollback == b->scrollback &&
+           a->weight == b->weight &&
+           manifest_string_equal(a->cwd, b->cwd) &&
+           strv_equal(a->env, b->env) &&
+           strv_equal(a->depends, b->depends) &&
+           manifest_string_equal(a->record, b->record);
+}
+
+// wait for a stopped process to be terminated before removing it,
+// killed if it is still there after the grace period
+static void manifest_remove(struct tty_process *process) {
+    struct timespec deadline;
+    bool killed = false;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += MANIFEST_STOP_GRACE;
+
+    pthread_mutex_lock(&process->mutex);
+
+    while(process->state != STOPPED && process->state != CRASHED) {
+        if(pthread_cond_timedwait(&process->notifier, &process->mutex, &deadline) != ETIMEDOUT || killed)
+            continue;
+
+        pthread_mutex_unlock(&process->mutex);
+
+        verbose("[-] manifest: %s still running after %ds, killing it\n", process->options.name, MANIFEST_STOP_GRACE);
+        reaper_kill(process, SIGKILL);
+        killed = true;
+
+        pthread_mutex_lock(&process->mutex);
+    }
+
+    pthread_mutex_unlock(&process->mutex);
+
+    process_remove(process);
+}
+
+// apply the manifest: entries removed or changed are stopped,
+// new or changed entries are started, others are left untouched
+//
+// the manifest lock is not held while waiting for processes to
+// terminate, entries are only started if no newer load began
+int manifest_load() {
+    struct tty_process *process, **named;
+    manifest_entry *entries;
+    int count = 0, stale = 0, started = 0;
+
+    pthread_mutex_lock(&manifest_lock);
+
+    if(!(entries = manifest_parse(manifest_filename, &count))) {
+        pthread_mutex_unlock(&manifest_lock);
+        return 1;
+    }
+
+    uint64_t generation = ++manifest_generation;
+
+    server_lock(&server->mutex);
+
+    // collecting processes to remove, they are removed
+    // without server lock (thread needs to be joined)
+    int total = 0;
+    LIST_FOREACH(process, &server->processes, list)
+        total++;
+
+    named = xmalloc(sizeof(struct tty_process *) * (total + 1));
+
+    LIST_FOREACH(process, &server->processes, list) {
+        if(process->options.name == NULL)
+            continue;
+
+        manifest_entry *entry = manifest_lookup(entries, count, process->options.name);
+
+        if(entry == NULL || !manifest_entry_equal(entry, process)) {
+            process_hold(process);
+            named[stale++] = process;
+        }
+    }
+
+    server_unlock(&server->mutex);
+    pthread_mutex_unlock(&manifest_lock);
+
+    // all stopped together, then waited for
+    for(int i = 0; i < stale; i++) {
+        verbose("[+] manifest: stopping %s\n", named[i]->options.name);
+        tty_server_process_stop(named[i]);
+    }
+
+    for(int i = 0; i < stale; i++) {
+        manifest_remove(named[i]);
+        process_release(named[i]);
+    }
+
+    free(named);
+
+    pthread_mutex_lock(&manifest_lock);
+
+    for(int i = 0; i < count && generation == manifest_generation; i++) {
+        server_lock(&server->mutex);
+        process = process_getby_name(entries[i].options.name);
+        server_unlock(&server->mutex);
+
+        if(process)
+            continue;
+
+        verbose("[+] manifest: starting %s: %s\n", entries[i].options.name, entries[i].argv[0]);
+        tty_server_process_start(server, entries[i].argc, entries[i].argv, &entries[i].options);
+        started++;
+    }
+
+    if(generation != manifest_generation)
+        verbose("[-] manifest: reloaded meanwhile, starting entries left to the last load\n");
+
+    verbose("[+] manifest: %d entries, %d stopped, %d started\n", count, stale, started);
+    manifest_entries_free(entries, count);
+
+    pthread_mutex_unlock(&manifest_lock);
+
+    return 0;
+}
+
+static void *manifest_reloader(void *args) {
+    while(1) {
+        if(sem_wait(&manifest_reload) < 0) {
+            if(errno == EINTR)
+                continue;
+
+            warnp("manifest: sem_wait");
+            break;
+        }
+
+        verbose("[+] manifest: reloading %s\n", manifest_filename);
+        manifest_load();
+    }
+
+    return NULL;
+}
+
+// SIGHUP, sem_post is async-signal-safe
+static void manifest_signal(int sig) {
+    sem_post(&manifest_reload);
+}
+
+int manifest_init(const char *filename) {
+    manifest_filename = strdup(filename);
+
+    if(sem_init(&manifest_reload, 0, 0) < 0) {
+        warnp("manifest: sem_init");
+        return 1;
+    }
+
+    if(pthread_create(&manifest_thread, NULL, manifest_reloader, NULL)) {
+        warnp("manifest: pthread_create");
+        return 1;
+    }
+
+    pthread_detach(manifest_thread);
+    signal(SIGHUP, manifest_signal);
+
+    return 0;
+}
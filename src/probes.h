@@ -0,0 +1,57 @@
+#ifndef TFMUX_PROBES_H
+#define TFMUX_PROBES_H
+
+//
+// static tracepoints
+//
+// USDT probes (provider "tfmux") on the hot paths, a probe is a nop
+// instruction until a tracer (bpftrace, perf, systemtap) attaches to
+// it, see tools/*.bt, compiled out when sys/sdt.h is not available
+//
+//   pty__read(id, length)              pty output read (select or io_uring reader)
+//   ring__commit(ring, length, written) bytes committed into a logs ring
+//   fanout__enqueue(id, tsi)           service thread woken up for a client
+//   ws__write(id, length, offset)      output frame written to a websocket
+//   input__write(id, length)           websocket input written to a pty
+//   process__spawn(id, pid)            process forked
+//   process__exit(id, pid, wstatus)    process exited
+//   lock__acquire(mutex)               server mutex wanted
+//   lock__acquired(mutex)              server mutex held (again, after a wait)
+//   lock__release(mutex)               server mutex released (or waiting)
+//   http__route(method, path)          http route handler called
+//   http__route__done(method, path, value) http route handler returned
+//
+#ifdef WITH_SDT
+#include <sys/sdt.h>
+
+#define PROBE0(name) DTRACE_PROBE(tfmux, name)
+#define PROBE1(name, a) DTRACE_PROBE1(tfmux, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(tfmux, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(tfmux, name, a, b, c)
+#else
+#define PROBE0(name) do { } while(0)
+#define PROBE1(name, a) do { } while(0)
+#define PROBE2(name, a, b) do { } while(0)
+#define PROBE3(name, a, b, c) do { } while(0)
+#endif
+
+// server mutex, waiting and holding time traced
+#define server_lock(mutex) do { \
+    PROBE1(lock__acquire, (mutex)); \
+    pthread_mutex_lock(mutex); \
+    PROBE1(lock__acquired, (mutex)); \
+} while(0)
+
+#define server_unlock(mutex) do { \
+    pthread_mutex_unlock(mutex); \
+    PROBE1(lock__release, (mutex)); \
+} while(0)
+
+// condition wait, the mutex is released while waiting
+#define server_timedwait(cond, mutex, deadline) do { \
+    PROBE1(lock__release, (mutex)); \
+    pthread_cond_timedwait(cond, mutex, deadline); \
+    PROBE1(lock__acquired, (mutex)); \
+} while(0)
+
+#endif
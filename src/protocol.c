@@ -11,6 +11,7 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <pthread.h>
+#include <time.h>
 
 #if defined(__OpenBSD__) || defined(__APPLE__)
 #include <util.h>
@@ -24,6 +25,7 @@
 #include <json.h>
 
 #include "server.h"
+#include "probes.h"
 #include "utils.h"
 
 // initial message list
@@ -33,16 +35,14 @@ char initial_cmds[] = {
     SET_PREFERENCES
 };
 
+// process is the one the client is attached to, referenced by the client
 int
-send_initial_message(struct lws *wsi, int index) {
+send_initial_message(struct lws *wsi, struct tty_process *process, int index) {
     unsigned char message[LWS_PRE + 1 + 4096];
     unsigned char *p = &message[LWS_PRE];
     char buffer[128];
     int n = 0;
 
-    // FIXME
-    struct tty_process *process = LIST_FIRST(&server->processes);
-
     char cmd = initial_cmds[index];
     switch(cmd) {
         case SET_WINDOW_TITLE:
@@ -119,18 +119,45 @@ check_host_origin(struct lws *wsi) {
     return len > 0 && strcasecmp(buf, host_buf) == 0;
 }
 
+static void
+tty_client_event(struct tty_client *client, const char *type) {
+    struct json_object *event = json_object_new_object();
+    json_object_object_add(event, "address", json_object_new_string(client->address));
+    json_object_object_add(event, "clients", json_object_new_int(server->client_count));
+
+    events_emit(type, client->process->id, event);
+}
+
 void
 tty_client_remove(struct tty_client *client) {
-    pthread_mutex_lock(&server->mutex);
+    bool found = false;
+
+    server_lock(&server->mutex);
     struct tty_client *iterator;
     LIST_FOREACH(iterator, &server->clients, list) {
         if (iterator == client) {
             LIST_REMOVE(iterator, list);
             server->client_count--;
+
+            // service list is only used by this thread
+            LIST_REMOVE(client, service);
+            sched_remove(client);
+
+            pthread_mutex_lock(&client->process->mutex);
+            LIST_REMOVE(client, viewers);
+            latency_detach(client);
+            pthread_mutex_unlock(&client->process->mutex);
+
+            tty_client_event(client, "detach");
+            found = true;
             break;
         }
     }
-    pthread_mutex_unlock(&server->mutex);
+    server_unlock(&server->mutex);
+
+    // process can be freed now if it was removed
+    if(found)
+        process_release(client->process);
 }
 
 void
@@ -172,40 +199,185 @@ cleanup:
     tty_client_remove(client);
 }
 
-void * mainthread_run_command(void *args) {
-    fd_set des_set;
-    int pty = 0;
-    pid_t pid;
+// read pty output straight into the process logs and notify attached
+// clients, they will fetch data from logs themselves when writable
+// returns the read length, zero or negative means the pty is gone
+static ssize_t process_pty_forward(struct tty_process *process) {
+    struct iovec iov[2];
+    ssize_t pty_len;
 
-    struct tty_process *process = (struct tty_process *) args;
+    pthread_mutex_lock(&process->mutex);
+
+    int count = circular_reserve(process->logs, iov, BUF_SIZE);
+    pty_len = readv(process->pty, iov, count);
+    PROBE2(pty__read, process->id, pty_len);
+
+    if(pty_len > 0)
+        circular_commit(process->logs, pty_len);
+
+    pthread_mutex_unlock(&process->mutex);
+
+    if(pty_len <= 0) {
+        if(pty_len < 0 && errno != EIO)
+            warnp("mainthread_run_command: read");
+
+        return pty_len;
+    }
+
+    process_output(process, pty_len);
+
+    return pty_len;
+}
+
+// new data committed into process logs, notify attached clients
+//
+// writable requests can only be issued from the thread servicing the
+// client connection, clients are flagged and their service thread is
+// woken up once, it then requests writable callbacks itself
+void process_output(struct tty_process *process, size_t length) {
     struct tty_server *server = process->server;
+    struct tty_client *client;
+
+    __atomic_add_fetch(&process->output_bytes, length, __ATOMIC_RELAXED);
 
-    // let's do our job
     pthread_mutex_lock(&process->mutex);
+    latency_output(process, length);
+
+    LIST_FOREACH(client, &process->viewers, viewers) {
+        if(__atomic_exchange_n(&client->pending, true, __ATOMIC_SEQ_CST))
+            continue;
+
+        tty_service *service = &server->services[client->tsi];
+        PROBE2(fanout__enqueue, process->id, client->tsi);
+
+        // service thread already notified
+        if(__atomic_exchange_n(&service->pending, true, __ATOMIC_SEQ_CST))
+            continue;
+
+        lws_cancel_service_pt(client->wsi);
+    }
 
-    if((pid = forkpty(&pty, NULL, NULL, NULL)) < 0)
-        return warnp("forkpty");
+    pthread_mutex_unlock(&process->mutex);
+
+    control_notify(process);
+    watch_feed(process);
+    record_feed(process);
+}
+
+// process removed, its clients are closed by their service thread,
+// they keep a reference on it until then
+void process_viewers_close(struct tty_process *process) {
+    struct tty_client *client;
+
+    pthread_mutex_lock(&process->mutex);
+
+    LIST_FOREACH(client, &process->viewers, viewers) {
+        __atomic_store_n(&client->closing, true, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&client->pending, true, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&server->services[client->tsi].pending, true, __ATOMIC_SEQ_CST);
+
+        lws_cancel_service_pt(client->wsi);
+    }
+
+    pthread_mutex_unlock(&process->mutex);
+}
+
+// called on the service thread when woken up by process output
+void service_flush(int tsi) {
+    tty_service *service = &server->services[tsi];
+    struct tty_client *client;
+
+    // flag is cleared first, output notified while
+    // scanning will wake the thread up again
+    if(!__atomic_exchange_n(&service->pending, false, __ATOMIC_SEQ_CST))
+        return;
+
+    LIST_FOREACH(client, &service->clients, service) {
+        if(!__atomic_exchange_n(&client->pending, false, __ATOMIC_SEQ_CST))
+            continue;
+
+        // closed from its writable callback
+        if(__atomic_load_n(&client->closing, __ATOMIC_SEQ_CST)) {
+            lws_callback_on_writable(client->wsi);
+            continue;
+        }
+
+        if(client->running)
+            sched_wakeup(client);
+    }
+}
+
+// forward whatever is still pending on the pty once the process is gone
+static void process_pty_drain(struct tty_process *process) {
+    fd_set des_set;
+
+    while(1) {
+        FD_ZERO (&des_set);
+        FD_SET (process->pty, &des_set);
+        struct timeval tv = { 0, 0 };
+
+        if(select(process->pty + 1, &des_set, NULL, NULL, &tv) <= 0)
+            return;
+
+        if(process_pty_forward(process) <= 0)
+            return;
+    }
+}
+
+// fork the command on a new pty, process mutex must be held
+static int process_spawn(struct tty_process *process) {
+    struct tty_server *server = process->server;
+    struct winsize *size = NULL;
+    int pty = 0;
+    pid_t pid;
+
+    // restoring last known window size on restart
+    if(process->size.ws_col > 0 && process->size.ws_row > 0)
+        size = &process->size;
+
+    if((pid = forkpty(&pty, NULL, NULL, size)) < 0) {
+        warnp("forkpty");
+        return 1;
+    }
 
     process->state = STARTING;
 
+    if(pid > 0)
+        PROBE2(process__spawn, process->id, pid);
+
     if(pid == 0) {
         if(setenv("TERM", server->terminal_type, true) < 0) {
             perror("setenv");
             pthread_exit((void *) 1);
         }
 
+        for(char **env = process->options.env; env && *env; env++) {
+            if(putenv(*env) < 0) {
+                perror("putenv");
+                pthread_exit((void *) 1);
+            }
+        }
+
+        if(process->options.cwd && chdir(process->options.cwd) < 0) {
+            *process->error = strerror(errno);
+            perror("chdir");
+            pthread_exit((void *) 1);
+        }
+
         printf("[+] =============================================\n");
         printf("[+] tfmux: initializing subprocess\n");
         printf("[+] tfmux: starting: %s\n", process->argv[0]);
         printf("[+] =============================================\n");
 
+        limits_enter(process);
+
         if(execvp(process->argv[0], process->argv) < 0) {
             *process->error = strerror(errno);
             warnp("execvp");
             pthread_exit((void *) 1);
         }
 
-        return NULL;
+        return 1;
     }
 
     verbose("[+] subprocess: started process, pid: %d, pty: %d\n", pid, pty);
@@ -213,84 +385,222 @@ void * mainthread_run_command(void *args) {
     process->pty = pty;
     process->running = true;
     process->state = RUNNING;
+    process->restart.started = time(NULL);
+    process_changed(process);
 
-    // we are ready, let notify this
-    pthread_cond_signal(&process->notifier);
-    pthread_mutex_unlock(&process->mutex);
+    return 0;
+}
+
+// forward pty output until the child exits and has been reaped
+static void process_pump(struct tty_process *process, int reaped) {
+    fd_set des_set;
+    int pty = process->pty;
+    int nfds = (pty > process->wakeup ? pty : process->wakeup) + 1;
+
+    // pty read by the io_uring engine, waiting for it to finish
+    if(process->server->io_uring && uring_pump(process) == 0)
+        goto drain;
 
     while(process->running) {
         FD_ZERO (&des_set);
         FD_SET (pty, &des_set);
-        struct timeval tv = { 1, 0 };
+        FD_SET (process->wakeup, &des_set);
 
-        int ret = select(pty + 1, &des_set, NULL, NULL, &tv);
-        if (ret == 0) continue;
+        // no timeout needed, reaper and stop request wake us up
+        int ret = select(nfds, &des_set, NULL, NULL, NULL);
+        if (ret < 0 && errno == EINTR) continue;
         if (ret < 0) break;
 
+        if (FD_ISSET (process->wakeup, &des_set)) {
+            uint64_t value;
+            if(read(process->wakeup, &value, sizeof(value)) < 0)
+                warnp("mainthread_run_command: wakeup");
+        }
+
         if (FD_ISSET (pty, &des_set)) {
-            pthread_mutex_lock(&server->mutex);
+            if(process_pty_forward(process) <= 0)
+                break;
+        }
+    }
 
-            char pty_buffer[BUF_SIZE];
-            ssize_t pty_len;
+drain:
+    // sending last output written before exit
+    process_pty_drain(process);
 
-            memset(pty_buffer, 0, sizeof(pty_buffer));
-            pty_len = read(pty, pty_buffer, sizeof(pty_buffer));
+    // locking process
+    pthread_mutex_lock(&process->mutex);
 
-            if(pty_len < 0) {
-                warnp("mainthread_run_command: read");
-                process->running = false;
-                goto try_again;
-            }
+    if(!reaped) {
+        // fetching information about exit
+        pthread_mutex_unlock(&process->mutex);
+        reaper_wait(process);
+        pthread_mutex_lock(&process->mutex);
+    }
 
-            // keeping logs into our circular buffer
-            circular_append(process->logs, pty_buffer, pty_len);
+    // waiting for the reaper to flag the process as terminated
+    while(process->state == RUNNING || process->state == STOPPING)
+        pthread_cond_wait(&process->notifier, &process->mutex);
 
-            struct tty_client *client;
-            LIST_FOREACH(client, &server->clients, list) {
-                // printf("trying sending to client (%d bytes)\n", pty_len);
-                pthread_mutex_lock(&client->mutex);
+    process->pty = -1;
+    close(pty);
 
-                if(!client->running || client->pid != process->pid) {
-                    pthread_mutex_unlock(&client->mutex);
-                    continue;
-                }
+    // unlocking process
+    pthread_mutex_unlock(&process->mutex);
+}
 
-                memcpy(client->pty_buffer + LWS_PRE + 1, pty_buffer, pty_len);
-                client->pty_len = pty_len;
-                client->state = STATE_READY;
+// sleep until the restart delay expires, returns non-zero
+// if the process should not be restarted anymore
+static int process_restart_wait(struct tty_process *process) {
+    struct timespec deadline;
 
-                // printf("running %d, state: %d, request callback\n", client->running, client->state);
-                lws_callback_on_writable(client->wsi);
-                pthread_mutex_unlock(&client->mutex);
+    pthread_mutex_lock(&process->mutex);
 
-                while(client->state != STATE_DONE) {
-                    // delay write
-                    lws_callback_on_writable(client->wsi);
-                }
-            }
+    if(process->state != RESTARTING) {
+        pthread_mutex_unlock(&process->mutex);
+        return 1;
+    }
+
+    int delay = process_restart_delay(process);
+    verbose("[+] subprocess: restarting %lu in %d ms\n", process->id, delay);
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += delay / 1000;
+    deadline.tv_nsec += (delay % 1000) * 1000000L;
+
+    if(deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    // a stop request cancels the restart
+    while(process->state == RESTARTING) {
+        if(pthread_cond_timedwait(&process->notifier, &process->mutex, &deadline) == ETIMEDOUT)
+            break;
+    }
+
+    if(process->state != RESTARTING) {
+        pthread_mutex_unlock(&process->mutex);
+        return 1;
+    }
+
+    *process->error = NULL;
+    process->restart.restarts++;
+
+    pthread_mutex_unlock(&process->mutex);
+
+    return 0;
+}
+
+// wait until every dependency is running, returns non-zero if the
+// process should not be started (stopped meanwhile or dependency failed)
+static int process_depends_wait(struct tty_process *process) {
+    struct timespec deadline;
+    char **depends = process->options.depends;
+    int failed = 0;
+
+    if(depends == NULL)
+        return 0;
+
+    server_lock(&server->mutex);
+
+    for(int i = 0; depends[i] && !failed && !force_exit; ) {
+        struct tty_process *depend = process_getby_name(depends[i]);
+        tty_process_state state = depend ? depend->state : CRASHED;
+
+        if(process->state != CREATED) {
+            failed = 1;
+            break;
         }
 
-        try_again:
-        pthread_mutex_unlock(&server->mutex);
+        if(state == RUNNING) {
+            i++;
+            continue;
+        }
+
+        if(state == STOPPED || state == CRASHED) {
+            verbose("[-] subprocess: %s: dependency %s not running\n", process->options.name, depends[i]);
+            failed = 1;
+            break;
+        }
+
+        // changes are broadcasted without server mutex, a
+        // wakeup can be missed, checking again periodically
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 1;
+
+        server_timedwait(&server->changed, &server->mutex, &deadline);
     }
 
-    // locking process
-    pthread_mutex_lock(&process->mutex);
+    server_unlock(&server->mutex);
 
-    // fetching information about exit
-    pid_t value = waitpid(process->pid, &process->wstatus, 0);
-    if(value < 0)
-        warnp("mainthread_run_command: waitpid");
+    if(!failed && !force_exit)
+        return 0;
 
-    // setting flags
-    process->state = STOPPED;
+    pthread_mutex_lock(&process->mutex);
 
-    if(*process->error)
+    if(process->state == CREATED) {
+        *process->error = "dependency not running";
         process->state = CRASHED;
+        process_changed(process);
+        pthread_cond_broadcast(&process->notifier);
+    }
 
-    // unlocking process
     pthread_mutex_unlock(&process->mutex);
 
+    return 1;
+}
+
+void * mainthread_run_command(void *args) {
+    struct tty_process *process = (struct tty_process *) args;
+
+    // process handed over by a previous instance (hot restart)
+    int adopted = (process->state != CREATED);
+
+    // not running anymore when handed over, only a pending
+    // restart needs to be honored
+    if(adopted && !process->running && process_restart_wait(process))
+        pthread_exit((void *) 0);
+
+    // dependencies are only honored for the first start
+    if(!adopted && process_depends_wait(process))
+        pthread_exit((void *) 0);
+
+    while(1) {
+        // let's do our job
+        pthread_mutex_lock(&process->mutex);
+
+        if(adopted && process->running) {
+            verbose("[+] subprocess: adopted process, pid: %d, pty: %d\n", process->pid, process->pty);
+            adopted = 0;
+
+        } else if(process->state == STOPPED) {
+            // stopped before being started
+            pthread_mutex_unlock(&process->mutex);
+            break;
+
+        } else if(process_spawn(process)) {
+            process->state = CRASHED;
+            process_changed(process);
+            pthread_cond_broadcast(&process->notifier);
+            pthread_mutex_unlock(&process->mutex);
+            break;
+        }
+
+        // exit status will be collected by the reaper if available
+        int reaped = (reaper_watch(process) == 0);
+
+        // we are ready, let notify this
+        pthread_cond_broadcast(&process->notifier);
+        pthread_mutex_unlock(&process->mutex);
+
+        process_pump(process, reaped);
+
+        // same process (id, logs, clients) is restarted
+        // according to its restart policy
+        if(process_restart_wait(process))
+            break;
+    }
+
     pthread_exit((void *) 0);
 }
 
@@ -324,21 +634,23 @@ int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user,
             size_t iid = strtoul(buf + sizeof(WS_PATH), NULL, 10);
             verbose("[+] callback: tty: request id: %lu\n", iid);
 
+            // reference released once the client is removed
             struct tty_process *process;
-            if(!(process = process_getby_id(iid))) {
+            if(!(process = process_lookup(iid))) {
                 verbose("[+$ callback: tty: invalid id, closing connection\n");
                 return 1;
             }
 
-            client->process = process;
-            client->pid = process->pid;
-            client->pty = process->pty;
-
             if(server->check_origin && !check_host_origin(wsi)) {
                 verbose("[-] callback: tty: refuse to serve ws client from different origin due to the --check-origin option\n");
+                process_release(process);
                 return 1;
             }
 
+            client->process = process;
+            client->pid = process->pid;
+            client->pty = process->pty;
+
             break;
 
         case LWS_CALLBACK_ESTABLISHED:
@@ -349,7 +661,6 @@ int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user,
             client->wsi = wsi;
             client->buffer = NULL;
             client->state = STATE_INIT;
-            client->pty_len = 0;
 
             pthread_mutex_init(&client->mutex, NULL);
             pthread_cond_init(&client->cond, NULL);
@@ -357,29 +668,50 @@ int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user,
                                    client->hostname, sizeof(client->hostname),
                                    client->address, sizeof(client->address));
 
-            pthread_mutex_lock(&server->mutex);
+            server_lock(&server->mutex);
             LIST_INSERT_HEAD(&server->clients, client, list);
             server->client_count++;
             lws_hdr_copy(wsi, buf, sizeof(buf), WSI_TOKEN_GET_URI);
 
             verbose("[+] callback: tty: established: %s - %s (%s), clients: %d\n", buf, client->address, client->hostname, server->client_count);
 
-            // sending initial logs
-            buffer_t *logs = circular_get(client->process->logs, 0);
-
-            memcpy(client->pty_buffer + LWS_PRE + 1, logs->buffer, logs->length);
-            client->pty_len = logs->length;
+            // connection stays on the thread which accepted it
+            client->tsi = lws_get_tsi(wsi);
+            client->pending = false;
+            client->closing = false;
+            client->queued = false;
+            client->granted = false;
+            client->deficit = 0;
+            client->probing = false;
+            client->ping_length = 0;
+            memset(&client->latency, 0, sizeof(client->latency));
+            LIST_INSERT_HEAD(&server->services[client->tsi].clients, client, service);
+
+            // initial logs are sent from the oldest data available
+            pthread_mutex_lock(&client->process->mutex);
+            client->offset = circular_first(client->process->logs);
             client->state = STATE_READY;
+            LIST_INSERT_HEAD(&client->process->viewers, client, viewers);
+            pthread_mutex_unlock(&client->process->mutex);
+
+            // removed since the lookup, viewers were already closed
+            if(client->process->removed) {
+                client->closing = true;
+                lws_callback_on_writable(wsi);
+            }
 
-            pthread_mutex_unlock(&server->mutex);
+            tty_client_event(client, "attach");
 
-            // sending effective data
-            lws_callback_on_writable(client->wsi);
-            buffer_free(logs);
+            server_unlock(&server->mutex);
 
             break;
 
         case LWS_CALLBACK_SERVER_WRITEABLE:
+            if (__atomic_load_n(&client->closing, __ATOMIC_SEQ_CST)) {
+                lws_close_reason(wsi, LWS_CLOSE_STATUS_GOINGAWAY, (unsigned char *) "process removed", 15);
+                return -1;
+            }
+
             if (!client->initialized) {
                 if (client->initial_cmd_index == sizeof(initial_cmds)) {
                     client->initialized = true;
@@ -387,7 +719,7 @@ int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user,
                     break;
                 }
 
-                if (send_initial_message(wsi, client->initial_cmd_index) < 0) {
+                if (send_initial_message(wsi, client->process, client->initial_cmd_index) < 0) {
                     lws_close_reason(wsi, LWS_CLOSE_STATUS_UNEXPECTED_CONDITION, NULL, 0);
                     return -1;
                 }
@@ -397,29 +729,65 @@ int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user,
                 return 0;
             }
 
-            if (client->state != STATE_READY)
+            if (client->state != STATE_READY || !client->running) {
+                sched_remove(client);
                 break;
+            }
 
-            pthread_mutex_lock(&client->mutex);
+            // pong first, output continues on the next callback
+            if (client->ping_length) {
+                unsigned char pong[LWS_PRE + 1 + sizeof(client->ping)];
 
-            // read error or client exited, close connection
-            if (client->pty_len <= 0) {
-                lws_close_reason(wsi,
-                                 client->pty_len == 0 ? LWS_CLOSE_STATUS_NORMAL
-                                                       : LWS_CLOSE_STATUS_UNEXPECTED_CONDITION,
-                                 NULL, 0);
-                return -1;
-            }
+                pong[LWS_PRE] = PONG;
+                memcpy(pong + LWS_PRE + 1, client->ping, client->ping_length);
+
+                if (lws_write(wsi, pong + LWS_PRE, client->ping_length + 1, LWS_WRITE_BINARY) < (int) (client->ping_length + 1))
+                    fprintf(stderr, "[-] callback: tty: writable: could not write pong to ws\n");
 
-            client->pty_buffer[LWS_PRE] = OUTPUT;
-            n = (size_t) (client->pty_len + 1);
-            if (lws_write(wsi, (unsigned char *) client->pty_buffer + LWS_PRE, n, LWS_WRITE_BINARY) < n) {
-                fprintf(stderr, "[-] callback: tty: writable: could not write data to ws\n");
+                client->ping_length = 0;
+                lws_callback_on_writable(wsi);
+                break;
             }
 
-            client->state = STATE_DONE;
+            {
+                struct tty_process *process = client->process;
+                unsigned char message[LWS_PRE + 1 + BUF_SIZE];
+                size_t budget = sched_budget(client);
+                uint64_t written;
+
+                // backlogged, waiting for its turn
+                if (budget == 0)
+                    break;
+
+                // copying pending data from process logs, client too
+                // far behind lose data overwritten in the meantime
+                pthread_mutex_lock(&process->mutex);
+
+                if (client->offset < circular_first(process->logs))
+                    client->offset = circular_first(process->logs);
+
+                n = circular_read(process->logs, client->offset, (char *) message + LWS_PRE + 1, budget);
+                written = process->logs->written;
+
+                pthread_mutex_unlock(&process->mutex);
+
+                if (n == 0) {
+                    sched_written(client, 0, 0);
+                    break;
+                }
+
+                message[LWS_PRE] = OUTPUT;
+                if (lws_write(wsi, message + LWS_PRE, n + 1, LWS_WRITE_BINARY) < (int) (n + 1)) {
+                    fprintf(stderr, "[-] callback: tty: writable: could not write data to ws\n");
+                }
+
+                client->offset += n;
+                PROBE3(ws__write, process->id, n, client->offset);
+                latency_sent(client);
 
-            pthread_mutex_unlock(&client->mutex);
+                // next frame scheduled with other clients backlogs
+                sched_written(client, n, written - client->offset);
+            }
             break;
 
         case LWS_CALLBACK_RECEIVE:
@@ -448,21 +816,27 @@ int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user,
 
             switch (command) {
                 case INPUT:
-                    if (client->pty == 0)
+                    if (client->process->pty < 0)
                         break;
                     if (server->readonly)
                         return 0;
-                    if (write(client->pty, client->buffer + 1, client->len - 1) == -1) {
+
+                    uint64_t received = server->latency ? latency_now() : 0;
+
+                    if (uring_write(client->process, client->buffer + 1, client->len - 1) < 0) {
                         warnp("callback: tty: write input to pty failed");
                         lws_close_reason(wsi, LWS_CLOSE_STATUS_UNEXPECTED_CONDITION, NULL, 0);
                         return -1;
                     }
+
+                    latency_input(client, received);
+                    break;
+                case PING:
+                    latency_ping(client, client->buffer + 1, client->len - 1);
                     break;
                 case RESIZE_TERMINAL:
-                    if (parse_window_size(client->buffer + 1, &client->size) && client->pty > 0) {
-                        if (ioctl(client->pty, TIOCSWINSZ, &client->size) == -1) {
-                            warnp("ioctl TIOCSWINSZ");
-                        }
+                    if (parse_window_size(client->buffer + 1, &client->size)) {
+                        process_resize(client->process, &client->size);
                     }
                     break;
 
@@ -495,6 +869,9 @@ int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user,
 
                     client->running = true;
 
+                    // client is ready, sending pending logs
+                    lws_callback_on_writable(wsi);
+
                     break;
 
                 default:
@@ -508,6 +885,13 @@ int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user,
             }
             break;
 
+        case LWS_CALLBACK_EVENT_WAIT_CANCELLED:
+            service_flush(lws_get_tsi(wsi));
+            events_flush(lws_get_tsi(wsi));
+            search_flush(lws_get_tsi(wsi));
+            http_flush(lws_get_tsi(wsi));
+            break;
+
         case LWS_CALLBACK_CLOSED:
             tty_client_destroy(client);
             verbose("[+] callback: tty: ws closed from %s (%s), clients: %d\n", client->address, client->hostname, server->client_count);
@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <libwebsockets.h>
+
+#include "server.h"
+#include "utils.h"
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+#define REAPER_EVENTS 32
+
+//
+// central child reaper
+//
+// every running process gets a pidfd registered into one epoll set,
+// a single thread waits on it and collects exit status as soon as the
+// kernel flags the child as terminated, there is no per-process polling
+//
+// children are only reaped under the reaper lock, a hot restart
+// suspends reaping so that no child handed over is already reaped
+//
+static int reaper_epoll = -1;
+static pthread_t reaper_thread;
+static pthread_mutex_t reaper_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reaper_resumed = PTHREAD_COND_INITIALIZER;
+static bool reaper_suspended;
+
+static int reaper_pidfd_open(pid_t pid) {
+    return (int) syscall(SYS_pidfd_open, pid, 0);
+}
+
+// reaper lock must be held
+static void reaper_collect(struct tty_process *process) {
+    int wstatus = 0;
+    pid_t value;
+
+    while((value = waitpid(process->pid, &wstatus, WNOHANG)) < 0 && errno == EINTR)
+        ;
+
+    // spurious wakeup, child is still alive
+    if(value == 0)
+        return;
+
+    if(value < 0)
+        warnp("reaper: waitpid");
+
+    epoll_ctl(reaper_epoll, EPOLL_CTL_DEL, process->pidfd, NULL);
+    close(process->pidfd);
+    process->pidfd = -1;
+
+    verbose("[+] reaper: process %d exited, status: %d\n", process->pid, wstatus);
+    process_exited(process, wstatus);
+}
+
+static void *reaper_run(void *args) {
+    struct epoll_event events[REAPER_EVENTS];
+
+    while(1) {
+        int n = epoll_wait(reaper_epoll, events, REAPER_EVENTS, -1);
+
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+
+            warnp("reaper: epoll_wait");
+            break;
+        }
+
+        pthread_mutex_lock(&reaper_lock);
+
+        // exits are collected once resumed, pidfds stay readable
+        while(reaper_suspended)
+            pthread_cond_wait(&reaper_resumed, &reaper_lock);
+
+        for(int i = 0; i < n; i++)
+            reaper_collect((struct tty_process *) events[i].data.ptr);
+
+        pthread_mutex_unlock(&reaper_lock);
+    }
+
+    return NULL;
+}
+
+int reaper_init() {
+    // checking pidfd support on this kernel (linux 5.3+)
+    int pidfd = reaper_pidfd_open(getpid());
+    if(pidfd < 0) {
+        verbose("[-] reaper: pidfd not supported, falling back to per-process waitpid\n");
+        return 1;
+    }
+
+    close(pidfd);
+
+    if((reaper_epoll = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        warnp("reaper: epoll_create1");
+        return 1;
+    }
+
+    if(pthread_create(&reaper_thread, NULL, reaper_run, NULL)) {
+        warnp("reaper: pthread_create");
+        close(reaper_epoll);
+        reaper_epoll = -1;
+        return 1;
+    }
+
+    pthread_detach(reaper_thread);
+    verbose("[+] reaper: watching processes with pidfd\n");
+
+    return 0;
+}
+
+// register a freshly started process to the reaper, returns
+// non-zero if the caller needs to reap the process itself
+int reaper_watch(struct tty_process *process) {
+    struct epoll_event event;
+
+    if(reaper_epoll < 0)
+        return 1;
+
+    if((process->pidfd = reaper_pidfd_open(process->pid)) < 0) {
+        warnp("reaper: pidfd_open");
+        return 1;
+    }
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = process;
+
+    if(epoll_ctl(reaper_epoll, EPOLL_CTL_ADD, process->pidfd, &event) < 0) {
+        warnp("reaper: epoll_ctl");
+        close(process->pidfd);
+        process->pidfd = -1;
+        return 1;
+    }
+
+    return 0;
+}
+
+// fallback without pidfd, the process thread waits for its child
+// without reaping it, it is reaped once reaping is not suspended
+void reaper_wait(struct tty_process *process) {
+    siginfo_t info;
+    int wstatus = 0;
+
+    while(waitid(P_PID, process->pid, &info, WEXITED | WNOWAIT) < 0) {
+        if(errno != EINTR) {
+            warnp("reaper: waitid");
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&reaper_lock);
+
+    while(reaper_suspended)
+        pthread_cond_wait(&reaper_resumed, &reaper_lock);
+
+    if(waitpid(process->pid, &wstatus, 0) < 0)
+        warnp("reaper: waitpid");
+
+    process_exited(process, wstatus);
+
+    pthread_mutex_unlock(&reaper_lock);
+}
+
+// no child is reaped anymore once returning (hot restart)
+void reaper_suspend() {
+    pthread_mutex_lock(&reaper_lock);
+    reaper_suspended = true;
+    pthread_mutex_unlock(&reaper_lock);
+}
+
+void reaper_resume() {
+    pthread_mutex_lock(&reaper_lock);
+    reaper_suspended = false;
+    pthread_cond_broadcast(&reaper_resumed);
+    pthread_mutex_unlock(&reaper_lock);
+}
+
+// signal a child not reaped yet, its pid cannot be reused meanwhile
+// since reaping and the final state change happen under the reaper lock
+int reaper_kill(struct tty_process *process, int sig) {
+    int value = -1;
+
+    pthread_mutex_lock(&reaper_lock);
+    pthread_mutex_lock(&process->mutex);
+
+    if(process->pid > 0 && (process->state == RUNNING || process->state == STOPPING))
+        value = kill(process->pid, sig);
+
+    pthread_mutex_unlock(&process->mutex);
+    pthread_mutex_unlock(&reaper_lock);
+
+    return value;
+}
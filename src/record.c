@@ -0,0 +1,716 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/queue.h>
+
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#include <libwebsockets.h>
+#include <json.h>
+
+#include "server.h"
+#include "utils.h"
+
+//
+// session recording
+//
+// processes with a recording directory get their output, input and
+// window changes written as an asciicast v2 file, the pty reader and
+// input paths only copy and enqueue events, a single writer thread
+// formats them and writes them by segments
+//
+// each segment is an independent zstd frame (plain text without zstd),
+// the file is then a regular zstd stream (zstdcat gives the asciicast
+// back) and a segment can be read on its own, segments (time, offset,
+// length) are listed in a sidecar index file and kept in memory for
+// replay seeking
+//
+// a recording is referenced by its process, by every queued event and
+// by readers (replay, listing), process->record is swapped under the
+// process mutex, the file is closed by the writer once the recording
+// is stopped and memory released with the last reference
+//
+#define RECORD_SEGMENT_SIZE 262144     // events formatted before writing a segment
+#define RECORD_SEGMENT_TIME 10         // seconds before a pending segment is written
+#define RECORD_QUEUE_MAX 67108864      // bytes waiting for the writer, dropped beyond
+#define RECORD_LEVEL 3                 // zstd compression level
+
+#ifdef WITH_ZSTD
+#define RECORD_EXTENSION ".cast.zst"
+#else
+#define RECORD_EXTENSION ".cast"
+#endif
+
+typedef struct record_segment {
+    double time;                   // first event time
+    uint64_t offset;               // file offset
+    uint32_t length;               // stored length
+    uint32_t size;                 // events length
+
+} record_segment;
+
+struct tty_record {
+    size_t id;                     // process id
+    char *path;                    // recording file
+    int fd;
+    FILE *index;                   // segments index file
+    char *header;                  // asciicast header line
+    struct timespec started;
+    uint64_t offset;               // logs recorded up to (pty reader only)
+
+    char *pending;                 // events not written yet (writer)
+    size_t pending_length;
+    size_t pending_size;
+    double pending_time;           // first pending event time
+    char carry[4];                 // incomplete utf-8 sequence (writer)
+    size_t carry_length;
+
+    record_segment *segments;
+    size_t count;
+    uint64_t size;                 // file size
+    uint64_t dropped;              // events dropped, writer late
+
+    int refs;                      // process, queued events and readers
+    bool closed;                   // file closed, later events dropped (mutex)
+
+    pthread_mutex_t mutex;         // segments and pending (writer, replay)
+    LIST_ENTRY(tty_record) list;
+};
+
+typedef struct record_event {
+    struct tty_record *record;
+    double time;
+    char type;                     // asciicast event type, 0: recording end
+    char *data;
+    size_t length;
+
+    STAILQ_ENTRY(record_event) next;
+} record_event;
+
+static pthread_once_t record_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t record_cond = PTHREAD_COND_INITIALIZER;
+static STAILQ_HEAD(, record_event) record_queue = STAILQ_HEAD_INITIALIZER(record_queue);
+static LIST_HEAD(, tty_record) record_list = LIST_HEAD_INITIALIZER(record_list);
+static size_t record_queued = 0;
+
+static void record_hold(struct tty_record *record) {
+    __atomic_add_fetch(&record->refs, 1, __ATOMIC_SEQ_CST);
+}
+
+static void record_release(struct tty_record *record) {
+    if(__atomic_sub_fetch(&record->refs, 1, __ATOMIC_SEQ_CST))
+        return;
+
+    pthread_mutex_destroy(&record->mutex);
+
+    free(record->path);
+    free(record->header);
+    free(record->pending);
+    free(record->segments);
+    free(record);
+}
+
+// recording of the process, referenced, NULL if not recorded
+static struct tty_record *record_get(struct tty_process *process) {
+    struct tty_record *record;
+
+    if(!__atomic_load_n(&process->record, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    pthread_mutex_lock(&process->mutex);
+
+    if((record = process->record))
+        record_hold(record);
+
+    pthread_mutex_unlock(&process->mutex);
+
+    return record;
+}
+
+static double record_elapsed(struct tty_record *record) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - record->started.tv_sec) + (now.tv_nsec - record->started.tv_nsec) / 1e9;
+}
+
+// data ownership is taken, the event holds a reference
+static void record_enqueue(struct tty_record *record, char type, char *data, size_t length) {
+    record_event *event = xmalloc(sizeof(record_event));
+
+    event->record = record;
+    event->time = record_elapsed(record);
+    event->type = type;
+    event->data = data;
+    event->length = length;
+
+    pthread_mutex_lock(&record_lock);
+
+    // writer is late, output is dropped rather than piling up
+    if(type && record_queued + length > RECORD_QUEUE_MAX) {
+        record->dropped++;
+        pthread_mutex_unlock(&record_lock);
+        free(data);
+        free(event);
+        return;
+    }
+
+    record_hold(record);
+    record_queued += length;
+    STAILQ_INSERT_TAIL(&record_queue, event, next);
+    pthread_cond_signal(&record_cond);
+    pthread_mutex_unlock(&record_lock);
+}
+
+//
+// writer
+//
+
+// write pending events as a new segment, record mutex held
+static void record_flush(struct tty_record *record) {
+    char *data = record->pending;
+    size_t length = record->pending_length;
+
+    if(!length)
+        return;
+
+#ifdef WITH_ZSTD
+    size_t bound = ZSTD_compressBound(length);
+    char *compressed = xmalloc(bound);
+
+    length = ZSTD_compress(compressed, bound, record->pending, record->pending_length, RECORD_LEVEL);
+
+    if(ZSTD_isError(length)) {
+        fprintf(stderr, "[-] record: %s: %s\n", record->path, ZSTD_getErrorName(length));
+        free(compressed);
+        record->pending_length = 0;
+        return;
+    }
+
+    data = compressed;
+#endif
+
+    for(size_t written = 0; written < length; ) {
+        ssize_t n = write(record->fd, data + written, length - written);
+
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+
+            warnp("record: write");
+            break;
+        }
+
+        written += n;
+    }
+
+    record->segments = xrealloc(record->segments, sizeof(record_segment) * (record->count + 1));
+
+    record_segment *segment = &record->segments[record->count++];
+    segment->time = record->pending_time;
+    segment->offset = record->size;
+    segment->length = length;
+    segment->size = record->pending_length;
+
+    record->size += length;
+
+    fprintf(record->index, "%.6f %lu %u %u\n", segment->time, (unsigned long) segment->offset, segment->length, segment->size);
+    fflush(record->index);
+
+#ifdef WITH_ZSTD
+    free(compressed);
+#endif
+
+    record->pending_length = 0;
+}
+
+static void record_append(struct tty_record *record, double time, const char *line, size_t length) {
+    if(record->pending_length + length > record->pending_size) {
+        record->pending_size = record->pending_length + length + RECORD_SEGMENT_SIZE;
+        record->pending = xrealloc(record->pending, record->pending_size);
+    }
+
+    if(!record->pending_length)
+        record->pending_time = time;
+
+    memcpy(record->pending + record->pending_length, line, length);
+    record->pending_length += length;
+}
+
+// incomplete utf-8 sequence at the end of data
+static size_t record_utf8_tail(const char *data, size_t length) {
+    for(size_t i = 1; i <= 3 && i <= length; i++) {
+        unsigned char c = data[length - i];
+
+        // continuation byte, keep looking for the lead
+        if((c & 0xc0) == 0x80)
+            continue;
+
+        size_t needed = (c >= 0xf0) ? 4 : (c >= 0xe0) ? 3 : (c >= 0xc0) ? 2 : 1;
+        return (needed > i) ? i : 0;
+    }
+
+    return 0;
+}
+
+static void record_event_write(record_event *event) {
+    struct tty_record *record = event->record;
+    char *data = event->data;
+    size_t length = event->length;
+    char *joined = NULL;
+
+    // output split in the middle of a character, asciicast
+    // data needs to be valid utf-8
+    if(event->type == 'o') {
+        if(record->carry_length) {
+            joined = xmalloc(record->carry_length + length);
+            memcpy(joined, record->carry, record->carry_length);
+            memcpy(joined + record->carry_length, data, length);
+
+            data = joined;
+            length += record->carry_length;
+            record->carry_length = 0;
+        }
+
+        size_t tail = record_utf8_tail(data, length);
+
+        memcpy(record->carry, data + length - tail, tail);
+        record->carry_length = tail;
+        length -= tail;
+    }
+
+    if(length) {
+        struct json_object *string = json_object_new_string_len(data, length);
+        const char *escaped = json_object_to_json_string_ext(string, JSON_C_TO_STRING_PLAIN);
+        char *line = xmalloc(strlen(escaped) + 64);
+
+        int n = sprintf(line, "[%.6f, \"%c\", %s]\n", event->time, event->type, escaped);
+
+        pthread_mutex_lock(&record->mutex);
+
+        // stopped, events queued by late feeders
+        if(record->closed) {
+            pthread_mutex_unlock(&record->mutex);
+            json_object_put(string);
+            free(line);
+            free(joined);
+            return;
+        }
+
+        record_append(record, event->time, line, n);
+
+        if(record->pending_length >= RECORD_SEGMENT_SIZE)
+            record_flush(record);
+
+        pthread_mutex_unlock(&record->mutex);
+
+        json_object_put(string);
+        free(line);
+    }
+
+    free(joined);
+}
+
+static void record_close(struct tty_record *record) {
+    pthread_mutex_lock(&record_lock);
+    LIST_REMOVE(record, list);
+    pthread_mutex_unlock(&record_lock);
+
+    pthread_mutex_lock(&record->mutex);
+    record_flush(record);
+
+    // readers holding a reference see it closed
+    close(record->fd);
+    fclose(record->index);
+    record->closed = true;
+
+    pthread_mutex_unlock(&record->mutex);
+
+    verbose("[+] record: %s closed, %lu segments, %lu bytes\n", record->path, record->count, (unsigned long) record->size);
+
+    if(record->dropped)
+        fprintf(stderr, "[-] record: %s: %lu events dropped\n", record->path, (unsigned long) record->dropped);
+}
+
+static void *record_writer(void *args) {
+    struct tty_record *record;
+
+    while(1) {
+        STAILQ_HEAD(, record_event) events = STAILQ_HEAD_INITIALIZER(events);
+        struct timespec deadline;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += RECORD_SEGMENT_TIME;
+
+        pthread_mutex_lock(&record_lock);
+
+        if(STAILQ_EMPTY(&record_queue))
+            pthread_cond_timedwait(&record_cond, &record_lock, &deadline);
+
+        STAILQ_CONCAT(&events, &record_queue);
+        record_queued = 0;
+
+        pthread_mutex_unlock(&record_lock);
+
+        while(!STAILQ_EMPTY(&events)) {
+            record_event *event = STAILQ_FIRST(&events);
+            STAILQ_REMOVE_HEAD(&events, next);
+
+            if(event->type)
+                record_event_write(event);
+            else
+                record_close(event->record);
+
+            record_release(event->record);
+            free(event->data);
+            free(event);
+        }
+
+        // quiet recordings, pending events are written anyway
+        pthread_mutex_lock(&record_lock);
+
+        LIST_FOREACH(record, &record_list, list) {
+            pthread_mutex_lock(&record->mutex);
+
+            if(record->pending_length && record_elapsed(record) - record->pending_time >= RECORD_SEGMENT_TIME)
+                record_flush(record);
+
+            pthread_mutex_unlock(&record->mutex);
+        }
+
+        pthread_mutex_unlock(&record_lock);
+    }
+
+    return NULL;
+}
+
+static void record_init() {
+    pthread_t thread;
+
+    if(pthread_create(&thread, NULL, record_writer, NULL)) {
+        warnp("record: pthread_create");
+        return;
+    }
+
+    pthread_detach(thread);
+}
+
+//
+// recording
+//
+void record_start(struct tty_process *process) {
+    struct tty_record *record;
+    char path[PATH_MAX];
+
+    if(!process->options.record)
+        return;
+
+    pthread_once(&record_once, record_init);
+
+    if(mkdir(process->options.record, 0700) < 0 && errno != EEXIST) {
+        warnp("record: mkdir");
+        return;
+    }
+
+    snprintf(path, sizeof(path), "%s/tfmux-%lu-%ld%s", process->options.record, process->id, (long) time(NULL), RECORD_EXTENSION);
+
+    record = xmalloc(sizeof(struct tty_record));
+    memset(record, 0, sizeof(struct tty_record));
+
+    if((record->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600)) < 0) {
+        warnp("record: open");
+        free(record);
+        return;
+    }
+
+    strcat(path, ".idx");
+
+    if(!(record->index = fopen(path, "we"))) {
+        warnp("record: fopen");
+        close(record->fd);
+        free(record);
+        return;
+    }
+
+    path[strlen(path) - 4] = '\0';
+    record->path = strdup(path);
+    record->id = process->id;
+    record->refs = 1;
+    pthread_mutex_init(&record->mutex, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &record->started);
+
+    // asciicast header, written as the first segment
+    struct json_object *header = json_object_new_object();
+    struct json_object *env = json_object_new_object();
+
+    json_object_object_add(header, "version", json_object_new_int(2));
+    json_object_object_add(header, "width", json_object_new_int(process->size.ws_col ? process->size.ws_col : 80));
+    json_object_object_add(header, "height", json_object_new_int(process->size.ws_row ? process->size.ws_row : 24));
+    json_object_object_add(header, "timestamp", json_object_new_int64(time(NULL)));
+    json_object_object_add(header, "command", json_object_new_string(process->command));
+
+    if(process->options.name)
+        json_object_object_add(header, "title", json_object_new_string(process->options.name));
+
+    json_object_object_add(env, "TERM", json_object_new_string(server->terminal_type));
+    json_object_object_add(header, "env", env);
+
+    const char *json = json_object_to_json_string_ext(header, JSON_C_TO_STRING_PLAIN);
+    record->header = xmalloc(strlen(json) + 2);
+    sprintf(record->header, "%s\n", json);
+    json_object_put(header);
+
+    pthread_mutex_lock(&record->mutex);
+    record_append(record, 0, record->header, strlen(record->header));
+    record_flush(record);
+    pthread_mutex_unlock(&record->mutex);
+
+    pthread_mutex_lock(&record_lock);
+    LIST_INSERT_HEAD(&record_list, record, list);
+    pthread_mutex_unlock(&record_lock);
+
+    // output already in the logs is not part of the recording
+    pthread_mutex_lock(&process->mutex);
+    record->offset = process->logs->written;
+    __atomic_store_n(&process->record, record, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&process->mutex);
+
+    verbose("[+] record: process %lu recorded to %s\n", process->id, record->path);
+}
+
+// recording ends once pending events are written, the process
+// does not reference it anymore
+void record_stop(struct tty_process *process) {
+    pthread_mutex_lock(&process->mutex);
+    struct tty_record *record = process->record;
+    __atomic_store_n(&process->record, NULL, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&process->mutex);
+
+    if(!record)
+        return;
+
+    record_enqueue(record, 0, NULL, 0);
+    record_release(record);
+}
+
+// new output committed, called by the pty reader
+void record_feed(struct tty_process *process) {
+    struct tty_record *record;
+
+    if(!__atomic_load_n(&process->record, __ATOMIC_ACQUIRE))
+        return;
+
+    pthread_mutex_lock(&process->mutex);
+
+    if(!(record = process->record)) {
+        pthread_mutex_unlock(&process->mutex);
+        return;
+    }
+
+    record_hold(record);
+
+    uint64_t first = circular_first(process->logs);
+    if(record->offset < first)
+        record->offset = first;
+
+    size_t length = process->logs->written - record->offset;
+    char *data = length ? xmalloc(length) : NULL;
+
+    if(length)
+        length = circular_read(process->logs, record->offset, data, length);
+
+    record->offset += length;
+
+    pthread_mutex_unlock(&process->mutex);
+
+    if(length)
+        record_enqueue(record, 'o', data, length);
+    else
+        free(data);
+
+    record_release(record);
+}
+
+void record_input(struct tty_process *process, const char *data, size_t length) {
+    struct tty_record *record;
+
+    if(!length || !(record = record_get(process)))
+        return;
+
+    char *copy = xmalloc(length);
+    memcpy(copy, data, length);
+
+    record_enqueue(record, 'i', copy, length);
+    record_release(record);
+}
+
+void record_resize(struct tty_process *process) {
+    struct tty_record *record;
+    char size[32];
+
+    if(!(record = record_get(process)))
+        return;
+
+    int length = snprintf(size, sizeof(size), "%dx%d", process->size.ws_col, process->size.ws_row);
+
+    record_enqueue(record, 'r', strdup(size), length);
+    record_release(record);
+}
+
+//
+// replay
+//
+
+// segment events (asciicast lines) from..to, rebased on from, record mutex held
+static void record_replay_events(const char *events, size_t length, double from, double to, char **output, size_t *size, size_t *used) {
+    const char *end = events + length;
+
+    for(const char *line = events; line < end; ) {
+        const char *eol = memchr(line, '\n', end - line);
+        size_t n = (eol ? eol + 1 : end) - line;
+
+        if(*line == '[') {
+            char *rest;
+            double time = strtod(line + 1, &rest);
+
+            if(time >= from && time <= to) {
+                if(*used + n + 32 > *size) {
+                    *size = (*used + n + 32) * 2;
+                    *output = xrealloc(*output, *size);
+                }
+
+                *used += sprintf(*output + *used, "[%.6f", time - from);
+                memcpy(*output + *used, rest, line + n - rest);
+                *used += line + n - rest;
+            }
+        }
+
+        line += n;
+    }
+}
+
+static char *record_segment_read(struct tty_record *record, record_segment *segment) {
+    char *stored = xmalloc(segment->length);
+
+    if(pread(record->fd, stored, segment->length, segment->offset) != segment->length) {
+        free(stored);
+        return NULL;
+    }
+
+#ifdef WITH_ZSTD
+    char *events = xmalloc(segment->size);
+    size_t length = ZSTD_decompress(events, segment->size, stored, segment->length);
+
+    free(stored);
+
+    if(ZSTD_isError(length)) {
+        free(events);
+        return NULL;
+    }
+
+    return events;
+#else
+    return stored;
+#endif
+}
+
+// asciicast from the given time (up to to, negative: end), events
+// are read from the segment containing from, NULL if not recorded
+char *record_replay(struct tty_process *process, double from, double to, size_t *length) {
+    struct tty_record *record;
+
+    if(!(record = record_get(process)))
+        return NULL;
+
+    if(to < 0)
+        to = 1e18;
+
+    pthread_mutex_lock(&record->mutex);
+
+    // stopped meanwhile, file is closed
+    if(record->closed) {
+        pthread_mutex_unlock(&record->mutex);
+        record_release(record);
+        return NULL;
+    }
+
+    size_t size = strlen(record->header) + RECORD_SEGMENT_SIZE;
+    size_t used = strlen(record->header);
+    char *output = xmalloc(size);
+    memcpy(output, record->header, used);
+
+    // last segment starting before from, segment 0 is the header
+    size_t low = 1, high = record->count;
+
+    while(high - low > 1) {
+        size_t middle = (low + high) / 2;
+
+        if(record->segments[middle].time <= from)
+            low = middle;
+        else
+            high = middle;
+    }
+
+    for(size_t i = low; i < record->count && record->segments[i].time <= to; i++) {
+        char *events = record_segment_read(record, &record->segments[i]);
+
+        if(events) {
+            record_replay_events(events, record->segments[i].size, from, to, &output, &size, &used);
+            free(events);
+        }
+    }
+
+    record_replay_events(record->pending, record->pending_length, from, to, &output, &size, &used);
+
+    pthread_mutex_unlock(&record->mutex);
+    record_release(record);
+
+    *length = used;
+
+    return output;
+}
+
+struct json_object *record_json(struct tty_process *process) {
+    struct tty_record *record;
+
+    if(!(record = record_get(process)))
+        return NULL;
+
+    struct json_object *root = json_object_new_object();
+    struct json_object *segments = json_object_new_array();
+
+    pthread_mutex_lock(&record->mutex);
+
+    json_object_object_add(root, "path", json_object_new_string(record->path));
+    json_object_object_add(root, "size", json_object_new_int64(record->size));
+    json_object_object_add(root, "dropped", json_object_new_int64(record->dropped));
+
+    for(size_t i = 1; i < record->count; i++) {
+        struct json_object *segment = json_object_new_object();
+        json_object_object_add(segment, "time", json_object_new_double(record->segments[i].time));
+        json_object_object_add(segment, "offset", json_object_new_int64(record->segments[i].offset));
+        json_object_object_add(segment, "length", json_object_new_int64(record->segments[i].length));
+        json_object_object_add(segment, "size", json_object_new_int64(record->segments[i].size));
+        json_object_array_add(segments, segment);
+    }
+
+    pthread_mutex_unlock(&record->mutex);
+    record_release(record);
+
+    json_object_object_add(root, "segments", segments);
+
+    return root;
+}
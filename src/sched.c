@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/queue.h>
+
+#include <libwebsockets.h>
+
+#include "server.h"
+#include "utils.h"
+
+//
+// output scheduling
+//
+// each service thread schedules the writes of its own clients, a
+// client with only a small backlog (shell echo, prompt) is written as
+// soon as possible, this is the priority lane, clients with a large
+// backlog (a process flooding output) take turns by deficit round-robin,
+// each turn adds its process weight share of bytes to the client deficit
+//
+// every writable callback writes one frame of at most BUF_SIZE bytes,
+// one client has the turn at a time, once its deficit is used it goes
+// to the back of the queue and the next one gets the turn, a client
+// that cannot write (socket choked) is passed over and goes to the
+// back as well, a slow client never holds the others, the service loop
+// polls again between frames so interactive clients never wait behind
+// a full backlog
+//
+#define SCHED_SMALL 1024               // backlog served on the priority lane
+#define SCHED_QUANTUM BUF_SIZE         // bytes per turn at weight 100
+#define SCHED_MIN 512                  // deficit left worth another frame
+
+static size_t sched_quantum(struct tty_client *client) {
+    size_t quantum = (size_t) SCHED_QUANTUM * client->process->options.weight / 100;
+    return quantum ? quantum : 1;
+}
+
+// client gets the turn and goes to the back of the queue
+static void sched_grant(tty_service *service, struct tty_client *client) {
+    size_t quantum = sched_quantum(client);
+
+    TAILQ_REMOVE(&service->bulk, client, sched);
+    TAILQ_INSERT_TAIL(&service->bulk, client, sched);
+
+    // unused deficit is carried over, bounded
+    client->deficit += quantum;
+    if(client->deficit > 2 * quantum)
+        client->deficit = 2 * quantum;
+
+    client->granted = true;
+    service->current = client;
+
+    lws_callback_on_writable(client->wsi);
+}
+
+// turn given to the first client able to write, those passed over
+// are asked for a writable callback, the first one coming back gets
+// the turn if nobody has it then (see sched_budget)
+static void sched_next(tty_service *service) {
+    TAILQ_HEAD(, tty_client) skipped = TAILQ_HEAD_INITIALIZER(skipped);
+    struct tty_client *client;
+
+    service->current = NULL;
+
+    while((client = TAILQ_FIRST(&service->bulk))) {
+        if(!lws_send_pipe_choked(client->wsi)) {
+            sched_grant(service, client);
+            break;
+        }
+
+        TAILQ_REMOVE(&service->bulk, client, sched);
+        TAILQ_INSERT_TAIL(&skipped, client, sched);
+        lws_callback_on_writable(client->wsi);
+    }
+
+    TAILQ_CONCAT(&service->bulk, &skipped, sched);
+}
+
+// client turn is over, the next one takes it
+static void sched_release(tty_service *service, struct tty_client *client) {
+    client->granted = false;
+
+    if(service->current == client)
+        sched_next(service);
+}
+
+static void sched_enqueue(tty_service *service, struct tty_client *client) {
+    if(client->queued)
+        return;
+
+    client->queued = true;
+    client->deficit = 0;
+    TAILQ_INSERT_TAIL(&service->bulk, client, sched);
+
+    if(!service->current)
+        sched_next(service);
+}
+
+static void sched_dequeue(tty_service *service, struct tty_client *client) {
+    if(!client->queued)
+        return;
+
+    TAILQ_REMOVE(&service->bulk, client, sched);
+    client->queued = false;
+    client->deficit = 0;
+}
+
+// new output for the client, called on its service thread
+void sched_wakeup(struct tty_client *client) {
+    tty_service *service = &server->services[client->tsi];
+    struct tty_process *process = client->process;
+
+    // backlogged clients are served by turns
+    if(client->queued)
+        return;
+
+    pthread_mutex_lock(&process->mutex);
+    uint64_t backlog = process->logs->written - client->offset;
+    pthread_mutex_unlock(&process->mutex);
+
+    if(backlog > SCHED_SMALL) {
+        sched_enqueue(service, client);
+        return;
+    }
+
+    lws_callback_on_writable(client->wsi);
+}
+
+// bytes allowed for the next frame, 0 while a backlogged client
+// waits for its turn, one passed over writable again takes the
+// turn if nobody has it
+size_t sched_budget(struct tty_client *client) {
+    tty_service *service = &server->services[client->tsi];
+
+    if(client->queued && !client->granted) {
+        if(service->current)
+            return 0;
+
+        sched_grant(service, client);
+    }
+
+    if(client->granted && client->deficit < BUF_SIZE)
+        return client->deficit;
+
+    return BUF_SIZE;
+}
+
+// frame written (length can be zero), remaining is the client backlog
+void sched_written(struct tty_client *client, size_t length, uint64_t remaining) {
+    tty_service *service = &server->services[client->tsi];
+
+    if(client->granted) {
+        client->deficit = (length < client->deficit) ? client->deficit - length : 0;
+
+        if(remaining == 0) {
+            sched_dequeue(service, client);
+            sched_release(service, client);
+            return;
+        }
+
+        // still its turn, unless the socket is full
+        if(length && client->deficit >= SCHED_MIN && !lws_send_pipe_choked(client->wsi)) {
+            lws_callback_on_writable(client->wsi);
+            return;
+        }
+
+        sched_release(service, client);
+        return;
+    }
+
+    // priority lane (or initial logs)
+    if(remaining == 0)
+        return;
+
+    if(remaining > SCHED_SMALL && !client->queued) {
+        sched_enqueue(service, client);
+        return;
+    }
+
+    if(!client->queued)
+        lws_callback_on_writable(client->wsi);
+}
+
+// client leaving, its turn (if any) is given up
+void sched_remove(struct tty_client *client) {
+    tty_service *service = &server->services[client->tsi];
+
+    sched_dequeue(service, client);
+
+    if(client->granted)
+        sched_release(service, client);
+}
@@ -0,0 +1,455 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <regex.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/queue.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <libwebsockets.h>
+#include <json.h>
+
+#include "server.h"
+#include "probes.h"
+#include "utils.h"
+
+#define SEARCH_THREADS_MAX 8
+
+//
+// scrollback search
+//
+// a search is split per process, a pool of workers takes processes
+// one at a time, each one copies the process logs (only its mutex
+// is held for the copy) then scans the copy, matches are collected
+// into the search result
+//
+// requests are answered asynchronously, the worker scanning the
+// last process wakes up the requester service thread which then
+// writes the result, service threads never wait for a search
+//
+typedef struct search_task {
+    char *query;                   // pattern (literal or regex)
+    search_options options;
+    size_t *ids;                   // processes to scan
+    size_t count;
+    size_t next;                   // next process to take (search_lock)
+    size_t done;                   // processes scanned (mutex)
+    size_t found;                  // matches kept (mutex)
+    bool truncated;                // limit reached (mutex)
+    bool cancelled;                // requester gone, freed once done (mutex)
+    uint64_t scanned;              // bytes scanned (mutex)
+    struct json_object *matches;   // matches found (mutex)
+    int tsi;                       // requester service thread
+    struct timespec begin;
+    struct timespec end;           // last process scanned (mutex)
+    pthread_mutex_t mutex;
+
+    STAILQ_ENTRY(search_task) next_task;
+} search_task;
+
+static pthread_once_t search_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t search_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t search_cond = PTHREAD_COND_INITIALIZER;
+static STAILQ_HEAD(, search_task) search_tasks = STAILQ_HEAD_INITIALIZER(search_tasks);
+static int search_threads = 0;
+
+// first and last pattern bytes are compared 16 positions at a
+// time, candidates are then confirmed with memcmp
+static const char *search_literal(const char *haystack, size_t length, const char *needle, size_t size) {
+    if(size == 0 || size > length)
+        return NULL;
+
+    if(size == 1)
+        return memchr(haystack, needle[0], length);
+
+    size_t i = 0;
+
+#ifdef __SSE2__
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[size - 1]);
+
+    for(; i + size - 1 + 16 <= length; i += 16) {
+        __m128i head = _mm_loadu_si128((const __m128i *) (haystack + i));
+        __m128i tail = _mm_loadu_si128((const __m128i *) (haystack + i + size - 1));
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(head, first), _mm_cmpeq_epi8(tail, last)));
+
+        while(mask) {
+            int bit = __builtin_ctz(mask);
+
+            if(memcmp(haystack + i + bit + 1, needle + 1, size - 2) == 0)
+                return haystack + i + bit;
+
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    return memmem(haystack + i, length - i, needle, size);
+}
+
+// line surrounding a match, clipped to context bytes on each side
+static struct json_object *search_context(const char *text, size_t length, size_t position, size_t size, size_t context) {
+    size_t start = position;
+    size_t end = position + size;
+
+    while(start > 0 && position - start < context && text[start - 1] != '\n')
+        start--;
+
+    while(end < length && end - (position + size) < context && text[end] != '\n')
+        end++;
+
+    return json_object_new_string_len(text + start, end - start);
+}
+
+// returns false once the limit is reached
+static bool search_match(search_task *task, size_t id, const char *name, uint64_t offset, struct json_object *context) {
+    bool more = true;
+
+    pthread_mutex_lock(&task->mutex);
+
+    if(task->found >= task->options.limit) {
+        task->truncated = true;
+        json_object_put(context);
+        more = false;
+
+    } else {
+        struct json_object *match = json_object_new_object();
+        json_object_object_add(match, "id", json_object_new_int64(id));
+
+        if(name)
+            json_object_object_add(match, "name", json_object_new_string(name));
+
+        json_object_object_add(match, "offset", json_object_new_int64(offset));
+        json_object_object_add(match, "context", context);
+        json_object_array_add(task->matches, match);
+        task->found++;
+    }
+
+    pthread_mutex_unlock(&task->mutex);
+
+    return more;
+}
+
+static void search_process(search_task *task, size_t id) {
+    search_options *options = &task->options;
+    struct tty_process *process;
+    uint32_t *map = NULL;
+    regex_t regex;
+
+    // removed meanwhile
+    if(!(process = process_lookup(id)))
+        return;
+
+    char *name = process->options.name ? strdup(process->options.name) : NULL;
+
+    // only the copy is made under the process lock
+    pthread_mutex_lock(&process->mutex);
+    uint64_t first = circular_first(process->logs);
+    buffer_t *logs = circular_get(process->logs, 0);
+    pthread_mutex_unlock(&process->mutex);
+
+    process_release(process);
+
+    char *text = (char *) logs->buffer;
+    size_t length = logs->length;
+
+    // offsets found in stripped text are mapped back to the logs
+    if(options->ansi) {
+        text = xmalloc(logs->length + 1);
+        map = xmalloc(sizeof(uint32_t) * (logs->length + 1));
+        length = ansi_strip((char *) logs->buffer, logs->length, text, map);
+    }
+
+    // case is folded on a copy, context is taken from the text
+    char *haystack = text;
+    if(options->icase && !options->regex) {
+        haystack = xmalloc(length);
+
+        for(size_t i = 0; i < length; i++)
+            haystack[i] = tolower((unsigned char) text[i]);
+    }
+
+    // compiled again by every worker, regexec serializes
+    // callers sharing the same compiled expression
+    if(options->regex && regcomp(&regex, task->query, REG_EXTENDED | REG_NEWLINE | (options->icase ? REG_ICASE : 0)))
+        goto cleanup;
+
+    size_t size = strlen(task->query);
+    size_t position = 0;
+
+    while(position < length) {
+        size_t found, matched;
+
+        if(options->regex) {
+            regmatch_t pm = { .rm_so = 0, .rm_eo = length - position };
+
+            if(regexec(&regex, text + position, 1, &pm, REG_STARTEND))
+                break;
+
+            found = position + pm.rm_so;
+            matched = pm.rm_eo - pm.rm_so;
+
+        } else {
+            const char *hit = search_literal(haystack + position, length - position, task->query, size);
+            if(!hit)
+                break;
+
+            found = hit - haystack;
+            matched = size;
+        }
+
+        uint64_t offset = first + (map ? map[found] : found);
+        struct json_object *context = search_context(text, length, found, matched, options->context);
+
+        if(!search_match(task, id, name, offset, context))
+            break;
+
+        // one match per line
+        const char *eol = memchr(text + found + matched, '\n', length - found - matched);
+        position = eol ? (size_t) (eol - text) + 1 : length;
+    }
+
+    if(options->regex)
+        regfree(&regex);
+
+cleanup:
+    pthread_mutex_lock(&task->mutex);
+    task->scanned += logs->length;
+    pthread_mutex_unlock(&task->mutex);
+
+    if(haystack != text)
+        free(haystack);
+
+    if(map) {
+        free(text);
+        free(map);
+    }
+
+    buffer_free(logs);
+    free(name);
+}
+
+static void search_free(search_task *task) {
+    if(task->matches)
+        json_object_put(task->matches);
+
+    pthread_mutex_destroy(&task->mutex);
+    free(task->ids);
+    free(task->query);
+    free(task);
+}
+
+// last process scanned, requester service thread is woken up
+static void search_wakeup(int tsi) {
+    tty_service *service = &server->services[tsi];
+
+    if(!__atomic_exchange_n(&service->searched, true, __ATOMIC_SEQ_CST))
+        lws_cancel_service(context);
+}
+
+static void *search_worker(void *args) {
+    while(1) {
+        pthread_mutex_lock(&search_lock);
+
+        while(STAILQ_EMPTY(&search_tasks))
+            pthread_cond_wait(&search_cond, &search_lock);
+
+        search_task *task = STAILQ_FIRST(&search_tasks);
+        size_t index = task->next++;
+
+        // every process taken, the task leaves the queue
+        if(task->next >= task->count)
+            STAILQ_REMOVE_HEAD(&search_tasks, next_task);
+
+        pthread_mutex_unlock(&search_lock);
+
+        // nobody is waiting for the result anymore
+        if(!__atomic_load_n(&task->cancelled, __ATOMIC_SEQ_CST))
+            search_process(task, task->ids[index]);
+
+        pthread_mutex_lock(&task->mutex);
+
+        bool done = ++task->done == task->count;
+        bool cancelled = task->cancelled;
+        int tsi = task->tsi;
+
+        if(done)
+            clock_gettime(CLOCK_MONOTONIC, &task->end);
+
+        pthread_mutex_unlock(&task->mutex);
+
+        if(done && cancelled)
+            search_free(task);
+
+        // the requester may free it from now on
+        else if(done)
+            search_wakeup(tsi);
+    }
+
+    return NULL;
+}
+
+static void search_start() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int count = (cpus < 1) ? 1 : (cpus > SEARCH_THREADS_MAX ? SEARCH_THREADS_MAX : (int) cpus);
+
+    for(int i = 0; i < count; i++) {
+        pthread_t thread;
+
+        if(pthread_create(&thread, NULL, search_worker, NULL)) {
+            warnp("search: pthread_create");
+            break;
+        }
+
+        pthread_detach(thread);
+        search_threads++;
+    }
+
+    verbose("[+] search: %d workers\n", search_threads);
+}
+
+// queue a scan of processes logs (all of them, or options->id only)
+// for the request, the result is fetched with search_response once
+// the request is writable, returns non-zero with error set on
+// invalid request
+int search_request(struct pss_http *pss, struct lws *wsi, const char *query, search_options *options, char **error) {
+    tty_service *service = &server->services[lws_get_tsi(wsi)];
+    struct tty_process *process;
+    regex_t regex;
+
+    if(strlen(query) == 0) {
+        *error = "empty query";
+        return 1;
+    }
+
+    if(options->regex) {
+        if(regcomp(&regex, query, REG_EXTENDED | REG_NEWLINE | REG_NOSUB)) {
+            *error = "invalid regular expression";
+            return 1;
+        }
+
+        regfree(&regex);
+    }
+
+    pthread_once(&search_once, search_start);
+
+    if(search_threads == 0) {
+        *error = "search workers not available";
+        return 1;
+    }
+
+    search_task *task = xmalloc(sizeof(search_task));
+    memset(task, 0, sizeof(search_task));
+    task->query = strdup(query);
+    task->options = *options;
+    task->matches = json_object_new_array();
+    task->tsi = lws_get_tsi(wsi);
+    pthread_mutex_init(&task->mutex, NULL);
+
+    // literal is folded once, haystacks are folded by workers
+    if(options->icase && !options->regex) {
+        for(char *c = task->query; *c; c++)
+            *c = tolower((unsigned char) *c);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &task->begin);
+
+    server_lock(&server->mutex);
+
+    LIST_FOREACH(process, &server->processes, list)
+        if(options->id == 0 || process->id == options->id)
+            task->count++;
+
+    task->ids = xmalloc(sizeof(size_t) * (task->count + 1));
+    task->count = 0;
+
+    LIST_FOREACH(process, &server->processes, list)
+        if(options->id == 0 || process->id == options->id)
+            task->ids[task->count++] = process->id;
+
+    server_unlock(&server->mutex);
+
+    pss->wsi = wsi;
+    pss->search = task;
+    LIST_INSERT_HEAD(&service->searches, pss, searches);
+
+    if(task->count > 0) {
+        pthread_mutex_lock(&search_lock);
+        STAILQ_INSERT_TAIL(&search_tasks, task, next_task);
+        pthread_cond_broadcast(&search_cond);
+        pthread_mutex_unlock(&search_lock);
+
+    } else {
+        task->end = task->begin;
+        lws_callback_on_writable(wsi);
+    }
+
+    return 0;
+}
+
+// result of the request search, NULL while it is still running
+struct json_object *search_response(struct pss_http *pss) {
+    search_task *task = pss->search;
+
+    pthread_mutex_lock(&task->mutex);
+    bool done = task->done == task->count;
+    pthread_mutex_unlock(&task->mutex);
+
+    if(!done)
+        return NULL;
+
+    LIST_REMOVE(pss, searches);
+    pss->search = NULL;
+
+    struct json_object *root = json_object_new_object();
+    json_object_object_add(root, "status", json_object_new_string("success"));
+    json_object_object_add(root, "processes", json_object_new_int64(task->count));
+    json_object_object_add(root, "scanned", json_object_new_int64(task->scanned));
+    json_object_object_add(root, "truncated", json_object_new_boolean(task->truncated));
+    json_object_object_add(root, "elapsed", json_object_new_double(
+            (task->end.tv_sec - task->begin.tv_sec) * 1000.0 + (task->end.tv_nsec - task->begin.tv_nsec) / 1e6));
+    json_object_object_add(root, "matches", task->matches);
+
+    task->matches = NULL;
+    search_free(task);
+
+    return root;
+}
+
+// request closed, a running search is freed by the last worker
+void search_request_remove(struct pss_http *pss) {
+    search_task *task = pss->search;
+
+    if(!task)
+        return;
+
+    LIST_REMOVE(pss, searches);
+    pss->search = NULL;
+
+    pthread_mutex_lock(&task->mutex);
+    bool done = task->done == task->count;
+    task->cancelled = true;
+    pthread_mutex_unlock(&task->mutex);
+
+    if(done)
+        search_free(task);
+}
+
+// called on the service thread when woken up by finished searches
+void search_flush(int tsi) {
+    tty_service *service = &server->services[tsi];
+    struct pss_http *pss;
+
+    if(!__atomic_exchange_n(&service->searched, false, __ATOMIC_SEQ_CST))
+        return;
+
+    LIST_FOREACH(pss, &service->searches, searches)
+        lws_callback_on_writable(pss->wsi);
+}
@@ -3,16 +3,23 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <pthread.h>
 #include <signal.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/wait.h>
 
 #include <libwebsockets.h>
 #include <json.h>
 
 #include "server.h"
+#include "probes.h"
+#include "control.h"
 #include "utils.h"
 
 #ifndef TTYD_VERSION
@@ -22,12 +29,14 @@
 void *mainthread_run_command(void *args);
 
 volatile bool force_exit = false;
+static volatile sig_atomic_t exit_signal = 0;
 struct lws_context *context;
 struct tty_server *server;
 
 int __verbose = 0;
 
-char *__process_states[] = {"created", "starting", "running", "stopping", "stopped", "crashed"};
+char *__process_states[] = {"created", "starting", "running", "stopping", "stopped", "crashed", "restarting"};
+char *__restart_policies[] = {"never", "on-failure", "always"};
 
 // websocket protocols
 static const struct lws_protocols protocols[] = {
@@ -59,16 +68,26 @@ static const struct option options[] = {
         {"ssl-cert",     required_argument, NULL, 'C'},
         {"ssl-key",      required_argument, NULL, 'K'},
         {"ssl-ca",       required_argument, NULL, 'A'},
+        {"ssl-ktls",     no_argument,       NULL, 'L'},
         {"readonly",     no_argument,       NULL, 'R'},
         {"check-origin", no_argument,       NULL, 'O'},
         {"max-clients",  required_argument, NULL, 'm'},
         {"once",         no_argument,       NULL, 'o'},
+        {"cgroup",       required_argument, NULL, 'G'},
+        {"io-uring",     no_argument,       NULL, 'U'},
+        {"threads",      required_argument, NULL, 'N'},
+        {"manifest",     required_argument, NULL, 'M'},
+        {"resume-fd",    required_argument, NULL, 'z'},
+        {"control",      required_argument, NULL, 'X'},
+        {"record",       required_argument, NULL, 'E'},
+        {"scrollback-budget", required_argument, NULL, 'B'},
+        {"latency",      no_argument,       NULL, 'l'},
         {"debug",        required_argument, NULL, 'd'},
         {"version",      no_argument,       NULL, 'v'},
         {"help",         no_argument,       NULL, 'h'},
         {NULL, 0, 0, 0}
 };
-static const char *opt_string = "p:i:c:u:g:s:r:I:6aSC:K:A:Rt:T:Om:od:vh";
+static const char *opt_string = "+p:i:c:u:g:s:r:I:6aSC:K:A:LRt:T:Om:oG:UN:M:z:X:E:B:ld:vh";
 
 void print_help() {
     fprintf(stderr, "ttyd is a tool for sharing terminal over the web\n\n"
@@ -95,6 +114,15 @@ void print_help() {
                     "    -C, --ssl-cert          SSL certificate file path\n"
                     "    -K, --ssl-key           SSL key file path\n"
                     "    -A, --ssl-ca            SSL CA file path for client certificate verification\n"
+                    "    -L, --ssl-ktls          Offload TLS records encryption to the kernel (kTLS) when available\n"
+                    "    -G, --cgroup            cgroup v2 directory to place processes with resources limits in\n"
+                    "    -U, --io-uring          Handle processes pty i/o with io_uring\n"
+                    "    -N, --threads           Websocket service threads (default: 1)\n"
+                    "    -M, --manifest          Processes manifest file (JSON), reloaded on SIGHUP\n"
+                    "    -X, --control           Binary control API UNIX domain socket path (eg: /run/tfmux.ctl)\n"
+                    "    -E, --record            Record processes sessions (asciicast) in this directory\n"
+                    "    -B, --scrollback-budget Scrollback memory budget, idle processes logs are compressed beyond (eg: 512M)\n"
+                    "    -l, --latency           Follow keystrokes echo latency (see /api/latency)\n"
                     "    -d, --debug             Set log level (default: 7)\n"
                     "    -v, --version           Print the version and exit\n"
                     "    -h, --help              Print this text and exit\n\n"
@@ -127,96 +155,225 @@ void buffer_free(buffer_t *buffer) {
 //
 // circular buffer
 //
+
+// sealed memfd holding the shared header page and the ring
+static int circular_memfd(size_t length) {
+    int fd;
+
+    if((fd = memfd_create("tfmux-logs", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0)
+        return -1;
+
+    if(ftruncate(fd, CONTROL_RING_HEADER + length) < 0 || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// header seqlock, only the ring writer updates it
+static void circular_publish(circbuf_t *circular) {
+    control_ring *shared = circular->shared;
+
+    if(!shared)
+        return;
+
+    __atomic_store_n(&shared->sequence, shared->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    __atomic_store_n(&shared->written, circular->written, __ATOMIC_RELAXED);
+    __atomic_store_n(&shared->reserved, circular->reserved, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&shared->sequence, shared->sequence + 1, __ATOMIC_RELEASE);
+}
+
 circbuf_t *circular_new(size_t length) {
     circbuf_t *circular = xmalloc(sizeof(circbuf_t));
 
     circular->length = length;
+    circular->written = 0;
+    circular->reserved = 0;
+    circular->shared = NULL;
+    circular->exported = false;
+    circular->frozen = NULL;
+
+    // ring lives in shared memory when possible, local
+    // consumers can then map it (see circular_share)
+    if((circular->memfd = circular_memfd(length)) >= 0) {
+        char *memory = mmap(NULL, CONTROL_RING_HEADER + length, PROT_READ | PROT_WRITE, MAP_SHARED, circular->memfd, 0);
+
+        if(memory != MAP_FAILED) {
+            circular->shared = (control_ring *) memory;
+            circular->shared->magic = CONTROL_RING_MAGIC;
+            circular->shared->length = length;
+            circular->buffer = memory + CONTROL_RING_HEADER;
+
+            return circular;
+        }
+
+        close(circular->memfd);
+        circular->memfd = -1;
+    }
+
     circular->buffer = xmalloc(length);
-    circular->reader = circular->buffer;
-    circular->writer = circular->buffer;
 
     return circular;
 }
 
 void circular_free(circbuf_t *circular) {
-    free(circular->buffer);
+    circular_unfreeze(circular);
+
+    if(circular->shared) {
+        munmap(circular->shared, CONTROL_RING_HEADER + circular->length);
+        close(circular->memfd);
+
+    } else free(circular->buffer);
+
     circular->length = 0;
 
     free(circular);
 }
 
-size_t circular_append(circbuf_t *circular, uint8_t *data, size_t length) {
-    // we have enough space on the buffer to write our data
-    // it's easy
-    if(circular->writer - circular->buffer + length < circular->length) {
-        // printf("<> circular append, case 1\n");
-        memcpy(circular->writer, data, length);
-        circular->writer += length;
-
-        // reset writer to the beginin if we are at the end
-        // CHECK: maybe will never occures because of first if
-        if(circular->writer == circular->buffer + circular->length)
-            circular->writer = circular->buffer;
+// read-only descriptor on the ring shared memory, consumers mapping
+// it cannot write into it, -1 if the ring is not shared
+int circular_share(circbuf_t *circular) {
+    char path[64];
 
-        return length;
+    if(circular->memfd < 0)
+        return -1;
+
+    // consumers read the memory directly
+    if(circular->frozen)
+        circular_thaw(circular);
+
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", circular->memfd);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    // consumers keep their mapping after the share is dropped,
+    // punched pages would then read as zeros
+    if(fd >= 0)
+        circular->exported = true;
+
+    return fd;
+}
+
+// get the free segment(s) where the next length bytes will be
+// written, this lets readers fill the ring directly without any
+// intermediate buffer, oldest data will be overwritten
+int circular_reserve(circbuf_t *circular, struct iovec *iov, size_t length) {
+    if(circular->frozen)
+        circular_thaw(circular);
+
+    size_t position = circular->written % circular->length;
+    size_t remain = circular->length - position;
+
+    if(length > circular->length)
+        length = circular->length;
+
+    circular->reserved = length;
+    circular_publish(circular);
+
+    iov[0].iov_base = circular->buffer + position;
+
+    if(remain >= length) {
+        iov[0].iov_len = length;
+        return 1;
     }
 
+    // we don't have enough space to store data in one shot
+    // second segment goes back to the beginin
+    iov[0].iov_len = remain;
+    iov[1].iov_base = circular->buffer;
+    iov[1].iov_len = length - remain;
+
+    return 2;
+}
+
+// flag reserved data as written, reservation is released
+void circular_commit(circbuf_t *circular, size_t length) {
+    circular->written += length;
+    circular->reserved = 0;
+    circular_publish(circular);
+
+    PROBE3(ring__commit, circular, length, circular->written);
+}
+
+// oldest offset still available on the buffer, reserved space
+// can be overwritten at any time and is not available anymore
+uint64_t circular_first(circbuf_t *circular) {
+    if(circular->written + circular->reserved > circular->length)
+        return circular->written + circular->reserved - circular->length;
+
+    return 0;
+}
+
+size_t circular_append(circbuf_t *circular, uint8_t *data, size_t length) {
+    struct iovec iov[2];
+
     // if data is larger than our circular buffer
-    // let's just put the latest data available in the beginin
-    if(length >= circular->length) {
-        printf("<> circular append, case 2\n");
-        memcpy(circular->buffer, data + length - circular->length, circular->length);
-        circular->writer = circular->buffer;
-        circular->reader = circular->buffer;
-        return length;
+    // let's just keep the latest data available
+    if(length > circular->length) {
+        circular->written += length - circular->length;
+        data += length - circular->length;
+        length = circular->length;
     }
 
-    // printf("<> circular append, case 3\n");
+    int count = circular_reserve(circular, iov, length);
 
-    // we don't have enough space to store data in one shot
-    // let's copy what we can, then go back to the beginin and
-    // write again, ...
-    size_t bufremain = circular->length - (circular->writer - circular->buffer);
-    memcpy(circular->writer, data, bufremain);
-    circular->writer = circular->buffer;
+    memcpy(iov[0].iov_base, data, iov[0].iov_len);
+    if(count > 1)
+        memcpy(iov[1].iov_base, data + iov[0].iov_len, iov[1].iov_len);
+
+    circular_commit(circular, length);
 
-    memcpy(circular->writer, data + bufremain, length - bufremain);
-    circular->writer += length - bufremain;
+    return length;
 }
 
-buffer_t *circular_get(circbuf_t *circular, size_t length) {
-    if(length > circular->length)
-        return NULL;
+// copy data starting at an absolute offset, offset older than
+// the available data starts from the oldest byte available
+size_t circular_read(circbuf_t *circular, uint64_t offset, char *target, size_t length) {
+    if(circular->frozen)
+        circular_thaw(circular);
 
-    if(length == 0) {
-        // buffer is full, we know length will be
-        // the full buffer
-        if(circular->reader != circular->buffer) {
-            length = circular->length;
+    uint64_t first = circular_first(circular);
 
-        } else {
-            // the buffer is not full, computing
-            // how long is it right now
-            length = circular->writer - circular->buffer;
-        }
-    }
+    if(offset < first)
+        offset = first;
 
-    buffer_t *response = buffer_new(length);
+    if(offset >= circular->written)
+        return 0;
+
+    if(length > circular->written - offset)
+        length = circular->written - offset;
 
-    if(circular->reader == circular->buffer) {
-        // if the reader is on the beginin, we can
-        // just copy available data and returns it
-        memcpy(response->buffer, circular->reader, length);
-        return response;
+    size_t position = offset % circular->length;
+    size_t remain = circular->length - position;
+
+    if(remain >= length) {
+        memcpy(target, circular->buffer + position, length);
+        return length;
     }
 
-    // buffer is full, we need to start from reader, copy
-    // 'til the end of the buffer, then appends the rest which
-    // is the beginin of the buffer
-    size_t remain = circular->length - (circular->reader - circular->buffer);
+    memcpy(target, circular->buffer + position, remain);
+    memcpy(target + remain, circular->buffer, length - remain);
+
+    return length;
+}
+
+// get the latest length bytes, or the full content when length is zero
+buffer_t *circular_get(circbuf_t *circular, size_t length) {
+    uint64_t first = circular_first(circular);
+    size_t available = circular->written - first;
+
+    if(length > circular->length)
+        return NULL;
 
-    memcpy(response->buffer, circular->reader, remain);
-    memcpy(response->buffer + remain, circular->buffer, circular->reader - circular->buffer);
+    if(length == 0 || length > available)
+        length = available;
+
+    buffer_t *response = buffer_new(length);
+    response->length = circular_read(circular, circular->written - length, (char *) response->buffer, length);
 
     return response;
 }
@@ -229,8 +386,11 @@ struct tty_server *tty_server_new() {
 
     LIST_INIT(&ts->clients);
     LIST_INIT(&ts->processes);
+    pthread_mutex_init(&ts->mutex, NULL);
+    pthread_cond_init(&ts->changed, NULL);
 
     ts->client_count = 0;
+    ts->threads = 1;
     ts->reconnect = 10;
     ts->sig_code = SIGHUP;
 
@@ -248,32 +408,231 @@ char *tty_server_process_state(struct tty_process *process) {
     return state;
 }
 
+char *restart_policy_name(tty_restart_policy policy) {
+    return __restart_policies[policy];
+}
+
+int restart_policy_parse(const char *name, tty_restart_policy *policy) {
+    for(size_t i = 0; i < sizeof(__restart_policies) / sizeof(char *); i++) {
+        if(strcmp(name, __restart_policies[i]) == 0) {
+            *policy = (tty_restart_policy) i;
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+void tty_process_options_default(tty_process_options *options) {
+    memset(options, 0, sizeof(tty_process_options));
+
+    options->restart = RESTART_NEVER;
+    options->max_restarts = 0;
+    options->restart_window = RESTART_WINDOW;
+    options->weight = 100;
+    options->record = server->record ? strdup(server->record) : NULL;
+}
+
+// deep copy, strings are owned by the target
+void tty_process_options_copy(tty_process_options *target, tty_process_options *source) {
+    *target = *source;
+
+    target->name = source->name ? strdup(source->name) : NULL;
+    target->cwd = source->cwd ? strdup(source->cwd) : NULL;
+    target->env = strv_dup(source->env);
+    target->depends = strv_dup(source->depends);
+    target->record = source->record ? strdup(source->record) : NULL;
+}
+
+void tty_process_options_free(tty_process_options *options) {
+    free(options->name);
+    free(options->cwd);
+    strv_free(options->env);
+    strv_free(options->depends);
+    free(options->record);
+}
+
 struct tty_process *tty_server_process_stop(struct tty_process *process) {
-    if(process->running == false)
+    pthread_mutex_lock(&process->mutex);
+
+    // waiting for a restart or dependencies, just cancel it
+    if(process->state == RESTARTING || process->state == CREATED) {
+        verbose("[+] cancelling start of process: %lu\n", process->id);
+        process->state = STOPPED;
+        process_changed(process);
+        pthread_cond_broadcast(&process->notifier);
+        pthread_mutex_unlock(&process->mutex);
+        return process;
+    }
+
+    if(process->running == false) {
+        pthread_mutex_unlock(&process->mutex);
         return NULL;
+    }
 
     verbose("[+] killing process: %d\n", process->pid);
 
     kill(process->pid, SIGTERM);
 
-    pthread_mutex_lock(&process->mutex);
     process->running = false;
     process->state = STOPPING;
+    process_changed(process);
     pthread_mutex_unlock(&process->mutex);
 
+    process_wakeup(process);
+
     return process;
 }
 
-struct tty_process *tty_server_process_start(struct tty_server *ts, int argc, char **argv) {
+// flag a change visible on the processes listing
+void process_changed(struct tty_process *process) {
+    process->version = __atomic_add_fetch(&server->version, 1, __ATOMIC_SEQ_CST);
+    events_process(process);
+    control_changed();
+    http_changed();
+
+    // processes waiting for dependencies
+    pthread_cond_broadcast(&server->changed);
+}
+
+// interrupt the pty reader waiting on select
+void process_wakeup(struct tty_process *process) {
+    uint64_t value = 1;
+
+    if(write(process->wakeup, &value, sizeof(value)) < 0)
+        warnp("process_wakeup: write");
+}
+
+// apply a new window size, kept to restore it when the process restarts
+void process_resize(struct tty_process *process, struct winsize *size) {
+    // pty swapped and closed under the process mutex on respawn
+    pthread_mutex_lock(&process->mutex);
+
+    process->size = *size;
+
+    if(process->pty >= 0 && ioctl(process->pty, TIOCSWINSZ, &process->size) == -1)
+        warnp("process_resize: ioctl TIOCSWINSZ");
+
+    pthread_mutex_unlock(&process->mutex);
+
+    events_resize(process);
+    record_resize(process);
+}
+
+// check restart policy against exit status, process mutex must be held
+static int process_restart_wanted(struct tty_process *process, int wstatus) {
+    tty_restart *restart = &process->restart;
+    time_t now = time(NULL);
+
+    // killed on purpose to be restarted (watch action)
+    bool requested = restart->requested;
+    restart->requested = false;
+
+    // stop explicitly requested
+    if(process->state == STOPPING || force_exit)
+        return 0;
+
+    switch(requested ? RESTART_ALWAYS : process->options.restart) {
+        case RESTART_NEVER:
+            return 0;
+
+        case RESTART_ON_FAILURE:
+            if(!*process->error && WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0)
+                return 0;
+            break;
+
+        case RESTART_ALWAYS:
+            break;
+    }
+
+    // process was running for a while, backoff starts over
+    if((now - restart->started) * 1000 >= RESTART_BACKOFF_MAX)
+        restart->attempt = 0;
+
+    if(now - restart->window_start >= process->options.restart_window) {
+        restart->window_start = now;
+        restart->window_count = 0;
+    }
+
+    if(process->options.max_restarts > 0 && restart->window_count >= process->options.max_restarts) {
+        verbose("[-] process %lu: %d restarts within %ds, giving up\n",
+                process->id, restart->window_count, process->options.restart_window);
+
+        restart->exhausted = true;
+        return 0;
+    }
+
+    restart->window_count++;
+
+    return 1;
+}
+
+// exponential backoff with jitter, process mutex must be held
+int process_restart_delay(struct tty_process *process) {
+    tty_restart *restart = &process->restart;
+    int delay = RESTART_BACKOFF_MAX;
+
+    if(restart->attempt < 16 && (RESTART_BACKOFF_MIN << restart->attempt) < RESTART_BACKOFF_MAX)
+        delay = RESTART_BACKOFF_MIN << restart->attempt;
+
+    restart->attempt++;
+
+    // keep half of the delay, randomize the other half to
+    // avoid restarting crashed processes all together
+    return delay / 2 + rand_r(&restart->seed) % (delay / 2 + 1);
+}
+
+// called once the child is reaped, by the reaper or by the process thread
+void process_exited(struct tty_process *process, int wstatus) {
+    PROBE3(process__exit, process->id, process->pid, wstatus);
+
+    pthread_mutex_lock(&process->mutex);
+
+    process->wstatus = wstatus;
+    process->running = false;
+
+    struct json_object *event = json_object_new_object();
+    json_object_object_add(event, "pid", json_object_new_int(process->pid));
+
+    if(WIFEXITED(wstatus))
+        json_object_object_add(event, "code", json_object_new_int(WEXITSTATUS(wstatus)));
+
+    if(WIFSIGNALED(wstatus))
+        json_object_object_add(event, "signal", json_object_new_int(WTERMSIG(wstatus)));
+
+    events_emit("exited", process->id, event);
+
+    // waking up reader before releasing the state, process
+    // can be removed as soon as the state is final
+    process_wakeup(process);
+
+    if(process_restart_wanted(process, wstatus)) {
+        process->state = RESTARTING;
+
+    } else {
+        process->state = STOPPED;
+
+        if(*process->error || process->restart.exhausted)
+            process->state = CRASHED;
+    }
+
+    process_changed(process);
+
+    pthread_cond_broadcast(&process->notifier);
+    pthread_mutex_unlock(&process->mutex);
+}
+
+// allocate a process and its command, nothing is started yet
+struct tty_process *process_new(struct tty_server *ts, int argc, char **argv, tty_process_options *options) {
     struct tty_process *process;
     size_t cmd_len = 0;
 
     process = xmalloc(sizeof(struct tty_process));
     memset(process, 0, sizeof(struct tty_process));
 
-    // internal id is just variable's address
-    // it's unique for the running instance
-    process->id = (size_t) process;
+    // internal id is a counter, unique for the running instance
+    // and kept across hot restarts
+    process->id = __atomic_add_fetch(&ts->next_id, 1, __ATOMIC_SEQ_CST);
 
     // shared memory across forks
     process->error = mmap(NULL, sizeof(char *), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
@@ -282,6 +641,28 @@ struct tty_process *tty_server_process_start(struct tty_server *ts, int argc, ch
     process->state = CREATED;
     process->server = server;
     process->wstatus = 0;
+    process->pidfd = -1;
+    process->pty = -1;
+    process->reported = -1;
+    process->refs = 1;
+
+    if(options)
+        tty_process_options_copy(&process->options, options);
+    else
+        tty_process_options_default(&process->options);
+
+    process->restart.window_start = time(NULL);
+    process->restart.seed = (unsigned int) (process->id ^ time(NULL));
+
+    if((process->wakeup = eventfd(0, EFD_CLOEXEC)) < 0) {
+        warnp("eventfd");
+
+        munmap(process->error, sizeof(char *));
+        tty_process_options_free(&process->options);
+        free(process);
+
+        return NULL;
+    }
 
     process->argv = xmalloc(sizeof(char *) * (argc + 1));
     for (int i = 0; i < argc; i++) {
@@ -304,28 +685,54 @@ struct tty_process *tty_server_process_start(struct tty_server *ts, int argc, ch
 
     *ptr = '\0'; // null terminator
 
-    process->logs = circular_new(LOGS_SIZE);
+    process->logs = circular_new(process->options.scrollback ? process->options.scrollback : LOGS_SIZE);
 
     // initial lock, will unlock when process is ready
     pthread_mutex_init(&process->mutex, NULL);
     pthread_cond_init(&process->notifier, NULL);
+    LIST_INIT(&process->viewers);
+    LIST_INIT(&process->shares);
+    uring_process_init(process);
+
+    return process;
+}
+
+// start the process supervision thread and publish the process, a
+// process already running (hot restart) is adopted and not spawned
+struct tty_process *process_launch(struct tty_server *ts, struct tty_process *process) {
+    // leaf cgroup is kept across restarts
+    if(tty_limits_isset(&process->options.limits))
+        cgroup_create(process);
+
+    record_start(process);
 
-    // starting the process
     if(pthread_create(&process->thread, NULL, mainthread_run_command, process))
         return warnp("pthread_create");
 
-    pthread_mutex_lock(&ts->mutex);
+    server_lock(&ts->mutex);
+    process_changed(process);
     LIST_INSERT_HEAD(&ts->processes, process, list);
-    pthread_mutex_unlock(&ts->mutex);
+    server_unlock(&ts->mutex);
 
     return process;
 }
 
-void process_remove(struct tty_process *process) {
+struct tty_process *tty_server_process_start(struct tty_server *ts, int argc, char **argv, tty_process_options *options) {
+    struct tty_process *process;
+
+    if(!(process = process_new(ts, argc, argv, options)))
+        return NULL;
+
+    return process_launch(ts, process);
+}
+
+// last reference released, nothing can reach the process anymore
+static void process_free(struct tty_process *process) {
     // cleaning shared memory
     munmap(process->error, sizeof(char *));
 
-    pthread_join(process->thread, NULL);
+    watch_free(process);
+    lines_free(process);
 
     for(int i = 0; ; i++) {
         if(process->argv[i] == NULL)
@@ -337,20 +744,74 @@ void process_remove(struct tty_process *process) {
     free(process->argv);
     free(process->command);
 
+    close(process->wakeup);
+
+    if(process->pty >= 0)
+        close(process->pty);
+
     circular_free(process->logs);
+    tty_process_options_free(&process->options);
 
-    pthread_mutex_lock(&server->mutex);
-    LIST_REMOVE(process, list);
-    pthread_mutex_unlock(&server->mutex);
+    pthread_mutex_destroy(&process->mutex);
+    pthread_cond_destroy(&process->notifier);
 
     free(process);
 }
 
+void process_hold(struct tty_process *process) {
+    __atomic_add_fetch(&process->refs, 1, __ATOMIC_SEQ_CST);
+}
+
+void process_release(struct tty_process *process) {
+    if(__atomic_sub_fetch(&process->refs, 1, __ATOMIC_SEQ_CST) == 0)
+        process_free(process);
+}
+
+// stop tracking the process, it is freed once its viewers and
+// pending lookups released their reference
+void process_remove(struct tty_process *process) {
+    // unlisted before anything is released, lookups (by id,
+    // search) can't reach a half released process
+    server_lock(&server->mutex);
+
+    // removed concurrently (api, manifest reload)
+    if(process->removed) {
+        server_unlock(&server->mutex);
+        return;
+    }
+
+    process->removed = true;
+    LIST_REMOVE(process, list);
+
+    // keeping track of removal for listing delta
+    tty_removed *removed = &server->removed[server->removed_count % REMOVED_LOG];
+    removed->id = process->id;
+    removed->version = __atomic_add_fetch(&server->version, 1, __ATOMIC_SEQ_CST);
+    server->removed_count++;
+
+    server_unlock(&server->mutex);
+
+    // control socket subscribers and websocket clients are told
+    control_detach(process);
+    process_viewers_close(process);
+
+    events_emit("removed", process->id, NULL);
+
+    pthread_join(process->thread, NULL);
+
+    // pty reader is gone, no more output fed to the recording
+    record_stop(process);
+    cgroup_remove(process);
+
+    // processes list reference
+    process_release(process);
+}
+
 struct tty_process *process_getby_pid(int pid, int only_running) {
     struct tty_process *process;
     struct tty_process *found = NULL;
 
-    pthread_mutex_lock(&server->mutex);
+    server_lock(&server->mutex);
 
     LIST_FOREACH(process, &server->processes, list) {
         if(process->running == false && only_running == 1)
@@ -362,30 +823,42 @@ struct tty_process *process_getby_pid(int pid, int only_running) {
         }
     }
 
-    pthread_mutex_unlock(&server->mutex);
+    server_unlock(&server->mutex);
 
     return found;
 }
 
-struct tty_process *process_getby_id(size_t id) {
+// server mutex must be held
+struct tty_process *process_getby_name(const char *name) {
+    struct tty_process *process;
+
+    LIST_FOREACH(process, &server->processes, list)
+        if(process->options.name && strcmp(process->options.name, name) == 0)
+            return process;
+
+    return NULL;
+}
+
+// lookup by id, a reference is taken, to be released with process_release
+struct tty_process *process_lookup(size_t id) {
     struct tty_process *process;
     struct tty_process *found = NULL;
 
-    pthread_mutex_lock(&server->mutex);
+    server_lock(&server->mutex);
 
     LIST_FOREACH(process, &server->processes, list) {
         if(process->id == id) {
             found = process;
+            process_hold(found);
             break;
         }
     }
 
-    pthread_mutex_unlock(&server->mutex);
+    server_unlock(&server->mutex);
 
     return found;
 }
 
-
 void tty_server_free(struct tty_server *ts) {
     if (ts == NULL)
         return;
@@ -420,44 +893,109 @@ void tty_server_free(struct tty_server *ts) {
     free(ts);
 }
 
+//
+// websocket service threads
+//
+// connections are spread by libwebsockets across its service threads,
+// each client stays on the thread which accepted it, main thread
+// services the first one
+//
+static void *service_run(void *args) {
+    tty_service *service = (tty_service *) args;
+
+    while(!force_exit) {
+        lws_service_tsi(context, 10, service->tsi);
+    }
+
+    return NULL;
+}
+
+int services_init(int threads) {
+    server->services = xmalloc(sizeof(tty_service) * threads);
+    memset(server->services, 0, sizeof(tty_service) * threads);
+
+    if(threads != server->threads)
+        verbose("[-] service: libwebsockets limited to %d threads\n", threads);
+
+    server->threads = threads;
+
+    for(int i = 0; i < threads; i++) {
+        tty_service *service = &server->services[i];
+
+        service->tsi = i;
+        LIST_INIT(&service->clients);
+        LIST_INIT(&service->streams);
+        LIST_INIT(&service->searches);
+        LIST_INIT(&service->starts);
+        TAILQ_INIT(&service->bulk);
+
+        if(i == 0)
+            continue;
+
+        if(pthread_create(&service->thread, NULL, service_run, service)) {
+            warnp("service: pthread_create");
+            return 1;
+        }
+    }
+
+    verbose("[+] service: %d websocket service threads\n", threads);
+
+    return 0;
+}
+
+void services_join() {
+    for(int i = 1; i < server->threads; i++)
+        pthread_join(server->services[i].thread, NULL);
+
+    free(server->services);
+}
+
+// hot restart, processes are kept running and handed over
+// to the binary executed again once the service loop exited
+void sig_upgrade(int sig) {
+    if (force_exit)
+        return;
+
+    server->upgrade = true;
+    force_exit = true;
+
+    lws_cancel_service(context);
+}
+
+// processes are stopped by the main thread once the service
+// loop exited, nothing here can take a lock or allocate
 void sig_handler(int sig) {
     if (force_exit)
-        exit(EXIT_FAILURE);
+        _exit(EXIT_FAILURE);
 
-    char sig_name[20];
-    get_sig_name(sig, sig_name, sizeof(sig_name));
-    verbose("[+] received signal: %s (%d), exiting...\n", sig_name, sig);
+    exit_signal = sig;
     force_exit = true;
 
-    // killing processes
+    lws_cancel_service(context);
+}
+
+// stop every process, main thread only
+static void processes_stop() {
     struct tty_process *process;
 
-    pthread_mutex_lock(&server->mutex);
+    server_lock(&server->mutex);
 
-    LIST_FOREACH(process, &server->processes, list) {
+    LIST_FOREACH(process, &server->processes, list)
         tty_server_process_stop(process);
-        // FIXME: defunct
-    }
-
-    pthread_mutex_unlock(&server->mutex);
 
-    lws_cancel_service(context);
-    verbose("[+] waiting, you can force with another SIGINT\n");
+    server_unlock(&server->mutex);
 }
 
 int main(int argc, char **argv) {
-    int __argc = 1;
-    char *__argv[1] = {"/bin/bash"};
+    int resume_fd = -1;
+    bool manifest = false;
+    char *control = NULL;
 
     server = tty_server_new();
+    upgrade_init(argc, argv);
 
-    tty_server_process_start(server, __argc, __argv);
-
-    int __nargc = 5;
-    char *__nargv[5] = {"/usr/bin/python4", "/tmp/maxux-ttyd.py", "--demo", "--argument", "debug"};
-    tty_server_process_start(server, __nargc, __nargv);
-
-    pthread_mutex_init(&server->mutex, NULL);
+    reaper_init();
+    stats_init();
 
     struct lws_context_creation_info info;
     memset(&info, 0, sizeof(info));
@@ -475,6 +1013,7 @@ int main(int argc, char **argv) {
     int debug_level = LLL_ERR | LLL_WARN | LLL_NOTICE;
     char iface[128] = "";
     bool ssl = false;
+    bool ktls = false;
     char cert_path[1024] = "";
     char key_path[1024] = "";
     char ca_path[1024] = "";
@@ -506,6 +1045,48 @@ int main(int argc, char **argv) {
             case 'o':
                 server->once = true;
                 break;
+            case 'G':
+                if(cgroup_init(optarg))
+                    return -1;
+                break;
+            case 'U':
+                if(uring_init())
+                    return -1;
+                server->io_uring = true;
+                break;
+            case 'N':
+                server->threads = atoi(optarg);
+                if(server->threads < 1) {
+                    fprintf(stderr, "ttyd: invalid threads count: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'M':
+                if(manifest_init(optarg))
+                    return -1;
+                manifest = true;
+                break;
+            case 'z':
+                resume_fd = atoi(optarg);
+                break;
+            case 'X':
+                control = optarg;
+                break;
+            case 'E':
+                server->record = strdup(optarg);
+                break;
+            case 'l':
+                server->latency = true;
+                break;
+            case 'B':
+                if(parse_size(optarg, &server->scrollback_budget) || server->scrollback_budget == 0) {
+                    fprintf(stderr, "ttyd: invalid scrollback budget: %s\n", optarg);
+                    return -1;
+                }
+
+                if(governor_init(server->scrollback_budget))
+                    return -1;
+                break;
             case 'p':
                 info.port = atoi(optarg);
                 if (info.port < 0) {
@@ -572,6 +1153,9 @@ int main(int argc, char **argv) {
             case 'S':
                 ssl = true;
                 break;
+            case 'L':
+                ktls = true;
+                break;
             case 'C':
                 strncpy(cert_path, optarg, sizeof(cert_path) - 1);
                 cert_path[sizeof(cert_path) - 1] = '\0';
@@ -633,6 +1217,13 @@ int main(int argc, char **argv) {
 #endif
 #endif
 
+    // idle http connections are kept for the next requests
+    info.keepalive_timeout = HTTP_KEEPALIVE;
+
+#ifdef LWS_WITH_HTTP2
+    info.alpn = "h2,http/1.1";
+#endif
+
     if (strlen(iface) > 0) {
         info.iface = iface;
         if (endswith(info.iface, ".sock") || endswith(info.iface, ".socket")) {
@@ -647,6 +1238,8 @@ int main(int argc, char **argv) {
     }
 
     if (ssl) {
+        tls_init(ktls);
+
         info.ssl_cert_filepath = cert_path;
         info.ssl_private_key_filepath = key_path;
         info.ssl_ca_filepath = ca_path;
@@ -692,8 +1285,28 @@ int main(int argc, char **argv) {
     if(server->index != NULL)
         verbose("[+]   custom index.html: %s\n", server->index);
 
+    if(resume_fd >= 0) {
+        // processes are handed over by the previous instance
+        if(upgrade_resume(resume_fd))
+            return 1;
+
+    } else if(optind < argc) {
+        // command given on the command line
+        tty_server_process_start(server, argc - optind, argv + optind, NULL);
+    }
+
+    // manifest entries already running (hot restart) are kept
+    if(manifest && manifest_load())
+        return 1;
+
+    if(control && control_init(control))
+        return 1;
+
     signal(SIGINT, sig_handler);
     signal(SIGTERM, sig_handler);
+    signal(SIGUSR2, sig_upgrade);
+
+    info.count_threads = server->threads;
 
     context = lws_create_context(&info);
     if(context == NULL) {
@@ -701,12 +1314,37 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    // libwebsockets main loop
+    // libwebsockets can be built with less threads support
+    if(services_init(lws_get_count_threads(context)))
+        return 1;
+
+    // libwebsockets main loop, first service thread
     while(!force_exit) {
-        lws_service(context, 10);
+        lws_service_tsi(context, 10, 0);
+    }
+
+    // interrupted, the context is still alive for process changes
+    if(!server->upgrade) {
+        char sig_name[20];
+
+        get_sig_name(exit_signal, sig_name, sizeof(sig_name));
+        verbose("[+] received signal: %s (%d), exiting...\n", sig_name, exit_signal);
+        processes_stop();
+        verbose("[+] waiting, you can force with another SIGINT\n");
     }
 
+    services_join();
     lws_context_destroy(context);
+    control_close();
+
+    if(server->upgrade)
+        verbose("[+] received signal: upgrade requested, handing over processes\n");
+
+    // listeners are closed, handing over to the new binary
+    if(server->upgrade && upgrade_exec()) {
+        fprintf(stderr, "[-] upgrade failed, stopping processes\n");
+        processes_stop();
+    }
 
     // cleanup
     tty_server_free(server);
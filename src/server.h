@@ -1,10 +1,14 @@
 #include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
 #include <sys/ioctl.h>
 #include <sys/queue.h>
+#include <sys/uio.h>
 
 // client message
 #define INPUT '0'
 #define RESIZE_TERMINAL '1'
+#define PING '2'
 #define JSON_DATA '{'
 
 // server message
@@ -12,6 +16,7 @@
 #define SET_WINDOW_TITLE '1'
 #define SET_PREFERENCES '2'
 #define SET_RECONNECT '3'
+#define PONG '4'
 
 // websocket url path
 #define WS_PATH "/ws"
@@ -20,8 +25,24 @@
 
 #define LOGS_SIZE 16384 // 16K
 
+#define RESTART_BACKOFF_MIN 1000   // first restart delay (ms)
+#define RESTART_BACKOFF_MAX 60000  // maximum restart delay (ms)
+#define RESTART_WINDOW 60          // default restart window (seconds)
+
+#define STATS_INTERVAL 1           // resources sampling interval (seconds)
+
+#define REMOVED_LOG 256            // removed processes kept for listing delta
+
+#define EVENTS_LOG 1024            // events kept for consumers catching up
+
+#define LATENCY_BUCKETS 25         // log2 microseconds buckets (up to 16s)
+
+#define HTTP_BODY_MAX 1048576      // request body limit (1M)
+#define HTTP_KEEPALIVE 60          // idle keep-alive connections timeout (seconds)
+
 extern volatile bool force_exit;
 extern struct lws_context *context;
+extern char *__process_states[];
 extern struct tty_server *server;
 
 enum pty_state {
@@ -37,10 +58,17 @@ typedef struct buffer_t {
 } buffer_t;
 
 typedef struct circbuf_t {
-    size_t length;
-    char *buffer;
-    char *reader;
-    char *writer;
+    size_t length;                 // ring size
+    char *buffer;                  // ring memory
+    uint64_t written;              // bytes written since creation
+    size_t reserved;               // bytes reserved for a pending write
+    int memfd;                     // shared memory backing the ring (-1: none)
+    struct control_ring *shared;   // shared header, published on changes
+    bool exported;                 // memfd handed out once, never frozen again
+    char *frozen;                  // compressed content, memory released (NULL: none)
+    size_t frozen_length;          // compressed length
+    uint64_t frozen_first;         // frozen data offsets
+    uint64_t frozen_written;
 
 } circbuf_t;
 
@@ -51,14 +79,146 @@ typedef enum tty_process_state {
     STOPPING,
     STOPPED,
     CRASHED,
+    RESTARTING,
 
 } tty_process_state;
 
+typedef enum tty_restart_policy {
+    RESTART_NEVER,
+    RESTART_ON_FAILURE,
+    RESTART_ALWAYS,
+
+} tty_restart_policy;
+
+typedef struct tty_limits {
+    unsigned int cpu_weight;       // cpu.weight (1-10000, 0: unset)
+    uint64_t memory_max;           // memory.max in bytes (0: unset)
+    unsigned int pids_max;         // pids.max (0: unset)
+    unsigned int io_weight;        // io.weight (1-10000, 0: unset)
+
+} tty_limits;
+
+typedef struct tty_stats {
+    uint64_t rss;                  // resident memory in bytes
+    uint64_t cpu_time;             // user and system time in ms
+    double cpu_rate;               // cpu usage, percent of one core
+    uint64_t io_read;              // storage bytes read
+    uint64_t io_write;             // storage bytes written
+    uint64_t output;               // pty output bytes
+    double output_rate;            // pty output bytes per second
+    int viewers;                   // attached websocket clients
+    bool cgroup;                   // cgroup values are available
+    uint64_t cgroup_memory;        // cgroup memory.current
+    uint64_t cgroup_pids;          // cgroup pids.current
+    struct timespec sampled;       // sample time (monotonic)
+
+} tty_stats;
+
+typedef enum tty_latency_stage {
+    LATENCY_INPUT,
+    LATENCY_PROCESS,
+    LATENCY_OUTPUT,
+    LATENCY_ECHO,
+    LATENCY_RTT,
+    LATENCY_STAGES,
+
+} tty_latency_stage;
+
+typedef struct tty_histogram {
+    uint64_t count;
+    uint64_t sum;                  // microseconds
+    uint64_t max;
+    uint64_t buckets[LATENCY_BUCKETS];
+
+} tty_histogram;
+
+typedef struct tty_latency {
+    tty_histogram stages[LATENCY_STAGES];
+
+} tty_latency;
+
+typedef enum tty_probe_state {
+    PROBE_IDLE,
+    PROBE_OUTPUT,                  // input written, waiting for output
+    PROBE_SEND,                    // output read, waiting to be sent
+
+} tty_probe_state;
+
+// keystroke followed along its path (process mutex)
+typedef struct tty_probe {
+    tty_probe_state state;
+    struct tty_client *client;     // client who typed it
+    uint64_t received;             // timestamps (monotonic ns)
+    uint64_t written;
+    uint64_t read;
+    uint64_t offset;               // logs offset of the output
+
+} tty_probe;
+
+typedef struct tty_process_options {
+    tty_restart_policy restart;    // restart policy
+    int max_restarts;              // restarts allowed within the window (0: no limit)
+    int restart_window;            // restart window in seconds
+    tty_limits limits;             // resources limits
+    size_t scrollback;             // logs ring size (0: default)
+    int weight;                    // output share among flooding processes (100: default)
+    char *name;                    // manifest entry name, if any
+    char *cwd;                     // working directory (NULL: inherited)
+    char **env;                    // extra environment, NULL terminated
+    char **depends;                // processes names to be running first
+    char *record;                  // recording directory (NULL: not recorded)
+
+} tty_process_options;
+
+typedef struct tty_restart {
+    int restarts;                  // restarts since the process was created
+    int attempt;                   // consecutive restarts, backoff exponent
+    int window_count;              // restarts within current window
+    time_t window_start;           // current window beginning
+    time_t started;                // last (re)start time
+    bool exhausted;                // restart limit reached, gave up
+    bool requested;                // restart requested regardless of policy
+    unsigned int seed;             // jitter random seed
+
+} tty_restart;
+
+typedef enum uring_op {
+    URING_READ,
+    URING_WRITE,
+    URING_CANCEL,
+
+} uring_op;
+
+typedef struct uring_request {
+    uring_op op;                   // operation kind
+    struct tty_process *process;   // process owning the request
+    char *data;                    // input payload (write)
+    size_t length;                 // input payload length
+    size_t done;                   // input bytes already written
+
+    STAILQ_ENTRY(uring_request) next;
+} uring_request;
+
+typedef struct uring_state {
+    bool active;                   // pty is handled by the io_uring engine
+    bool eof;                      // pty closed or read failed
+    bool cancel;                   // no more requests are submitted
+    int inflight;                  // requests submitted, not yet completed
+    struct iovec iov[2];           // logs segments targeted by the read
+    uring_request read;            // pty read request
+    STAILQ_HEAD(, uring_request) writes; // input waiting to be written
+    pthread_cond_t drained;        // nothing in flight anymore
+    pthread_mutex_t mutex;
+
+} uring_state;
+
 struct tty_process {
     pthread_t thread;              // main fork tread
     size_t id;                     // internal id representation
     int pid;                       // child process id
     int pty;                       // pty file descriptor
+    int pidfd;                     // process file descriptor (reaper)
+    int wakeup;                    // eventfd to wake up the pty reader
     int running;                   // process is running
     char **argv;                   // command with arguments
     char *command;                 // full command line
@@ -66,9 +226,31 @@ struct tty_process {
     int wstatus;                   // process end-of-life status
     struct tty_server *server;     // main server link
     circbuf_t *logs;               // circular buffer for logs
+    struct winsize size;           // last window size requested
+    tty_process_options options;   // process settings
+    tty_restart restart;           // restart supervision status
+    char *cgroup;                  // cgroup v2 leaf path, if any
+    uint64_t output_bytes;         // pty output counter
+    uint64_t idle_output;          // output counter seen by the governor
+    time_t idle_since;             // no output since (governor, monotonic)
+    int subscribers;               // control socket output subscriptions
+    int sharers;                   // shared ring consumers count
+    LIST_HEAD(, control_share) shares; // shared ring consumers (process mutex)
+    struct tty_watch *watch;       // output watch rules (NULL: none)
+    int reported;                  // last state on the events log (-1: none)
+    struct tty_lines *lines;       // logs line index, built on first query
+    struct tty_record *record;     // session recording (NULL: not recorded)
+    tty_latency latency;           // echo latency histograms
+    tty_probe probe;               // keystroke being followed
+    uint64_t version;              // listing version of the last change
+    uring_state uring;             // io_uring engine state
+    tty_stats stats;               // last resources usage sample
+    LIST_HEAD(, tty_client) viewers; // attached clients (process mutex)
     pthread_mutex_t mutex;
     pthread_cond_t notifier;
     tty_process_state state;       // process state
+    int refs;                      // references (list, viewers, lookups), last one frees
+    bool removed;                  // unlisted, being removed (server mutex)
 
     LIST_ENTRY(tty_process) list;
 };
@@ -90,22 +272,88 @@ struct tty_client {
     int pty;
     struct tty_process *process;
     enum pty_state state;
-    char pty_buffer[LWS_PRE + 1 + BUF_SIZE];
-    ssize_t pty_len;
+    uint64_t offset;               // next process logs offset to send
+    int tsi;                       // owning service thread index
+    bool pending;                  // process output waiting to be sent
+    bool closing;                  // process removed, to be closed by its service thread
+    bool queued;                   // backlogged, served by turns (service thread)
+    bool granted;                  // has the turn
+    size_t deficit;                // bytes allowed, carried over turns
+    tty_latency latency;           // echo latency histograms
+    bool probing;                  // a keystroke of this client is followed
+    char ping[128];                // ping payload to send back
+    size_t ping_length;
     pthread_t thread;
     pthread_mutex_t mutex;
     pthread_cond_t cond;
 
     LIST_ENTRY(tty_client) list;
+    LIST_ENTRY(tty_client) service;
+    LIST_ENTRY(tty_client) viewers;
+    TAILQ_ENTRY(tty_client) sched;
 };
 
+typedef struct tty_service {
+    int tsi;                       // libwebsockets service thread index
+    pthread_t thread;              // service thread (none for index 0)
+    bool pending;                  // some clients have output pending
+    bool events;                   // new events for the streams
+    bool searched;                 // searches finished for the requests
+    bool started;                  // processes changed, parked starts to check
+    LIST_HEAD(, tty_client) clients; // clients owned by this thread only
+    LIST_HEAD(, pss_http) streams; // events streams owned by this thread only
+    LIST_HEAD(, pss_http) searches; // requests waiting for a search, this thread only
+    LIST_HEAD(, pss_http) starts;  // requests waiting for a process start, this thread only
+    TAILQ_HEAD(, tty_client) bulk; // backlogged clients, round-robin
+    struct tty_client *current;    // backlogged client having the turn
+
+} tty_service;
+
+typedef enum http_method {
+    HTTP_GET,
+    HTTP_POST,
+    HTTP_PUT,
+    HTTP_DELETE,
+
+} http_method;
+
 struct pss_http {
     char path[128];
     char *buffer;
     char *ptr;
     size_t len;
+    bool shared;                   // buffer is static memory, not owned
+    const struct http_route *route; // route matched, waiting for the body
+    struct json_tokener *tokener;  // request body streaming parser
+    struct json_object *body;      // request body, once parsed
+    size_t body_len;               // request body bytes received
+    bool body_error;               // request body is not valid json
+    struct lws *wsi;
+    bool stream;                   // events stream (server-sent events)
+    uint64_t seq;                  // last event sent on the stream
+    struct search_task *search;    // search running for the request
+    struct tty_process *starting;  // process started by the request (referenced)
+    LIST_ENTRY(pss_http) streams;
+    LIST_ENTRY(pss_http) searches;
+    LIST_ENTRY(pss_http) starts;
 };
 
+typedef struct search_options {
+    bool regex;                    // query is a posix extended regex
+    bool icase;                    // case insensitive
+    bool ansi;                     // escape sequences stripped before matching
+    size_t context;                // context bytes around a match
+    size_t limit;                  // matches returned at most
+    size_t id;                     // single process to search (0: all)
+
+} search_options;
+
+typedef struct tty_removed {
+    size_t id;                     // removed process id
+    uint64_t version;              // listing version of the removal
+
+} tty_removed;
+
 struct tty_server {
     LIST_HEAD(client, tty_client) clients;     // client list
     LIST_HEAD(process, tty_process) processes; // process list
@@ -123,25 +371,179 @@ struct tty_server {
     bool once;                                 // whether accept only one client and exit on disconnection
     char socket_path[255];                     // UNIX domain socket path
     char terminal_type[30];                    // terminal type to report
+    char *record;                              // default recording directory
+    uint64_t scrollback_budget;                // rings resident bytes budget (0: none)
+    bool latency;                              // keystrokes echo latency followed
+    bool io_uring;                             // pty i/o handled by io_uring engine
+    int threads;                               // websocket service threads
+    tty_service *services;                     // per service thread state
+    size_t next_id;                            // last process id given
+    bool upgrade;                              // hot restart requested
+    uint64_t version;                          // processes listing version
+    uint64_t stats_version;                    // resources sampling generation
+    pthread_cond_t changed;                    // a process changed (server mutex)
+    tty_removed removed[REMOVED_LOG];          // last removed processes
+    size_t removed_count;                      // removed processes count
     pthread_mutex_t mutex;
 };
 
 extern int callback_http(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len);
 extern int callback_tty(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len);
+void http_changed();
+void http_flush(int tsi);
 
 char *tty_server_process_state(struct tty_process *process);
 struct tty_process *tty_server_process_stop(struct tty_process *process);
-struct tty_process *tty_server_process_start(struct tty_server *ts, int argc, char **argv);
+struct tty_process *tty_server_process_start(struct tty_server *ts, int argc, char **argv, tty_process_options *options);
+struct tty_process *process_new(struct tty_server *ts, int argc, char **argv, tty_process_options *options);
+struct tty_process *process_launch(struct tty_server *ts, struct tty_process *process);
+void tty_process_options_default(tty_process_options *options);
+void tty_process_options_copy(tty_process_options *target, tty_process_options *source);
+void tty_process_options_free(tty_process_options *options);
 void process_remove(struct tty_process *process);
+void process_hold(struct tty_process *process);
+void process_release(struct tty_process *process);
+struct tty_process *process_lookup(size_t id);
+void process_viewers_close(struct tty_process *process);
+void process_exited(struct tty_process *process, int wstatus);
+void process_changed(struct tty_process *process);
+int process_restart_delay(struct tty_process *process);
+void process_wakeup(struct tty_process *process);
+void process_resize(struct tty_process *process, struct winsize *size);
+
+void process_output(struct tty_process *process, size_t length);
+void service_flush(int tsi);
+void sched_wakeup(struct tty_client *client);
+size_t sched_budget(struct tty_client *client);
+void sched_written(struct tty_client *client, size_t length, uint64_t remaining);
+void sched_remove(struct tty_client *client);
+int services_init(int threads);
+void services_join();
+
+// io_uring engine
+int uring_init();
+void uring_process_init(struct tty_process *process);
+int uring_pump(struct tty_process *process);
+int uring_write(struct tty_process *process, char *data, size_t length);
+int uring_quiesce(struct tty_process *process, struct timespec *deadline);
+
+// processes manifest
+int manifest_init(const char *filename);
+int manifest_load();
+char *process_spec_parse(struct json_object *object, char ***argv, tty_process_options *options);
+
+// control socket
+int control_init(const char *path);
+void control_close();
+void control_notify(struct tty_process *process);
+void control_changed();
+void control_detach(struct tty_process *process);
+
+// scrollback search
+int search_request(struct pss_http *pss, struct lws *wsi, const char *query, search_options *options, char **error);
+struct json_object *search_response(struct pss_http *pss);
+void search_request_remove(struct pss_http *pss);
+void search_flush(int tsi);
+size_t ansi_strip(const char *source, size_t length, char *target, uint32_t *map);
+size_t ansi_plain(const char *source, size_t length, char *target);
+
+// logs line index
+uint64_t lines_tail(struct tty_process *process, size_t count, size_t *skip);
+void lines_free(struct tty_process *process);
+
+// output watchers
+size_t watch_add(struct tty_process *process, struct json_object *object, char **error);
+int watch_remove(struct tty_process *process, size_t id);
+struct json_object *watch_json(struct tty_process *process);
+void watch_feed(struct tty_process *process);
+void watch_free(struct tty_process *process);
+
+// session recording
+void record_start(struct tty_process *process);
+void record_stop(struct tty_process *process);
+void record_feed(struct tty_process *process);
+void record_input(struct tty_process *process, const char *data, size_t length);
+void record_resize(struct tty_process *process);
+char *record_replay(struct tty_process *process, double from, double to, size_t *length);
+struct json_object *record_json(struct tty_process *process);
+
+// events log
+uint64_t events_emit(const char *type, size_t id, struct json_object *event);
+void events_process(struct tty_process *process);
+void events_resize(struct tty_process *process);
+char *events_since(uint64_t since);
+uint64_t events_last();
+void events_resume(uint64_t seq);
+char *events_sse(uint64_t *since, size_t *length);
+void events_stream_add(struct pss_http *pss, struct lws *wsi, uint64_t since);
+void events_stream_remove(struct pss_http *pss);
+void events_flush(int tsi);
+
+// echo latency
+uint64_t latency_now();
+void latency_input(struct tty_client *client, uint64_t received);
+void latency_output(struct tty_process *process, size_t length);
+void latency_sent(struct tty_client *client);
+void latency_detach(struct tty_client *client);
+void latency_ping(struct tty_client *client, const char *payload, size_t length);
+struct json_object *latency_json(size_t id);
+
+// tls sessions
+void tls_init(bool ktls);
+void tls_context_setup(struct ssl_ctx_st *ctx);
+struct json_object *tls_json();
+
+// hot restart
+void upgrade_init(int argc, char **argv);
+int upgrade_exec();
+int upgrade_resume(int fd);
 
 struct tty_process *process_getby_pid(int pid, int only_running);
-struct tty_process *process_getby_id(size_t id);
+struct tty_process *process_getby_name(const char *name);
+
+// restart policies
+char *restart_policy_name(tty_restart_policy policy);
+int restart_policy_parse(const char *name, tty_restart_policy *policy);
+
+// resources limits
+int cgroup_init(const char *root);
+int cgroup_create(struct tty_process *process);
+void cgroup_remove(struct tty_process *process);
+void limits_enter(struct tty_process *process);
+bool tty_limits_isset(tty_limits *limits);
+int cgroup_sample(const char *cgroup, tty_stats *stats);
+
+// resources accounting
+int stats_init();
+struct json_object *stats_json(tty_stats *stats);
+
+// process reaper
+int reaper_init();
+int reaper_watch(struct tty_process *process);
+void reaper_wait(struct tty_process *process);
+int reaper_kill(struct tty_process *process, int sig);
+void reaper_suspend();
+void reaper_resume();
 
 // circular buffer
 circbuf_t *circular_new(size_t length);
 void circular_free(circbuf_t *circular);
 size_t circular_append(circbuf_t *circular, uint8_t *data, size_t length);
 buffer_t *circular_get(circbuf_t *circular, size_t length);
+int circular_reserve(circbuf_t *circular, struct iovec *iov, size_t length);
+void circular_commit(circbuf_t *circular, size_t length);
+uint64_t circular_first(circbuf_t *circular);
+size_t circular_read(circbuf_t *circular, uint64_t offset, char *target, size_t length);
+int circular_share(circbuf_t *circular);
+
+// scrollback governor
+int governor_init(uint64_t budget);
+int circular_freeze(circbuf_t *circular);
+void circular_thaw(circbuf_t *circular);
+void circular_unfreeze(circbuf_t *circular);
+size_t circular_resident(circbuf_t *circular);
+struct json_object *governor_json();
+struct json_object *governor_process_json(circbuf_t *circular);
 
 buffer_t *buffer_new(size_t length);
 void buffer_free(buffer_t *buffer);
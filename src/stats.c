@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/queue.h>
+
+#include <libwebsockets.h>
+#include <json.h>
+
+#include "server.h"
+#include "probes.h"
+#include "utils.h"
+
+//
+// resources accounting
+//
+// a background collector samples every process from /proc (or from
+// its cgroup) and caches the result into the process, api handlers
+// only read the cached sample and never touch /proc themselves
+//
+// processes to sample are collected under the server lock, sampling
+// itself is done without it, the sample is published under the
+// process mutex
+//
+typedef struct stats_target {
+    struct tty_process *process;   // referenced
+    char *cgroup;                  // cgroup path copy (NULL: none)
+    int viewers;
+
+} stats_target;
+
+static pthread_t stats_thread;
+static long stats_ticks;
+static long stats_pagesize;
+
+static int stats_read_file(const char *filename, char *buffer, size_t length) {
+    int fd;
+
+    if((fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+
+    ssize_t len = read(fd, buffer, length - 1);
+    close(fd);
+
+    if(len < 0)
+        return -1;
+
+    buffer[len] = '\0';
+    return 0;
+}
+
+// /proc/<pid>/stat: utime (14), stime (15) and rss (24)
+static void stats_read_stat(int pid, tty_stats *stats) {
+    char filename[64], buffer[1024];
+    unsigned long utime, stime;
+    long rss;
+
+    sprintf(filename, "/proc/%d/stat", pid);
+    if(stats_read_file(filename, buffer, sizeof(buffer)))
+        return;
+
+    // command name can contains spaces, skipping it
+    char *ptr = strrchr(buffer, ')');
+    if(!ptr)
+        return;
+
+    if(sscanf(ptr + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %*d %*d %*d %*d %*d %*d %*u %*u %ld",
+              &utime, &stime, &rss) != 3)
+        return;
+
+    stats->cpu_time = (utime + stime) * 1000 / stats_ticks;
+    stats->rss = (uint64_t) rss * stats_pagesize;
+}
+
+// /proc/<pid>/io: storage read_bytes and write_bytes
+static void stats_read_io(int pid, tty_stats *stats) {
+    char filename[64], buffer[1024];
+    char *ptr;
+
+    sprintf(filename, "/proc/%d/io", pid);
+    if(stats_read_file(filename, buffer, sizeof(buffer)))
+        return;
+
+    if((ptr = strstr(buffer, "\nread_bytes: ")))
+        stats->io_read = strtoull(ptr + 13, NULL, 10);
+
+    if((ptr = strstr(buffer, "\nwrite_bytes: ")))
+        stats->io_write = strtoull(ptr + 14, NULL, 10);
+}
+
+static double stats_elapsed(struct timespec *from, struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static void stats_sample(stats_target *target, struct timespec *now) {
+    struct tty_process *process = target->process;
+    tty_stats sample;
+
+    pthread_mutex_lock(&process->mutex);
+    tty_stats previous = process->stats;
+    int running = process->running;
+    int pid = process->pid;
+    pthread_mutex_unlock(&process->mutex);
+
+    memset(&sample, 0, sizeof(sample));
+    sample.output = __atomic_load_n(&process->output_bytes, __ATOMIC_RELAXED);
+
+    if(running) {
+        stats_read_stat(pid, &sample);
+        stats_read_io(pid, &sample);
+    }
+
+    cgroup_sample(target->cgroup, &sample);
+    sample.viewers = target->viewers;
+
+    double elapsed = stats_elapsed(&previous.sampled, now);
+
+    if(previous.sampled.tv_sec && elapsed > 0) {
+        // counters restart from zero when the process restarts
+        if(running && sample.cpu_time >= previous.cpu_time)
+            sample.cpu_rate = (sample.cpu_time - previous.cpu_time) / (elapsed * 10);
+
+        sample.output_rate = (sample.output - previous.output) / elapsed;
+    }
+
+    sample.sampled = *now;
+
+    pthread_mutex_lock(&process->mutex);
+    process->stats = sample;
+    pthread_mutex_unlock(&process->mutex);
+}
+
+static void *stats_collector(void *args) {
+    struct tty_process *process;
+    struct tty_client *client;
+    struct timespec now;
+
+    while(!force_exit) {
+        size_t count = 0;
+
+        sleep(STATS_INTERVAL);
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        server_lock(&server->mutex);
+
+        LIST_FOREACH(process, &server->processes, list)
+            count++;
+
+        stats_target *targets = xmalloc(sizeof(stats_target) * (count + 1));
+        count = 0;
+
+        LIST_FOREACH(process, &server->processes, list) {
+            stats_target *target = &targets[count++];
+
+            process_hold(process);
+            target->process = process;
+            target->cgroup = process->cgroup ? strdup(process->cgroup) : NULL;
+            target->viewers = 0;
+
+            LIST_FOREACH(client, &server->clients, list)
+                if(client->process == process)
+                    target->viewers++;
+        }
+
+        server_unlock(&server->mutex);
+
+        for(size_t i = 0; i < count; i++) {
+            stats_sample(&targets[i], &now);
+
+            free(targets[i].cgroup);
+            process_release(targets[i].process);
+        }
+
+        free(targets);
+
+        // invalidate cached listing including resources usage
+        __atomic_add_fetch(&server->stats_version, 1, __ATOMIC_SEQ_CST);
+    }
+
+    return NULL;
+}
+
+int stats_init() {
+    stats_ticks = sysconf(_SC_CLK_TCK);
+    stats_pagesize = sysconf(_SC_PAGESIZE);
+
+    if(pthread_create(&stats_thread, NULL, stats_collector, NULL)) {
+        warnp("stats: pthread_create");
+        return 1;
+    }
+
+    pthread_detach(stats_thread);
+
+    return 0;
+}
+
+// process mutex must be held
+struct json_object *stats_json(tty_stats *stats) {
+    struct json_object *root = json_object_new_object();
+
+    json_object_object_add(root, "rss", json_object_new_int64(stats->rss));
+    json_object_object_add(root, "cpu_time", json_object_new_int64(stats->cpu_time));
+    json_object_object_add(root, "cpu_rate", json_object_new_double(stats->cpu_rate));
+    json_object_object_add(root, "io_read", json_object_new_int64(stats->io_read));
+    json_object_object_add(root, "io_write", json_object_new_int64(stats->io_write));
+    json_object_object_add(root, "output", json_object_new_int64(stats->output));
+    json_object_object_add(root, "output_rate", json_object_new_double(stats->output_rate));
+    json_object_object_add(root, "viewers", json_object_new_int(stats->viewers));
+
+    if(stats->cgroup) {
+        json_object_object_add(root, "cgroup_memory", json_object_new_int64(stats->cgroup_memory));
+        json_object_object_add(root, "cgroup_pids", json_object_new_int64(stats->cgroup_pids));
+    }
+
+    return root;
+}
@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <libwebsockets.h>
+#include <openssl/ssl.h>
+#include <json.h>
+
+#include "server.h"
+#include "utils.h"
+
+//
+// tls sessions
+//
+// browsers reconnect all at once (server restart, network change),
+// each reconnection was a full handshake, sessions are now cached and
+// tickets issued so returning clients resume with an abbreviated one,
+// handshakes are counted per second to follow reconnection storms
+//
+// with kernel tls, records of established connections are encrypted
+// by the kernel, the service threads only copy plain text
+//
+#define TLS_SESSION_CACHE 20480        // sessions kept for id resumption
+#define TLS_SESSION_TIMEOUT 7200       // sessions (and tickets) lifetime in seconds
+#define TLS_WINDOW 64                  // seconds of handshakes history
+
+typedef struct tls_second {
+    time_t second;
+    uint32_t full;
+    uint32_t resumed;
+
+} tls_second;
+
+static SSL_CTX *tls_context;
+static bool tls_ktls;
+static int tls_counted = -1;           // ssl ex data index, handshake counted
+static pthread_mutex_t tls_lock = PTHREAD_MUTEX_INITIALIZER;
+static tls_second tls_window[TLS_WINDOW];
+
+// counters (tls lock)
+static uint64_t tls_full;
+static uint64_t tls_resumed;
+static uint64_t tls_ktls_send;
+static uint64_t tls_ktls_recv;
+
+static void tls_info(const SSL *ssl, int where, int ret) {
+    if(!(where & SSL_CB_HANDSHAKE_DONE))
+        return;
+
+    // tls 1.3 post handshake messages (tickets, key updates) are
+    // reported as handshakes too
+    if(SSL_get_ex_data(ssl, tls_counted))
+        return;
+
+    SSL_set_ex_data((SSL *) ssl, tls_counted, (void *) 1);
+
+    bool resumed = SSL_session_reused((SSL *) ssl);
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&tls_lock);
+
+    tls_second *second = &tls_window[now % TLS_WINDOW];
+    if(second->second != now) {
+        second->second = now;
+        second->full = second->resumed = 0;
+    }
+
+    if(resumed) {
+        second->resumed++;
+        tls_resumed++;
+
+    } else {
+        second->full++;
+        tls_full++;
+    }
+
+#ifdef BIO_get_ktls_send
+    // offload is set up by openssl once keys are known
+    if(BIO_get_ktls_send(SSL_get_wbio(ssl)))
+        tls_ktls_send++;
+
+    if(BIO_get_ktls_recv(SSL_get_rbio(ssl)))
+        tls_ktls_recv++;
+#endif
+
+    pthread_mutex_unlock(&tls_lock);
+}
+
+void tls_init(bool ktls) {
+    tls_ktls = ktls;
+    tls_counted = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+
+#ifndef SSL_OP_ENABLE_KTLS
+    if(ktls)
+        fprintf(stderr, "[-] tls: kernel tls not supported by this openssl\n");
+#endif
+}
+
+// server context created by libwebsockets, called once per vhost
+void tls_context_setup(struct ssl_ctx_st *ctx) {
+    static const unsigned char id[] = "tfmux";
+
+    tls_context = ctx;
+
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, TLS_SESSION_CACHE);
+    SSL_CTX_set_timeout(ctx, TLS_SESSION_TIMEOUT);
+
+    // needed to resume sessions verified with a client certificate
+    SSL_CTX_set_session_id_context(ctx, id, sizeof(id) - 1);
+
+    // stateless resumption, ticket keys are rotated by openssl
+    SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+    SSL_CTX_set_num_tickets(ctx, 1);
+#endif
+
+#ifdef SSL_OP_ENABLE_KTLS
+    if(tls_ktls)
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
+    SSL_CTX_set_info_callback(ctx, tls_info);
+
+    verbose("[+] tls: session cache %d, tickets enabled, kernel tls: %s\n", TLS_SESSION_CACHE, tls_ktls ? "requested" : "off");
+}
+
+// handshakes per second over the last seconds, tls lock held
+static double tls_rate(time_t now, int seconds, bool resumed) {
+    uint64_t count = 0;
+
+    for(int i = 1; i <= seconds; i++) {
+        tls_second *second = &tls_window[(now - i) % TLS_WINDOW];
+
+        if(second->second == now - i)
+            count += resumed ? second->resumed : second->full;
+    }
+
+    return (double) count / seconds;
+}
+
+struct json_object *tls_json() {
+    struct json_object *root = json_object_new_object();
+
+    json_object_object_add(root, "enabled", json_object_new_boolean(tls_context != NULL));
+
+    if(!tls_context)
+        return root;
+
+    struct json_object *handshakes = json_object_new_object();
+    struct json_object *rate = json_object_new_object();
+    struct json_object *cache = json_object_new_object();
+    struct json_object *ktls = json_object_new_object();
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&tls_lock);
+
+    json_object_object_add(handshakes, "full", json_object_new_int64(tls_full));
+    json_object_object_add(handshakes, "resumed", json_object_new_int64(tls_resumed));
+
+    json_object_object_add(rate, "full_10s", json_object_new_double(tls_rate(now, 10, false)));
+    json_object_object_add(rate, "resumed_10s", json_object_new_double(tls_rate(now, 10, true)));
+    json_object_object_add(rate, "full_60s", json_object_new_double(tls_rate(now, 60, false)));
+    json_object_object_add(rate, "resumed_60s", json_object_new_double(tls_rate(now, 60, true)));
+
+    json_object_object_add(ktls, "requested", json_object_new_boolean(tls_ktls));
+    json_object_object_add(ktls, "send", json_object_new_int64(tls_ktls_send));
+    json_object_object_add(ktls, "recv", json_object_new_int64(tls_ktls_recv));
+
+    pthread_mutex_unlock(&tls_lock);
+
+    // openssl own session cache statistics
+    json_object_object_add(cache, "sessions", json_object_new_int64(SSL_CTX_sess_number(tls_context)));
+    json_object_object_add(cache, "hits", json_object_new_int64(SSL_CTX_sess_hits(tls_context)));
+    json_object_object_add(cache, "misses", json_object_new_int64(SSL_CTX_sess_misses(tls_context)));
+    json_object_object_add(cache, "timeouts", json_object_new_int64(SSL_CTX_sess_timeouts(tls_context)));
+    json_object_object_add(cache, "full", json_object_new_int64(SSL_CTX_sess_cache_full(tls_context)));
+
+    json_object_object_add(root, "accepted", json_object_new_int64(SSL_CTX_sess_accept_good(tls_context)));
+    json_object_object_add(root, "handshakes", handshakes);
+    json_object_object_add(root, "rate", rate);
+    json_object_object_add(root, "cache", cache);
+    json_object_object_add(root, "ktls", ktls);
+
+    return root;
+}
@@ -0,0 +1,477 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+
+#include <libwebsockets.h>
+
+#include "server.h"
+#include "probes.h"
+#include "utils.h"
+
+#define UPGRADE_MAGIC "TFMUXUP5"
+#define UPGRADE_NULL  0xffffffff
+#define UPGRADE_QUIESCE 2          // seconds for pending pty i/o to land
+
+//
+// hot restart
+//
+// on SIGUSR2 the daemon stops serving, writes processes state and
+// scrollback into a memfd and exec its binary again in place, pty
+// masters and the memfd are inherited, children stay our children and
+// are adopted by the new instance which keeps reaping them
+//
+static char upgrade_binary[PATH_MAX];
+static char **upgrade_argv = NULL;
+static int upgrade_argc = 0;
+
+// keeping the original command line, getopt permutes argv
+void upgrade_init(int argc, char **argv) {
+    ssize_t len;
+
+    upgrade_argv = xmalloc(sizeof(char *) * (argc + 1));
+    memcpy(upgrade_argv, argv, sizeof(char *) * argc);
+    upgrade_argv[argc] = NULL;
+    upgrade_argc = argc;
+
+    // binary path is resolved now, once replaced on disk
+    // /proc/self/exe points to the old (deleted) one
+    if((len = readlink("/proc/self/exe", upgrade_binary, sizeof(upgrade_binary) - 1)) < 0) {
+        warnp("upgrade: readlink");
+        snprintf(upgrade_binary, sizeof(upgrade_binary), "%s", argv[0]);
+        return;
+    }
+
+    upgrade_binary[len] = '\0';
+}
+
+//
+// state serialization
+//
+static void upgrade_put(FILE *fp, const void *data, size_t length) {
+    if(fwrite(data, length, 1, fp) != 1)
+        warnp("upgrade: fwrite");
+}
+
+static void upgrade_put_u32(FILE *fp, uint32_t value) {
+    upgrade_put(fp, &value, sizeof(value));
+}
+
+static void upgrade_put_u64(FILE *fp, uint64_t value) {
+    upgrade_put(fp, &value, sizeof(value));
+}
+
+static void upgrade_put_string(FILE *fp, const char *str) {
+    if(str == NULL) {
+        upgrade_put_u32(fp, UPGRADE_NULL);
+        return;
+    }
+
+    uint32_t length = strlen(str);
+
+    upgrade_put_u32(fp, length);
+    upgrade_put(fp, str, length);
+}
+
+static void upgrade_put_strv(FILE *fp, char **strv) {
+    uint32_t count = 0;
+
+    if(strv == NULL) {
+        upgrade_put_u32(fp, UPGRADE_NULL);
+        return;
+    }
+
+    while(strv[count])
+        count++;
+
+    upgrade_put_u32(fp, count);
+    for(uint32_t i = 0; i < count; i++)
+        upgrade_put_string(fp, strv[i]);
+}
+
+static int upgrade_get(FILE *fp, void *data, size_t length) {
+    return (fread(data, length, 1, fp) == 1) ? 0 : -1;
+}
+
+static int upgrade_get_u32(FILE *fp, uint32_t *value) {
+    return upgrade_get(fp, value, sizeof(uint32_t));
+}
+
+static int upgrade_get_u64(FILE *fp, uint64_t *value) {
+    return upgrade_get(fp, value, sizeof(uint64_t));
+}
+
+// null values are not distinguished from errors, the
+// caller knows when a value is expected to be set
+static char *upgrade_get_string(FILE *fp) {
+    uint32_t length;
+
+    if(upgrade_get_u32(fp, &length) || length == UPGRADE_NULL)
+        return NULL;
+
+    char *str = xmalloc(length + 1);
+
+    if(upgrade_get(fp, str, length)) {
+        free(str);
+        return NULL;
+    }
+
+    str[length] = '\0';
+    return str;
+}
+
+static int upgrade_get_strv(FILE *fp, char ***strv) {
+    uint32_t count;
+
+    *strv = NULL;
+
+    if(upgrade_get_u32(fp, &count))
+        return -1;
+
+    if(count == UPGRADE_NULL)
+        return 0;
+
+    *strv = xmalloc(sizeof(char *) * (count + 1));
+    memset(*strv, 0, sizeof(char *) * (count + 1));
+
+    for(uint32_t i = 0; i < count; i++) {
+        if(!((*strv)[i] = upgrade_get_string(fp))) {
+            strv_free(*strv);
+            *strv = NULL;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// process mutex must be held
+static void upgrade_save_process(FILE *fp, struct tty_process *process) {
+    tty_process_options *options = &process->options;
+    tty_restart *restart = &process->restart;
+    uint32_t argc = 0;
+
+    upgrade_put_u64(fp, process->id);
+    upgrade_put_u32(fp, process->pid);
+    upgrade_put_u32(fp, process->pty);
+    upgrade_put_u32(fp, process->state);
+    upgrade_put_u32(fp, process->running);
+    upgrade_put_u32(fp, process->wstatus);
+    upgrade_put(fp, &process->size, sizeof(struct winsize));
+
+    upgrade_put_u32(fp, options->restart);
+    upgrade_put_u32(fp, options->max_restarts);
+    upgrade_put_u32(fp, options->restart_window);
+    upgrade_put_u32(fp, options->limits.cpu_weight);
+    upgrade_put_u64(fp, options->limits.memory_max);
+    upgrade_put_u32(fp, options->limits.pids_max);
+    upgrade_put_u32(fp, options->limits.io_weight);
+    upgrade_put_u64(fp, options->scrollback);
+    upgrade_put_u32(fp, options->weight);
+    upgrade_put_string(fp, options->name);
+    upgrade_put_string(fp, options->cwd);
+    upgrade_put_strv(fp, options->env);
+    upgrade_put_strv(fp, options->depends);
+    upgrade_put_string(fp, options->record);
+
+    upgrade_put_u32(fp, restart->restarts);
+    upgrade_put_u32(fp, restart->attempt);
+    upgrade_put_u32(fp, restart->window_count);
+    upgrade_put_u64(fp, restart->window_start);
+    upgrade_put_u64(fp, restart->started);
+    upgrade_put_u32(fp, restart->exhausted);
+
+    while(process->argv[argc])
+        argc++;
+
+    upgrade_put_u32(fp, argc);
+    for(uint32_t i = 0; i < argc; i++)
+        upgrade_put_string(fp, process->argv[i]);
+
+    // scrollback, absolute offsets are kept
+    buffer_t *logs = circular_get(process->logs, 0);
+
+    upgrade_put_u64(fp, circular_first(process->logs));
+    upgrade_put_u64(fp, logs->length);
+    upgrade_put(fp, logs->buffer, logs->length);
+
+    buffer_free(logs);
+}
+
+static struct tty_process *upgrade_load_process(FILE *fp) {
+    struct tty_process *process;
+    tty_process_options options;
+    uint32_t pid, pty, state, running, wstatus, argc;
+    uint32_t policy, max_restarts, restart_window;
+    uint32_t cpu_weight, pids_max, io_weight, weight;
+    uint32_t restarts, attempt, window_count, exhausted;
+    uint64_t id, memory_max, scrollback, window_start, started, first, length;
+    struct winsize size;
+    char **argv;
+
+    memset(&options, 0, sizeof(options));
+
+    if(upgrade_get_u64(fp, &id) || upgrade_get_u32(fp, &pid) || upgrade_get_u32(fp, &pty) ||
+       upgrade_get_u32(fp, &state) || upgrade_get_u32(fp, &running) || upgrade_get_u32(fp, &wstatus) ||
+       upgrade_get(fp, &size, sizeof(struct winsize)))
+        return NULL;
+
+    if(upgrade_get_u32(fp, &policy) || upgrade_get_u32(fp, &max_restarts) || upgrade_get_u32(fp, &restart_window) ||
+       upgrade_get_u32(fp, &cpu_weight) || upgrade_get_u64(fp, &memory_max) ||
+       upgrade_get_u32(fp, &pids_max) || upgrade_get_u32(fp, &io_weight) || upgrade_get_u64(fp, &scrollback) ||
+       upgrade_get_u32(fp, &weight))
+        return NULL;
+
+    options.name = upgrade_get_string(fp);
+    options.cwd = upgrade_get_string(fp);
+
+    if(upgrade_get_strv(fp, &options.env) || upgrade_get_strv(fp, &options.depends))
+        goto failed_options;
+
+    options.record = upgrade_get_string(fp);
+
+    if(upgrade_get_u32(fp, &restarts) || upgrade_get_u32(fp, &attempt) || upgrade_get_u32(fp, &window_count) ||
+       upgrade_get_u64(fp, &window_start) || upgrade_get_u64(fp, &started) || upgrade_get_u32(fp, &exhausted))
+        goto failed_options;
+
+    if(upgrade_get_u32(fp, &argc))
+        goto failed_options;
+
+    argv = xmalloc(sizeof(char *) * (argc + 1));
+    memset(argv, 0, sizeof(char *) * (argc + 1));
+
+    for(uint32_t i = 0; i < argc; i++)
+        if(!(argv[i] = upgrade_get_string(fp)))
+            goto failed;
+
+    options.restart = policy;
+    options.max_restarts = max_restarts;
+    options.restart_window = restart_window;
+    options.limits.cpu_weight = cpu_weight;
+    options.limits.memory_max = memory_max;
+    options.limits.pids_max = pids_max;
+    options.limits.io_weight = io_weight;
+    options.scrollback = scrollback;
+    options.weight = weight;
+
+    if(!(process = process_new(server, argc, argv, &options)))
+        goto failed;
+
+    process->id = id;
+    process->pid = pid;
+    process->pty = pty;
+    process->state = state;
+    process->running = running;
+    process->wstatus = wstatus;
+    process->size = size;
+
+    process->restart.restarts = restarts;
+    process->restart.attempt = attempt;
+    process->restart.window_count = window_count;
+    process->restart.window_start = window_start;
+    process->restart.started = started;
+    process->restart.exhausted = exhausted;
+
+    if(upgrade_get_u64(fp, &first) || upgrade_get_u64(fp, &length))
+        goto failed;
+
+    uint8_t *data = xmalloc(length ? length : 1);
+
+    if(length && upgrade_get(fp, data, length)) {
+        free(data);
+        goto failed;
+    }
+
+    // restoring absolute offset before appending the content
+    process->logs->written = first;
+    circular_append(process->logs, data, length);
+    free(data);
+
+    for(uint32_t i = 0; i < argc; i++)
+        free(argv[i]);
+
+    free(argv);
+    tty_process_options_free(&options);
+
+    return process;
+
+failed:
+    for(uint32_t i = 0; i < argc; i++)
+        free(argv[i]);
+
+    free(argv);
+
+failed_options:
+    tty_process_options_free(&options);
+
+    return NULL;
+}
+
+// serialize the state and exec the binary again, only returns on failure
+int upgrade_exec() {
+    struct tty_process *process;
+    uint32_t count = 0;
+    char resume[32];
+    int fd;
+
+    if((fd = memfd_create("tfmux-state", 0)) < 0) {
+        warnp("upgrade: memfd_create");
+        return 1;
+    }
+
+    FILE *fp = fdopen(dup(fd), "w");
+    if(fp == NULL) {
+        warnp("upgrade: fdopen");
+        close(fd);
+        return 1;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += UPGRADE_QUIESCE;
+
+    // exited children are left unreaped, the new instance
+    // adopts them and collects their exit status itself
+    reaper_suspend();
+
+    server_lock(&server->mutex);
+
+    LIST_FOREACH(process, &server->processes, list) {
+        // pending io_uring requests need to land before the snapshot,
+        // a read landing later is lost, the process is still handed over
+        uring_quiesce(process, &deadline);
+        count++;
+    }
+
+    upgrade_put(fp, UPGRADE_MAGIC, strlen(UPGRADE_MAGIC));
+    upgrade_put_u64(fp, server->next_id);
+    upgrade_put_u64(fp, server->version);
+    upgrade_put_u64(fp, events_last());
+    upgrade_put_u32(fp, count);
+
+    // process mutex are kept locked until exec, no more
+    // pty output can be consumed in the meantime
+    LIST_FOREACH(process, &server->processes, list) {
+        pthread_mutex_lock(&process->mutex);
+        upgrade_save_process(fp, process);
+
+        // pty master needs to survive exec
+        if(process->pty >= 0 && fcntl(process->pty, F_SETFD, 0) < 0)
+            warnp("upgrade: fcntl");
+    }
+
+    if(fclose(fp) != 0) {
+        warnp("upgrade: fclose");
+        goto failed;
+    }
+
+    lseek(fd, 0, SEEK_SET);
+
+    // building command line, resume argument goes first since
+    // options parsing stops on the command, if any
+    char **argv = xmalloc(sizeof(char *) * (upgrade_argc + 3));
+    int argc = 0;
+
+    snprintf(resume, sizeof(resume), "%d", fd);
+    argv[argc++] = upgrade_argv[0];
+    argv[argc++] = "--resume-fd";
+    argv[argc++] = resume;
+
+    for(int i = 1; i < upgrade_argc; i++) {
+        // dropping a previous resume argument
+        if(strcmp(upgrade_argv[i], "--resume-fd") == 0) {
+            i++;
+            continue;
+        }
+
+        argv[argc++] = upgrade_argv[i];
+    }
+
+    argv[argc] = NULL;
+
+    verbose("[+] upgrade: %u processes handed over, executing %s\n", count, upgrade_binary);
+    fflush(stdout);
+
+    execv(upgrade_binary, argv);
+    warnp("upgrade: execv");
+    free(argv);
+
+failed:
+    // processes are kept in their current state
+    LIST_FOREACH(process, &server->processes, list)
+        pthread_mutex_unlock(&process->mutex);
+
+    server_unlock(&server->mutex);
+    reaper_resume();
+
+    close(fd);
+
+    return 1;
+}
+
+// adopt processes handed over by the previous instance
+int upgrade_resume(int fd) {
+    struct tty_process **processes = NULL;
+    char magic[sizeof(UPGRADE_MAGIC)];
+    uint64_t next_id, version, seq;
+    uint32_t count = 0, loaded = 0;
+    FILE *fp;
+
+    if((fp = fdopen(fd, "r")) == NULL) {
+        warnp("upgrade: fdopen");
+        return 1;
+    }
+
+    if(upgrade_get(fp, magic, strlen(UPGRADE_MAGIC)) || memcmp(magic, UPGRADE_MAGIC, strlen(UPGRADE_MAGIC))) {
+        fprintf(stderr, "[-] upgrade: invalid state received\n");
+        fclose(fp);
+        return 1;
+    }
+
+    if(upgrade_get_u64(fp, &next_id) || upgrade_get_u64(fp, &version) || upgrade_get_u64(fp, &seq) ||
+       upgrade_get_u32(fp, &count)) {
+        fprintf(stderr, "[-] upgrade: truncated state received\n");
+        fclose(fp);
+        return 1;
+    }
+
+    server->next_id = next_id;
+    server->version = version;
+
+    // events cursors held by consumers stay meaningful
+    events_resume(seq);
+
+    processes = xmalloc(sizeof(struct tty_process *) * (count + 1));
+
+    for(loaded = 0; loaded < count; loaded++) {
+        if(!(processes[loaded] = upgrade_load_process(fp))) {
+            fprintf(stderr, "[-] upgrade: could not load process %u\n", loaded);
+            break;
+        }
+
+        // not inherited by future children
+        if(processes[loaded]->pty >= 0)
+            fcntl(processes[loaded]->pty, F_SETFD, FD_CLOEXEC);
+    }
+
+    fclose(fp);
+
+    verbose("[+] upgrade: %u processes adopted\n", loaded);
+
+    // processes were serialized from the list head,
+    // launching in reverse keeps the same ordering
+    while(loaded > 0)
+        process_launch(server, processes[--loaded]);
+
+    free(processes);
+
+    return 0;
+}
@@ -0,0 +1,431 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/queue.h>
+#include <sys/uio.h>
+
+#include <libwebsockets.h>
+
+#include "server.h"
+#include "probes.h"
+#include "utils.h"
+
+void uring_process_init(struct tty_process *process) {
+    uring_state *state = &process->uring;
+
+    memset(state, 0, sizeof(uring_state));
+    STAILQ_INIT(&state->writes);
+    pthread_mutex_init(&state->mutex, NULL);
+    pthread_cond_init(&state->drained, NULL);
+
+    state->read.op = URING_READ;
+    state->read.process = process;
+}
+
+#ifdef WITH_IO_URING
+#include <liburing.h>
+
+#define URING_ENTRIES 256
+
+//
+// io_uring i/o engine
+//
+// one thread and one ring handle every process pty: reads target the
+// free segment of the process logs directly and are all resubmitted
+// with a single submission per completion batch, input writes are
+// queued per process to keep keystrokes ordered
+//
+// locking order: process uring state, then ring submission lock,
+// then process mutex (logs)
+//
+static struct io_uring uring;
+static pthread_mutex_t uring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t uring_thread;
+
+// ring submission lock must be held
+static struct io_uring_sqe *uring_sqe() {
+    struct io_uring_sqe *sqe;
+
+    // submission queue full, flushing it
+    while(!(sqe = io_uring_get_sqe(&uring)))
+        io_uring_submit(&uring);
+
+    return sqe;
+}
+
+// process uring state mutex must be held
+static void uring_submit_read(uring_state *state) {
+    struct tty_process *process = state->read.process;
+
+    pthread_mutex_lock(&process->mutex);
+    int count = circular_reserve(process->logs, state->iov, BUF_SIZE);
+    pthread_mutex_unlock(&process->mutex);
+
+    pthread_mutex_lock(&uring_lock);
+
+    struct io_uring_sqe *sqe = uring_sqe();
+    io_uring_prep_readv(sqe, process->pty, state->iov, count, 0);
+    io_uring_sqe_set_data(sqe, &state->read);
+
+    pthread_mutex_unlock(&uring_lock);
+
+    state->inflight++;
+}
+
+// process uring state mutex must be held
+static void uring_submit_write(uring_state *state, uring_request *request) {
+    pthread_mutex_lock(&uring_lock);
+
+    struct io_uring_sqe *sqe = uring_sqe();
+    io_uring_prep_write(sqe, request->process->pty, request->data + request->done, request->length - request->done, 0);
+    io_uring_sqe_set_data(sqe, request);
+
+    pthread_mutex_unlock(&uring_lock);
+
+    state->inflight++;
+}
+
+// process uring state mutex must be held
+static void uring_submit_cancel(uring_request *target) {
+    uring_request *request = xmalloc(sizeof(uring_request));
+
+    memset(request, 0, sizeof(uring_request));
+    request->op = URING_CANCEL;
+
+    pthread_mutex_lock(&uring_lock);
+
+    struct io_uring_sqe *sqe = uring_sqe();
+    io_uring_prep_cancel(sqe, target, 0);
+    io_uring_sqe_set_data(sqe, request);
+
+    pthread_mutex_unlock(&uring_lock);
+}
+
+static void uring_complete_read(uring_state *state, int res) {
+    struct tty_process *process = state->read.process;
+    size_t length = 0;
+
+    pthread_mutex_lock(&state->mutex);
+
+    if(--state->inflight == 0)
+        pthread_cond_broadcast(&state->drained);
+
+    PROBE2(pty__read, process->id, res);
+
+    pthread_mutex_lock(&process->mutex);
+    circular_commit(process->logs, res > 0 ? res : 0);
+    pthread_mutex_unlock(&process->mutex);
+
+    if(res > 0) {
+        length = res;
+
+    } else if(res != -EAGAIN && res != -EINTR) {
+        // pty closed (EIO) or cancelled
+        if(res < 0 && res != -EIO && res != -ECANCELED) {
+            errno = -res;
+            warnp("uring: read");
+        }
+
+        state->eof = true;
+    }
+
+    bool eof = state->eof;
+
+    if(!eof && !state->cancel)
+        uring_submit_read(state);
+
+    pthread_mutex_unlock(&state->mutex);
+
+    if(length)
+        process_output(process, length);
+
+    if(eof)
+        process_wakeup(process);
+}
+
+static void uring_complete_write(uring_request *request, int res) {
+    uring_state *state = &request->process->uring;
+
+    pthread_mutex_lock(&state->mutex);
+
+    if(--state->inflight == 0)
+        pthread_cond_broadcast(&state->drained);
+
+    if(res < 0 && res != -EAGAIN && res != -EINTR) {
+        if(res != -ECANCELED) {
+            errno = -res;
+            warnp("uring: write");
+        }
+
+        // dropping the input, pty is gone
+        request->done = request->length;
+    }
+
+    if(res > 0)
+        request->done += res;
+
+    // partial write, sending the remaining part
+    if(request->done < request->length && !state->cancel) {
+        uring_submit_write(state, request);
+        pthread_mutex_unlock(&state->mutex);
+        return;
+    }
+
+    STAILQ_REMOVE_HEAD(&state->writes, next);
+    free(request->data);
+    free(request);
+
+    bool cancel = state->cancel;
+
+    if(!STAILQ_EMPTY(&state->writes) && !cancel)
+        uring_submit_write(state, STAILQ_FIRST(&state->writes));
+
+    pthread_mutex_unlock(&state->mutex);
+
+    if(cancel)
+        process_wakeup(state->read.process);
+}
+
+static void *uring_run(void *args) {
+    struct io_uring_cqe *cqe;
+    unsigned head;
+
+    while(1) {
+        int ret = io_uring_wait_cqe(&uring, &cqe);
+
+        if(ret == -EINTR)
+            continue;
+
+        if(ret < 0) {
+            errno = -ret;
+            warnp("uring: wait_cqe");
+            break;
+        }
+
+        // handling every completion available, resubmitted
+        // reads are all flushed together at the end
+        unsigned count = 0;
+
+        io_uring_for_each_cqe(&uring, head, cqe) {
+            uring_request *request = io_uring_cqe_get_data(cqe);
+            count++;
+
+            switch(request->op) {
+                case URING_READ:
+                    uring_complete_read(&request->process->uring, cqe->res);
+                    break;
+
+                case URING_WRITE:
+                    uring_complete_write(request, cqe->res);
+                    break;
+
+                case URING_CANCEL:
+                    free(request);
+                    break;
+            }
+        }
+
+        io_uring_cq_advance(&uring, count);
+
+        pthread_mutex_lock(&uring_lock);
+        io_uring_submit(&uring);
+        pthread_mutex_unlock(&uring_lock);
+    }
+
+    return NULL;
+}
+
+int uring_init() {
+    int ret;
+
+    if((ret = io_uring_queue_init(URING_ENTRIES, &uring, 0)) < 0) {
+        errno = -ret;
+        warnp("uring: queue_init");
+        return 1;
+    }
+
+    if(pthread_create(&uring_thread, NULL, uring_run, NULL)) {
+        warnp("uring: pthread_create");
+        io_uring_queue_exit(&uring);
+        return 1;
+    }
+
+    pthread_detach(uring_thread);
+    verbose("[+] uring: pty i/o handled by io_uring\n");
+
+    return 0;
+}
+
+// hand the process pty over the engine and wait until the pty is closed
+// or the process stopped, nothing is in flight anymore when returning
+int uring_pump(struct tty_process *process) {
+    uring_state *state = &process->uring;
+    uint64_t value;
+
+    pthread_mutex_lock(&state->mutex);
+
+    state->active = true;
+    state->eof = false;
+    state->cancel = false;
+    uring_submit_read(state);
+
+    pthread_mutex_lock(&uring_lock);
+    io_uring_submit(&uring);
+    pthread_mutex_unlock(&uring_lock);
+
+    while(!state->eof && process->running) {
+        pthread_mutex_unlock(&state->mutex);
+
+        // woken up by the reaper, stop request or the engine
+        if(read(process->wakeup, &value, sizeof(value)) < 0 && errno != EINTR)
+            warnp("uring: wakeup");
+
+        pthread_mutex_lock(&state->mutex);
+    }
+
+    // cancelling everything still in flight, remaining
+    // output is drained by the caller
+    state->cancel = true;
+
+    if(!state->eof)
+        uring_submit_cancel(&state->read);
+
+    if(!STAILQ_EMPTY(&state->writes))
+        uring_submit_cancel(STAILQ_FIRST(&state->writes));
+
+    pthread_mutex_lock(&uring_lock);
+    io_uring_submit(&uring);
+    pthread_mutex_unlock(&uring_lock);
+
+    while(state->inflight > 0) {
+        pthread_mutex_unlock(&state->mutex);
+
+        if(read(process->wakeup, &value, sizeof(value)) < 0 && errno != EINTR)
+            warnp("uring: wakeup");
+
+        pthread_mutex_lock(&state->mutex);
+    }
+
+    // input never written, pty is going away
+    while(!STAILQ_EMPTY(&state->writes)) {
+        uring_request *request = STAILQ_FIRST(&state->writes);
+        STAILQ_REMOVE_HEAD(&state->writes, next);
+        free(request->data);
+        free(request);
+    }
+
+    state->active = false;
+    pthread_mutex_unlock(&state->mutex);
+
+    return 0;
+}
+
+// queue input for the process pty, writes are kept in order
+int uring_write(struct tty_process *process, char *data, size_t length) {
+    uring_state *state = &process->uring;
+
+    PROBE2(input__write, process->id, length);
+    record_input(process, data, length);
+
+    pthread_mutex_lock(&state->mutex);
+
+    if(!state->active || state->cancel) {
+        pthread_mutex_unlock(&state->mutex);
+        return write(process->pty, data, length);
+    }
+
+    uring_request *request = xmalloc(sizeof(uring_request));
+    memset(request, 0, sizeof(uring_request));
+
+    request->op = URING_WRITE;
+    request->process = process;
+    request->data = xmalloc(length);
+    request->length = length;
+    memcpy(request->data, data, length);
+
+    // only the head of the queue is in flight
+    int idle = STAILQ_EMPTY(&state->writes);
+    STAILQ_INSERT_TAIL(&state->writes, request, next);
+
+    if(idle) {
+        uring_submit_write(state, request);
+
+        pthread_mutex_lock(&uring_lock);
+        io_uring_submit(&uring);
+        pthread_mutex_unlock(&uring_lock);
+    }
+
+    pthread_mutex_unlock(&state->mutex);
+
+    return length;
+}
+
+// stop reading the process pty and wait for the in-flight requests to
+// land, used before handing the pty over (hot restart), returns non-zero
+// if requests are still in flight at the deadline
+int uring_quiesce(struct tty_process *process, struct timespec *deadline) {
+    uring_state *state = &process->uring;
+    int value = 0;
+
+    pthread_mutex_lock(&state->mutex);
+
+    if(!state->active) {
+        pthread_mutex_unlock(&state->mutex);
+        return 0;
+    }
+
+    if(!state->cancel) {
+        state->cancel = true;
+
+        if(!state->eof)
+            uring_submit_cancel(&state->read);
+
+        if(!STAILQ_EMPTY(&state->writes))
+            uring_submit_cancel(STAILQ_FIRST(&state->writes));
+
+        pthread_mutex_lock(&uring_lock);
+        io_uring_submit(&uring);
+        pthread_mutex_unlock(&uring_lock);
+    }
+
+    // signaled by the engine on the last completion
+    while(state->inflight > 0 && !value)
+        value = (pthread_cond_timedwait(&state->drained, &state->mutex, deadline) == ETIMEDOUT);
+
+    if(state->inflight > 0) {
+        fprintf(stderr, "[-] uring: process %lu: %d requests still in flight\n", process->id, state->inflight);
+        value = 1;
+    }
+
+    pthread_mutex_unlock(&state->mutex);
+
+    return value;
+}
+
+#else
+
+int uring_init() {
+    fprintf(stderr, "[-] uring: tfmux is not compiled with io_uring support\n");
+    return 1;
+}
+
+int uring_pump(struct tty_process *process) {
+    return 1;
+}
+
+int uring_write(struct tty_process *process, char *data, size_t length) {
+    PROBE2(input__write, process->id, length);
+    record_input(process, data, length);
+    return write(process->pty, data, length);
+}
+
+int uring_quiesce(struct tty_process *process, struct timespec *deadline) {
+    return 0;
+}
+
+#endif
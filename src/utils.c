@@ -1,8 +1,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <ctype.h>
 #include <string.h>
+#include <errno.h>
 #include <signal.h>
 
 // https://github.com/karelzak/util-linux/blob/master/misc-utils/kill.c
@@ -60,6 +62,92 @@ int get_sig(const char *sig_name) {
     return atoi(sig_name);
 }
 
+int parse_size(const char *str, uint64_t *size) {
+    char *end;
+    uint64_t multiplier = 1;
+
+    // strtoull silently negates a leading minus
+    while(isspace(*str))
+        str++;
+
+    if(!isdigit(*str))
+        return 1;
+
+    errno = 0;
+    unsigned long long value = strtoull(str, &end, 10);
+
+    if(errno == ERANGE)
+        return 1;
+
+    switch(toupper(*end)) {
+        case 'G':
+            multiplier *= 1024;
+            /* fallthrough */
+        case 'M':
+            multiplier *= 1024;
+            /* fallthrough */
+        case 'K':
+            multiplier *= 1024;
+            end++;
+            /* fallthrough */
+        case '\0':
+            break;
+        default:
+            return 1;
+    }
+
+    if(*end != '\0')
+        return 1;
+
+    if(value > UINT64_MAX / multiplier)
+        return 1;
+
+    *size = value * multiplier;
+    return 0;
+}
+
+char **strv_dup(char **strv) {
+    size_t count = 0;
+
+    if(strv == NULL)
+        return NULL;
+
+    while(strv[count])
+        count++;
+
+    char **target = xmalloc(sizeof(char *) * (count + 1));
+
+    for(size_t i = 0; i < count; i++)
+        target[i] = strdup(strv[i]);
+
+    target[count] = NULL;
+
+    return target;
+}
+
+void strv_free(char **strv) {
+    if(strv == NULL)
+        return;
+
+    for(size_t i = 0; strv[i]; i++)
+        free(strv[i]);
+
+    free(strv);
+}
+
+bool strv_equal(char **a, char **b) {
+    size_t i = 0;
+
+    if(a == NULL || b == NULL)
+        return (a == NULL || *a == NULL) && (b == NULL || *b == NULL);
+
+    for(i = 0; a[i] && b[i]; i++)
+        if(strcmp(a[i], b[i]))
+            return false;
+
+    return a[i] == NULL && b[i] == NULL;
+}
+
 // https://github.com/darkk/redsocks/blob/master/base64.c
 char *base64_encode(const unsigned char *buffer, size_t length) {
     static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
@@ -25,6 +25,22 @@ get_sig_name(int sig, char *buf, size_t len);
 int
 get_sig(const char *sig_name);
 
+// Parse a size with optional K, M or G suffix
+int
+parse_size(const char *str, uint64_t *size);
+
+// Duplicate a NULL terminated strings array (NULL stays NULL)
+char **
+strv_dup(char **strv);
+
+// Free a NULL terminated strings array
+void
+strv_free(char **strv);
+
+// Compare two NULL terminated strings array, NULL is an empty array
+bool
+strv_equal(char **a, char **b);
+
 // Encode text to base64, the caller should free the returned string
 char *
 base64_encode(const unsigned char *buffer, size_t length);
@@ -0,0 +1,580 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <regex.h>
+#include <pthread.h>
+
+#include <libwebsockets.h>
+#include <json.h>
+
+#include "server.h"
+#include "utils.h"
+
+//
+// output watchers
+//
+// {"name": "ready", "patterns": ["listening on", "ready"], "regex": "panic: .*",
+//  "action": "notify|stop|restart", "once": true}
+//
+// literal patterns of every rule of a process are compiled into one
+// aho-corasick automaton, stored as a full transition table over byte
+// classes (bytes not used by any pattern share a single class), the
+// pty output is then fed once, byte per byte, whatever the amount of
+// patterns, and the automaton state is kept across chunks
+//
+// regex are matched against complete lines, the current line being
+// kept across chunks (truncated to WATCH_LINE bytes)
+//
+#define WATCH_CHUNK 8192
+#define WATCH_LINE 4096
+#define WATCH_STATES_MAX 65536
+#define WATCH_RULES_MAX 256
+
+// ordered by strength, stop wins over restart
+typedef enum watch_action {
+    WATCH_NOTIFY,
+    WATCH_RESTART,
+    WATCH_STOP,
+
+} watch_action;
+
+typedef struct watch_rule {
+    size_t id;
+    char *name;                    // name reported in events
+    char **patterns;               // literals, NULL terminated
+    char *expression;              // regex source, if any
+    regex_t regex;
+    watch_action action;
+    bool once;                     // disarmed after first match
+    bool armed;
+    uint64_t matches;
+
+} watch_rule;
+
+struct tty_watch {
+    watch_rule *rules;
+    size_t count;
+    size_t next_id;
+    size_t regexes;                // rules with a regex
+
+    // automaton, patterns are indexed in rules order
+    uint8_t classes[256];          // byte to class
+    size_t nclasses;
+    uint32_t *delta;               // states x classes transitions
+    int32_t *first;                // first pattern ending on a state (-1: none)
+    int32_t *chain;                // next pattern ending on the same state
+    uint32_t *output;              // nearest state (self included) with patterns
+    uint32_t *dict;                // nearest proper suffix state with patterns
+    size_t *owner;                 // pattern to rule index
+    char **literal;                // pattern to string
+    uint32_t state;
+
+    uint64_t offset;               // next logs byte to scan
+    char line[WATCH_LINE];         // current line, for regex
+    size_t line_length;
+
+    pthread_mutex_t mutex;
+};
+
+static char *watch_action_name(watch_action action) {
+    switch(action) {
+        case WATCH_STOP:    return "stop";
+        case WATCH_RESTART: return "restart";
+        default:            return "notify";
+    }
+}
+
+static int watch_action_parse(const char *name, watch_action *action) {
+    if(strcmp(name, "notify") == 0)
+        *action = WATCH_NOTIFY;
+    else if(strcmp(name, "stop") == 0)
+        *action = WATCH_STOP;
+    else if(strcmp(name, "restart") == 0)
+        *action = WATCH_RESTART;
+    else
+        return 1;
+
+    return 0;
+}
+
+static void watch_rule_free(watch_rule *rule) {
+    free(rule->name);
+    strv_free(rule->patterns);
+
+    if(rule->expression) {
+        free(rule->expression);
+        regfree(&rule->regex);
+    }
+}
+
+static void watch_automaton_free(struct tty_watch *watch) {
+    free(watch->delta);
+    free(watch->first);
+    free(watch->chain);
+    free(watch->output);
+    free(watch->dict);
+    free(watch->owner);
+    free(watch->literal);
+
+    watch->delta = NULL;
+    watch->first = watch->chain = NULL;
+    watch->output = watch->dict = NULL;
+    watch->owner = NULL;
+    watch->literal = NULL;
+}
+
+// rebuild the automaton from the current rules, watch mutex held
+static int watch_compile(struct tty_watch *watch) {
+    size_t patterns = 0, states = 1;
+
+    watch_automaton_free(watch);
+    memset(watch->classes, 0, sizeof(watch->classes));
+    watch->nclasses = 1;
+    watch->state = 0;
+
+    for(size_t r = 0; r < watch->count; r++) {
+        for(char **p = watch->rules[r].patterns; p && *p; p++) {
+            for(unsigned char *c = (unsigned char *) *p; *c; c++)
+                if(!watch->classes[*c])
+                    watch->classes[*c] = watch->nclasses++;
+
+            states += strlen(*p);
+            patterns++;
+        }
+    }
+
+    if(patterns == 0)
+        return 0;
+
+    if(states > WATCH_STATES_MAX)
+        return 1;
+
+    size_t nclasses = watch->nclasses;
+
+    watch->delta = xmalloc(sizeof(uint32_t) * states * nclasses);
+    watch->first = xmalloc(sizeof(int32_t) * states);
+    watch->output = xmalloc(sizeof(uint32_t) * states);
+    watch->dict = xmalloc(sizeof(uint32_t) * states);
+    watch->chain = xmalloc(sizeof(int32_t) * patterns);
+    watch->owner = xmalloc(sizeof(size_t) * patterns);
+    watch->literal = xmalloc(sizeof(char *) * patterns);
+
+    uint32_t *fail = xmalloc(sizeof(uint32_t) * states);
+    uint32_t *queue = xmalloc(sizeof(uint32_t) * states);
+
+    memset(watch->delta, 0xff, sizeof(uint32_t) * states * nclasses);
+    memset(watch->first, 0xff, sizeof(int32_t) * states);
+
+    // trie
+    size_t count = 1, index = 0;
+
+    for(size_t r = 0; r < watch->count; r++) {
+        for(char **p = watch->rules[r].patterns; p && *p; p++) {
+            uint32_t state = 0;
+
+            for(unsigned char *c = (unsigned char *) *p; *c; c++) {
+                uint32_t *next = &watch->delta[state * nclasses + watch->classes[*c]];
+
+                if(*next == UINT32_MAX)
+                    *next = count++;
+
+                state = *next;
+            }
+
+            watch->chain[index] = watch->first[state];
+            watch->first[state] = index;
+            watch->owner[index] = r;
+            watch->literal[index] = *p;
+            index++;
+        }
+    }
+
+    // failure links resolved breadth first, missing transitions
+    // are filled from the failure state, giving a full dfa
+    size_t head = 0, tail = 0;
+
+    fail[0] = 0;
+    watch->dict[0] = 0;
+    watch->output[0] = 0;
+
+    for(size_t c = 0; c < nclasses; c++) {
+        uint32_t *next = &watch->delta[c];
+
+        if(*next == UINT32_MAX) {
+            *next = 0;
+            continue;
+        }
+
+        fail[*next] = 0;
+        queue[tail++] = *next;
+    }
+
+    while(head < tail) {
+        uint32_t state = queue[head++];
+        uint32_t suffix = fail[state];
+
+        watch->dict[state] = (watch->first[suffix] >= 0) ? suffix : watch->dict[suffix];
+        watch->output[state] = (watch->first[state] >= 0) ? state : watch->dict[state];
+
+        for(size_t c = 0; c < nclasses; c++) {
+            uint32_t *next = &watch->delta[state * nclasses + c];
+            uint32_t fallback = watch->delta[suffix * nclasses + c];
+
+            if(*next == UINT32_MAX) {
+                *next = fallback;
+                continue;
+            }
+
+            fail[*next] = fallback;
+            queue[tail++] = *next;
+        }
+    }
+
+    free(fail);
+    free(queue);
+
+    return 0;
+}
+
+static struct json_object *watch_rule_json(watch_rule *rule) {
+    struct json_object *root = json_object_new_object();
+    struct json_object *patterns = json_object_new_array();
+
+    for(char **p = rule->patterns; p && *p; p++)
+        json_object_array_add(patterns, json_object_new_string(*p));
+
+    json_object_object_add(root, "watch", json_object_new_int64(rule->id));
+
+    if(rule->name)
+        json_object_object_add(root, "name", json_object_new_string(rule->name));
+
+    json_object_object_add(root, "patterns", patterns);
+
+    if(rule->expression)
+        json_object_object_add(root, "regex", json_object_new_string(rule->expression));
+
+    json_object_object_add(root, "action", json_object_new_string(watch_action_name(rule->action)));
+    json_object_object_add(root, "once", json_object_new_boolean(rule->once));
+    json_object_object_add(root, "armed", json_object_new_boolean(rule->armed));
+    json_object_object_add(root, "matches", json_object_new_int64(rule->matches));
+
+    return root;
+}
+
+static char *watch_rule_parse(struct json_object *object, watch_rule *rule) {
+    struct json_object *value;
+
+    memset(rule, 0, sizeof(watch_rule));
+    rule->armed = true;
+
+    if(json_object_object_get_ex(object, "name", &value))
+        rule->name = strdup(json_object_get_string(value));
+
+    if(json_object_object_get_ex(object, "patterns", &value)) {
+        if(!json_object_is_type(value, json_type_array))
+            return "invalid patterns";
+
+        size_t length = json_object_array_length(value);
+        rule->patterns = xmalloc(sizeof(char *) * (length + 1));
+        rule->patterns[0] = NULL;
+
+        for(size_t i = 0; i < length; i++) {
+            const char *pattern = json_object_get_string(json_object_array_get_idx(value, i));
+
+            if(!pattern || !*pattern)
+                return "invalid pattern";
+
+            rule->patterns[i] = strdup(pattern);
+            rule->patterns[i + 1] = NULL;
+        }
+    }
+
+    if(json_object_object_get_ex(object, "regex", &value)) {
+        const char *expression = json_object_get_string(value);
+
+        if(!expression || regcomp(&rule->regex, expression, REG_EXTENDED | REG_NOSUB))
+            return "invalid regex";
+
+        rule->expression = strdup(expression);
+    }
+
+    if(!(rule->patterns && rule->patterns[0]) && !rule->expression)
+        return "missing patterns";
+
+    if(json_object_object_get_ex(object, "action", &value))
+        if(watch_action_parse(json_object_get_string(value), &rule->action))
+            return "invalid action";
+
+    if(json_object_object_get_ex(object, "once", &value))
+        rule->once = json_object_get_boolean(value);
+
+    return NULL;
+}
+
+// add a rule to a process, returns the rule id, 0 with error set
+size_t watch_add(struct tty_process *process, struct json_object *object, char **error) {
+    struct tty_watch *watch;
+    watch_rule rule;
+
+    if((*error = watch_rule_parse(object, &rule))) {
+        watch_rule_free(&rule);
+        return 0;
+    }
+
+    pthread_mutex_lock(&process->mutex);
+
+    // created once, released with the process
+    if(!(watch = process->watch)) {
+        watch = xmalloc(sizeof(struct tty_watch));
+        memset(watch, 0, sizeof(struct tty_watch));
+        pthread_mutex_init(&watch->mutex, NULL);
+
+        // only output produced from now on is watched
+        watch->offset = process->logs->written;
+
+        __atomic_store_n(&process->watch, watch, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&process->mutex);
+
+    pthread_mutex_lock(&watch->mutex);
+
+    if(watch->count >= WATCH_RULES_MAX) {
+        pthread_mutex_unlock(&watch->mutex);
+        watch_rule_free(&rule);
+        *error = "too many watch rules";
+        return 0;
+    }
+
+    rule.id = ++watch->next_id;
+    watch->rules = xrealloc(watch->rules, sizeof(watch_rule) * (watch->count + 1));
+    watch->rules[watch->count++] = rule;
+
+    if(rule.expression)
+        watch->regexes++;
+
+    if(watch_compile(watch)) {
+        watch->count--;
+        watch->regexes -= rule.expression ? 1 : 0;
+        watch_compile(watch);
+
+        pthread_mutex_unlock(&watch->mutex);
+        watch_rule_free(&rule);
+        *error = "watch patterns too large";
+        return 0;
+    }
+
+    pthread_mutex_unlock(&watch->mutex);
+
+    verbose("[+] watch: process %lu, rule %lu added\n", process->id, rule.id);
+
+    return rule.id;
+}
+
+int watch_remove(struct tty_process *process, size_t id) {
+    struct tty_watch *watch = __atomic_load_n(&process->watch, __ATOMIC_ACQUIRE);
+
+    if(!watch)
+        return 1;
+
+    pthread_mutex_lock(&watch->mutex);
+
+    for(size_t i = 0; i < watch->count; i++) {
+        if(watch->rules[i].id != id)
+            continue;
+
+        if(watch->rules[i].expression)
+            watch->regexes--;
+
+        watch_rule_free(&watch->rules[i]);
+        memmove(&watch->rules[i], &watch->rules[i + 1], sizeof(watch_rule) * (watch->count - i - 1));
+        watch->count--;
+        watch_compile(watch);
+
+        pthread_mutex_unlock(&watch->mutex);
+        return 0;
+    }
+
+    pthread_mutex_unlock(&watch->mutex);
+
+    return 1;
+}
+
+struct json_object *watch_json(struct tty_process *process) {
+    struct tty_watch *watch = __atomic_load_n(&process->watch, __ATOMIC_ACQUIRE);
+    struct json_object *rules = json_object_new_array();
+
+    if(!watch)
+        return rules;
+
+    pthread_mutex_lock(&watch->mutex);
+
+    for(size_t i = 0; i < watch->count; i++)
+        json_object_array_add(rules, watch_rule_json(&watch->rules[i]));
+
+    pthread_mutex_unlock(&watch->mutex);
+
+    return rules;
+}
+
+void watch_free(struct tty_process *process) {
+    struct tty_watch *watch = process->watch;
+
+    if(!watch)
+        return;
+
+    for(size_t i = 0; i < watch->count; i++)
+        watch_rule_free(&watch->rules[i]);
+
+    watch_automaton_free(watch);
+    pthread_mutex_destroy(&watch->mutex);
+    free(watch->rules);
+    free(watch);
+
+    process->watch = NULL;
+}
+
+// a rule matched, event is emitted and the strongest action
+// requested is kept, watch mutex held
+static void watch_hit(struct tty_process *process, watch_rule *rule, const char *matched, uint64_t offset, watch_action *action) {
+    if(!rule->armed)
+        return;
+
+    rule->matches++;
+
+    if(rule->once)
+        rule->armed = false;
+
+    struct json_object *event = json_object_new_object();
+    json_object_object_add(event, "watch", json_object_new_int64(rule->id));
+
+    if(rule->name)
+        json_object_object_add(event, "name", json_object_new_string(rule->name));
+
+    json_object_object_add(event, "match", json_object_new_string(matched));
+    json_object_object_add(event, "offset", json_object_new_int64(offset));
+    json_object_object_add(event, "action", json_object_new_string(watch_action_name(rule->action)));
+
+    events_emit("watch", process->id, event);
+
+    if(rule->action > *action)
+        *action = rule->action;
+}
+
+static void watch_line(struct tty_process *process, struct tty_watch *watch, uint64_t offset, watch_action *action) {
+    watch->line[watch->line_length] = '\0';
+
+    for(size_t i = 0; i < watch->count; i++) {
+        watch_rule *rule = &watch->rules[i];
+
+        if(!rule->expression || !rule->armed)
+            continue;
+
+        if(regexec(&rule->regex, watch->line, 0, NULL, 0) == 0)
+            watch_hit(process, rule, watch->line, offset, action);
+    }
+
+    watch->line_length = 0;
+}
+
+static void watch_scan(struct tty_process *process, struct tty_watch *watch, const uint8_t *data, size_t length, watch_action *action) {
+    uint32_t state = watch->state;
+    size_t nclasses = watch->nclasses;
+
+    for(size_t i = 0; i < length; i++) {
+        uint8_t c = data[i];
+
+        if(watch->delta) {
+            state = watch->delta[state * nclasses + watch->classes[c]];
+
+            // dictionary links walk every pattern ending here
+            for(uint32_t s = watch->output[state]; s; s = watch->dict[s])
+                for(int32_t p = watch->first[s]; p >= 0; p = watch->chain[p])
+                    watch_hit(process, &watch->rules[watch->owner[p]], watch->literal[p], watch->offset + i + 1 - strlen(watch->literal[p]), action);
+        }
+
+        if(!watch->regexes)
+            continue;
+
+        if(c == '\n' || c == '\r') {
+            if(watch->line_length)
+                watch_line(process, watch, watch->offset + i - watch->line_length, action);
+
+            continue;
+        }
+
+        if(watch->line_length < WATCH_LINE - 1)
+            watch->line[watch->line_length++] = c;
+    }
+
+    watch->state = state;
+    watch->offset += length;
+}
+
+// run watch rules against new process output, called by the pty
+// reader after each commit (only thread feeding this process)
+void watch_feed(struct tty_process *process) {
+    struct tty_watch *watch = __atomic_load_n(&process->watch, __ATOMIC_ACQUIRE);
+    watch_action action = WATCH_NOTIFY;
+    uint8_t chunk[WATCH_CHUNK];
+
+    if(!watch)
+        return;
+
+    pthread_mutex_lock(&watch->mutex);
+
+    while(watch->count) {
+        pthread_mutex_lock(&process->mutex);
+
+        uint64_t first = circular_first(process->logs);
+        uint64_t written = process->logs->written;
+
+        // output overwritten before being scanned, starting over
+        if(watch->offset < first) {
+            watch->offset = first;
+            watch->state = 0;
+            watch->line_length = 0;
+        }
+
+        size_t length = written - watch->offset;
+        if(length > sizeof(chunk))
+            length = sizeof(chunk);
+
+        if(length)
+            length = circular_read(process->logs, watch->offset, (char *) chunk, length);
+
+        pthread_mutex_unlock(&process->mutex);
+
+        if(length == 0)
+            break;
+
+        watch_scan(process, watch, chunk, length, &action);
+    }
+
+    // nothing to watch, just following the logs
+    if(!watch->count)
+        watch->offset = __atomic_load_n(&process->logs->written, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&watch->mutex);
+
+    if(action == WATCH_STOP) {
+        verbose("[+] watch: stopping process %lu\n", process->id);
+        tty_server_process_stop(process);
+    }
+
+    if(action == WATCH_RESTART) {
+        pthread_mutex_lock(&process->mutex);
+
+        // killed, restart policy is bypassed once
+        if(process->running && process->state == RUNNING && !process->restart.requested) {
+            verbose("[+] watch: restarting process %lu\n", process->id);
+            process->restart.requested = true;
+            kill(process->pid, SIGTERM);
+        }
+
+        pthread_mutex_unlock(&process->mutex);
+    }
+}